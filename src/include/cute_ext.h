@@ -0,0 +1,78 @@
+/*
+ * C interface for native extensions of the Cute interpreter.
+ *
+ * '@name' in a script that names no built-in library loads libcute_name.so
+ * from the directories in CUTE_PATH (colon separated, none if unset) or the
+ * system library path, and calls its cute_ext_init. The functions it adds
+ * to the module become fields of the library object and are called like
+ * any closure, directly on the caller's arguments.
+ *
+ * Values are only valid during the call that received them and must not
+ * be kept. Strings returned by get_string are not NUL terminated. The
+ * interpreter keeps extensions loaded until it exits.
+ */
+#ifndef CUTE_EXT_H
+#define CUTE_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CUTE_EXT_VERSION 1
+
+typedef enum cute_type
+{
+    CUTE_NIL, CUTE_INT, CUTE_FLOAT, CUTE_BOOL,
+    CUTE_STRING, CUTE_OBJECT, CUTE_ARRAY, CUTE_CLOSURE
+} cute_type;
+
+/* Opaque, large enough for a value in every build of the interpreter */
+typedef struct cute_value
+{
+    uint64_t opaque[2];
+} cute_value;
+
+typedef struct cute_module cute_module;
+
+/* Stores the return value in result, which starts as null. Returns an
+ * error message that stops the script, NULL on success. The message must
+ * outlive the call, e.g. a string literal. */
+typedef const char * (* cute_function)(const cute_value * args, uint32_t arg_cnt, cute_value * result);
+
+typedef struct cute_api
+{
+    uint32_t version;
+
+    cute_type (* type)(const cute_value * v);
+    int64_t (* get_int)(const cute_value * v);
+    double (* get_float)(const cute_value * v);
+    int (* get_bool)(const cute_value * v);
+    const char * (* get_string)(const cute_value * v, size_t * len);
+    size_t (* array_size)(const cute_value * v);
+    void (* array_get)(const cute_value * v, size_t idx, cute_value * out);
+
+    void (* set_nil)(cute_value * out);
+    void (* set_int)(cute_value * out, int64_t i);
+    void (* set_float)(cute_value * out, double f);
+    void (* set_bool)(cute_value * out, int b);
+    void (* set_string)(cute_value * out, const char * s, size_t len);
+    void (* set_array)(cute_value * out, const cute_value * items, size_t n);
+
+    void (* add_function)(cute_module * m, const char * name, cute_function fn);
+    void (* add_value)(cute_module * m, const char * name, const cute_value * v);
+} cute_api;
+
+/* Exported by the extension. Later versions only add members at the end
+ * of cute_api, so an extension works with any api->version at least the
+ * CUTE_EXT_VERSION it was built with. Returns an error message, NULL on
+ * success. */
+const char * cute_ext_init(const cute_api * api, cute_module * m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
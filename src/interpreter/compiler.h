@@ -0,0 +1,28 @@
+// Compiling source code into scripts, see cute.y
+
+// A compiled script with the code and strings it points to
+struct compiled_script
+{
+    script s; // points into code and strings
+    std::vector<uint8_t> code;
+    std::vector<std::string> strings;
+};
+
+namespace cute
+{
+
+// Compiles source files or text into scripts that any number of vms can
+// run. Compilations on several threads take turns.
+class compiler
+{
+public:
+    bool optimized; // run the bytecode optimizer
+
+    compiler(): optimized(true) {}
+
+    // Both print the errors and return nullptr if the source has any
+    compiled_script * compile_file(const char * path) const;
+    compiled_script * compile(std::string_view source) const;
+};
+
+}
@@ -3,62 +3,104 @@
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <cstdint>
 #include <cstdio>
+#include <mutex>
 #include "types.h"
 #include "vm.h"
+#include "bytecode.h"
+#include "optimizer.h"
+#include "compiler.h"
 
-extern FILE * yyin;
 int yylex();
 void yyerror(const char *);
+void lex_start(FILE * f);
 
 struct bc_segment
 {
-    std::vector<uint8_t> bc;
+    std::vector<bc_instr> bc;
     size_t ref_segment;
-    size_t ref_bc;
+    std::vector<size_t> var_refs; // indices of LOAD and STORE
+    std::unordered_set<std::string> super_names; // names accessed by inner closures
+    bool escapes; // scope object is observable as a whole
+    bool ends_with_return;
 };
 
-std::vector<bc_segment> segments(1);
-size_t current_segment;
-std::vector<std::string> string_pool;
-std::unordered_map<std::string, size_t> string_idx;
+// State of the compilation in progress
+struct compile_state
+{
+    std::vector<bc_segment> segments;
+    size_t current_segment;
+    std::vector<std::string> string_pool;
+    std::unordered_map<std::string, size_t> string_idx;
+    int cache_count;
+
+    compile_state(): segments(1), current_segment(0), cache_count(0) {}
+};
+
+// The generated parser and lexer have global state, so compilations take
+// turns under compile_mutex
+static compile_state * cs;
+static std::mutex compile_mutex;
 
 #define panic(msg) { puts(msg); YYABORT; }
 #define E(f) try { f; } catch (const char * e) { puts(e); YYABORT; }
 
-void C(uint8_t bc)
+void C(uint8_t op, int64_t arg0 = 0, int64_t arg1 = 0)
 {
-    segments[current_segment].bc.push_back(bc);
+    cs->segments[cs->current_segment].bc.push_back({op, {arg0, arg1}});
 }
 
 size_t get_pos()
 {
-    return segments[current_segment].bc.size();
+    return cs->segments[cs->current_segment].bc.size();
 }
 
-void fill_pos(size_t pos, uint8_t bc)
-{
-    segments[current_segment].bc[pos] = bc;
-}
-
-uint8_t get_str_idx(const char * s)
+size_t get_str_idx(const char * s)
 {
     size_t idx;
     std::string str(s);
-    auto p = string_idx.find(str);
-    if (p == string_idx.end())
+    auto p = cs->string_idx.find(str);
+    if (p == cs->string_idx.end())
     {
-        idx = string_pool.size();
-        string_pool.push_back(str);
-        string_idx[str] = idx;
+        idx = cs->string_pool.size();
+        cs->string_pool.push_back(str);
+        cs->string_idx[str] = idx;
     }
     else
     {
         idx = p->second;
     }
-    if (idx >= 256) throw "ERROR: String pool too large (>= 256)";
-    return (uint8_t)idx;
+    return idx;
+}
+
+const std::string & get_str(size_t idx)
+{
+    return cs->string_pool[idx];
+}
+
+// Segment whose scope is seen as super of the given level, nullptr if none
+bc_segment * get_super_segment(int level)
+{
+    size_t idx = cs->current_segment;
+    for (int i = 0; i <= level; i++)
+    {
+        if (idx == 0) return nullptr;
+        idx = cs->segments[idx].ref_segment;
+    }
+    return &cs->segments[idx];
+}
+
+void add_var_ref()
+{
+    cs->segments[cs->current_segment].var_refs.push_back(get_pos());
+}
+
+// Inline cache slot for a field access site
+int new_cache()
+{
+    return cs->cache_count++;
 }
 
 void parse_lv_read(const lval & lv)
@@ -66,16 +108,14 @@ void parse_lv_read(const lval & lv)
     switch (lv.t)
     {
     case lval::VAR:
-        C(LOAD);
-        C(get_str_idx(lv.s));
+        add_var_ref();
+        C(LOAD, get_str_idx(lv.s));
         break;
     case lval::SUPER:
-        C(LOAD_SUPER);
-        C(get_str_idx(lv.s));
+        C(LOAD_SUPER, get_str_idx(lv.s), new_cache());
         break;
     case lval::FIELD:
-        C(LOAD_FIELD);
-        C(get_str_idx(lv.s));
+        C(LOAD_FIELD, get_str_idx(lv.s), new_cache());
         break;
     case lval::ITEM:
         C(LOAD_ITEM);
@@ -89,16 +129,14 @@ void parse_lv_write(const lval & lv)
     switch (lv.t)
     {
     case lval::VAR:
-        C(STORE);
-        C(get_str_idx(lv.s));
+        add_var_ref();
+        C(STORE, get_str_idx(lv.s));
         break;
     case lval::SUPER:
-        C(STORE_SUPER);
-        C(get_str_idx(lv.s));
+        C(STORE_SUPER, get_str_idx(lv.s), new_cache());
         break;
     case lval::FIELD:
-        C(STORE_FIELD);
-        C(get_str_idx(lv.s));
+        C(STORE_FIELD, get_str_idx(lv.s), new_cache());
         break;
     case lval::ITEM:
         C(STORE_ITEM);
@@ -107,88 +145,189 @@ void parse_lv_write(const lval & lv)
     delete[] lv.s;
 }
 
-void parse_param(uint8_t level, const char * s)
+void parse_param(int64_t level, const char * s)
 {
-    C(PUSH_ARG); C(level);
-    C(STORE); C(get_str_idx(s));
+    C(PUSH_ARG, level);
+    add_var_ref();
+    C(STORE, get_str_idx(s));
     delete[] s;
 }
 
-void parse_push_int(int64_t i)
+void parse_push_float(double f)
 {
-    if (i >= INT8_MIN && i <= INT8_MAX)
-    {
-        C(PUSH_BINT);
-        C((int8_t)i);
-    }
-    else if (i >= INT16_MIN && i <= INT16_MAX)
-    {
-        C(PUSH_WINT);
-        uint16_t ii = (int16_t)i;
-        for (int n = 0; n < 2; n++)
-            C((uint8_t)(ii >> (n * 8)));
-    }
-    else if (i >= INT32_MIN && i <= INT32_MAX)
-    {
-        C(PUSH_DWINT);
-        uint32_t ii = (int32_t)i;
-        for (int n = 0; n < 4; n++)
-            C((uint8_t)(ii >> (n * 8)));
-    }
-    else
-    {
-        C(PUSH_INT);
-        uint64_t ii = i;
-        for (int n = 0; n < 8; n++)
-            C((uint8_t)(ii >> (n * 8)));
-    }
+    C(PUSH_FLOAT, *(int64_t *)&f);
 }
 
-void parse_push_float(double f)
+// Point the jump at the given index to the next instruction
+void parse_jump_target(size_t jump)
 {
-    C(PUSH_FLOAT);
-    uint64_t ii = *(uint64_t *)&f;
-    for (int n = 0; n < 8; n++)
-        C((uint8_t)(ii >> (n * 8)));
+    cs->segments[cs->current_segment].bc[jump].arg[0] = get_pos();
 }
 
-void parse_jump_target(size_t from)
+void begin_segment()
 {
-    size_t offset = get_pos() - from;
-    if (offset >= 128) throw "ERROR: Jumping too far (offset >= 128)";
-    fill_pos(from - 1, (uint8_t)offset);
+    C(ENTER, 0);
+}
+
+// Turn variables that can never be observed through the scope object into
+// frame slots. The scope object is observable when it is pushed as a value
+// (PUSH_SELF at the end of the body, PUSH_SUPER from an inner closure), and
+// single names are observable when an inner closure accesses them via '$'.
+void end_segment()
+{
+    bc_segment & seg = cs->segments[cs->current_segment];
+    if (seg.escapes) return;
+    std::unordered_map<std::string, int64_t> slots;
+    for (size_t pos : seg.var_refs)
+    {
+        bc_instr & ins = seg.bc[pos];
+        const std::string & name = cs->string_pool[ins.arg[0]];
+        if (seg.super_names.count(name)) continue;
+        auto p = slots.emplace(name, (int64_t)slots.size()).first;
+        ins.op = ins.op == LOAD ? LOAD_LOCAL : STORE_LOCAL;
+        ins.arg[0] = p->second;
+    }
+    seg.bc[0].arg[0] = slots.size();
 }
 
 void begin_closure()
 {
-    C(PUSH_CLOSURE);
-    size_t ref_bc = get_pos();
-    C(0);
-    size_t idx = segments.size();
-    segments.emplace_back();
-    segments[idx].ref_segment = current_segment;
-    segments[idx].ref_bc = ref_bc;
-    current_segment = idx;
+    size_t idx = cs->segments.size();
+    C(PUSH_CLOSURE, idx);
+    cs->segments.emplace_back();
+    cs->segments[idx].ref_segment = cs->current_segment;
+    cs->current_segment = idx;
+    begin_segment();
 }
 
 void end_closure()
 {
-    current_segment = segments[current_segment].ref_segment;
+    end_segment();
+    cs->current_segment = cs->segments[cs->current_segment].ref_segment;
+}
+
+void end_statement(bool is_return)
+{
+    cs->segments[cs->current_segment].ends_with_return = is_return;
+}
+
+static const int operand_counts[] =
+{
+#define X(op, args, imm) args,
+    CUTE_INSTRUCTIONS(X)
+#undef X
+};
+
+static const int immediate_sizes[] =
+{
+#define X(op, args, imm) imm,
+    CUTE_INSTRUCTIONS(X)
+#undef X
+};
+
+// Smallest PUSH_*INT instruction holding the value
+uint8_t push_int_op(int64_t i)
+{
+    if (i >= INT8_MIN && i <= INT8_MAX) return PUSH_BINT;
+    if (i >= INT16_MIN && i <= INT16_MAX) return PUSH_WINT;
+    if (i >= INT32_MIN && i <= INT32_MAX) return PUSH_DWINT;
+    return PUSH_INT;
 }
 
-std::vector<uint8_t> get_script()
+struct layout
+{
+    std::vector<std::vector<bool>> wide; // per segment and instruction
+    std::vector<std::vector<size_t>> pos; // start of every instruction and end
+};
+
+size_t instr_size(const bc_instr & ins, bool wide)
 {
-    size_t idx = segments[0].bc.size();
-    for (size_t i = 1; i < segments.size(); i++)
+    uint8_t op = ins.op == PUSH_INT ? push_int_op(ins.arg[0]) : ins.op;
+    return wide + 1 + operand_counts[op] * (wide ? 4 : 1) + immediate_sizes[op];
+}
+
+// Operand value as encoded, with jumps relative to the next instruction
+int64_t operand_value(const layout & l, size_t seg, size_t i, int n)
+{
+    const bc_instr & ins = cs->segments[seg].bc[i];
+    if (is_jump(ins.op))
+        return (int64_t)l.pos[seg][ins.arg[0]] - (int64_t)l.pos[seg][i + 1];
+    if (ins.op == PUSH_CLOSURE)
+        return l.pos[ins.arg[0]][0];
+    return ins.arg[n];
+}
+
+bool fits_narrow(uint8_t op, int64_t v)
+{
+    if (is_jump(op))
+        return v >= INT8_MIN && v <= INT8_MAX;
+    return v >= 0 && v <= UINT8_MAX;
+}
+
+void emit_le(std::vector<uint8_t> & script, uint64_t v, int bytes)
+{
+    for (int n = 0; n < bytes; n++)
+        script.push_back((uint8_t)(v >> (n * 8)));
+}
+
+// Encode all segments back to back. Every instruction starts out with one
+// byte operands and gets a WIDE prefix when an operand does not fit. Since
+// widening only moves code further apart, repeating until nothing changes
+// terminates, and short jumps and small indices stay one byte.
+std::vector<uint8_t> get_script(bool optimized)
+{
+    std::vector<bc_segment> & segments = cs->segments;
+    if (optimized)
+        for (bc_segment & seg : segments)
+            optimize(seg.bc);
+    layout l;
+    l.pos.resize(segments.size());
+    for (const bc_segment & seg : segments)
+        l.wide.emplace_back(seg.bc.size());
+    bool changed = true;
+    while (changed)
     {
-        if (idx >= 256) throw "ERROR: Script too long (>= 256)";
-        const bc_segment & seg = segments[i];
-        segments[seg.ref_segment].bc[seg.ref_bc] = (uint8_t)idx;
-        idx += seg.bc.size();
+        size_t addr = 0;
+        for (size_t s = 0; s < segments.size(); s++)
+        {
+            const std::vector<bc_instr> & bc = segments[s].bc;
+            l.pos[s].resize(bc.size() + 1);
+            for (size_t i = 0; i < bc.size(); i++)
+            {
+                l.pos[s][i] = addr;
+                addr += instr_size(bc[i], l.wide[s][i]);
+            }
+            l.pos[s][bc.size()] = addr;
+        }
+        if (addr > INT32_MAX) throw "ERROR: Script too long (> 2^31)";
+        changed = false;
+        for (size_t s = 0; s < segments.size(); s++)
+            for (size_t i = 0; i < segments[s].bc.size(); i++)
+            {
+                uint8_t op = segments[s].bc[i].op;
+                if (l.wide[s][i]) continue;
+                for (int n = 0; n < operand_counts[op]; n++)
+                    if (!fits_narrow(op, operand_value(l, s, i, n)))
+                    {
+                        l.wide[s][i] = true;
+                        changed = true;
+                        break;
+                    }
+            }
     }
     std::vector<uint8_t> script;
-    for (const bc_segment & seg : segments)
-        script.insert(script.end(), seg.bc.begin(), seg.bc.end());
+    for (size_t s = 0; s < segments.size(); s++)
+        for (size_t i = 0; i < segments[s].bc.size(); i++)
+        {
+            const bc_instr & ins = segments[s].bc[i];
+            bool wide = l.wide[s][i];
+            uint8_t op = ins.op == PUSH_INT ? push_int_op(ins.arg[0]) : ins.op;
+            if (wide) script.push_back(WIDE);
+            script.push_back(op);
+            for (int n = 0; n < operand_counts[op]; n++)
+                emit_le(script, operand_value(l, s, i, n), wide ? 4 : 1);
+            emit_le(script, ins.arg[0], immediate_sizes[op]);
+        }
     return script;
 }
 
@@ -231,47 +370,50 @@ std::vector<uint8_t> get_script()
 %left '+' '-'
 %left '*' '/' '%'
 %left OP_POS OP_NEG '!' '~' '#'
+// Calls, indexing and fields bind tighter than prefix operators: -a.b is
+// -(a.b) and &f(x) makes a coroutine of what f returns
+%left '(' '[' '.'
 
 %%
 
-st_list :               { C(PUSH_SELF); C(RETURN); }
+st_list :               {
+                            if (!cs->segments[cs->current_segment].ends_with_return)
+                                cs->segments[cs->current_segment].escapes = true;
+                            C(PUSH_SELF); C(RETURN);
+                        }
         | st st_list
 
 st      : ';'
-        | lv '=' exp ';'    { E(parse_lv_write($1)); }
-        | '>' param_list ';'
-        | '<' exp ';'       { C(RETURN); }
-        | '<' '?' exp ',' cond_return_dummy exp ';' { C(RETURN); E(parse_jump_target($5)); }
-        | ':' loop_dummy exp ';'                    {
-                                                        C(JUMP_IF);
-                                                        size_t offset = get_pos() + 1 - $2;
-                                                        if (offset > 128) throw "ERROR: Jumping too far (offset < -128)";
-                                                        C(-(int8_t)offset);
-                                                    }
-        | OP_SHR lv ';'     { C(IN); E(parse_lv_write($2)); }
-        | OP_SHL exp ';'    { C(OUT); }
-        | exp ';'           { C(POP); }
-
-cond_return_dummy   : { C(JUMP_UNLESS); C(0); $$ = get_pos(); }
+        | lv '=' exp ';'    { E(parse_lv_write($1)); end_statement(false); }
+        | '>' param_list ';'    { end_statement(false); }
+        | '<' exp ';'       { C(RETURN); end_statement(true); }
+        | '<' '?' exp ',' cond_return_dummy exp ';' { C(RETURN); parse_jump_target($5); end_statement(false); }
+        | '<' ':' exp ';'   { C(YIELD); end_statement(false); }
+        | ':' loop_dummy exp ';'                    { C(JUMP_IF, $2); end_statement(false); }
+        | OP_SHR lv ';'     { C(IN); E(parse_lv_write($2)); end_statement(false); }
+        | OP_SHL exp ';'    { C(OUT); end_statement(false); }
+        | exp ';'           { C(POP); end_statement(false); }
+
+cond_return_dummy   : { $$ = get_pos(); C(JUMP_UNLESS); }
 
 loop_dummy          : { $$ = get_pos(); }
 
 param_list  : NAME                  { $$ = 0; E(parse_param(0, $1)); }
             | param_list ',' NAME   {
                                         $$ = $1 + 1;
-                                        if ($$ >= 256) panic("ERROR: Too many parameters (>= 256)");
-                                        E(parse_param((uint8_t)$$, $3));
+                                        E(parse_param($$, $3));
                                     }
 
-exp     : INT_CONST             { parse_push_int($1); }
+exp     : INT_CONST             { C(PUSH_INT, $1); }
         | FLOAT_CONST           { parse_push_float($1); }
-        | STRING_CONST          { C(PUSH_STRING); E(C(get_str_idx($1))); delete[] $1; }
+        | STRING_CONST          { C(PUSH_STRING, get_str_idx($1)); delete[] $1; }
         | lv                    { E(parse_lv_read($1)); }
         | '+' exp %prec OP_POS  { C(POS); }
         | '-' exp %prec OP_NEG  { C(NEG); }
         | '!' exp               { C(NOT); }
         | '~' exp               { C(BINV); }
         | '#' exp               { C(LEN); }
+        | '&' exp %prec OP_POS  { C(NEW_COROUTINE); }
         | exp '+' exp           { C(ADD); }
         | exp '-' exp           { C(SUB); }
         | exp '*' exp           { C(MUL); }
@@ -289,34 +431,39 @@ exp     : INT_CONST             { parse_push_int($1); }
         | exp OP_SHL exp        { C(SHL); }
         | exp OP_SHR exp        { C(SHR); }
         | exp OP_USHR exp       { C(USHR); }
-        | exp OP_OR op_or_dummy exp     { E(parse_jump_target($3)); }
-        | exp OP_AND op_and_dummy exp   { E(parse_jump_target($3)); }
-        | exp '?' op_cond_body ':' exp  { E(parse_jump_target($3)); }
+        | exp OP_OR op_or_dummy exp     { parse_jump_target($3); }
+        | exp OP_AND op_and_dummy exp   { parse_jump_target($3); }
+        | exp '?' op_cond_body ':' exp  { parse_jump_target($3); }
         | '(' exp ')'
-        | exp '(' exp_list ')'              { C(CALL); C((uint8_t)$3); }
-        | '{' closure_begin st_list '}'     { end_closure(); C(CALL); C(0); }
+        | exp '(' exp_list ')'              { C(CALL, $3); }
+        | '{' closure_begin st_list '}'     { end_closure(); C(CALL, 0); }
         | '@' '{' closure_begin st_list '}' { end_closure(); }
-        | '[' exp_list ']'                  { C(NEW_ARRAY); C((uint8_t)$2); }
-        | '@' NAME                          { C(LOAD_LIB); E(C(get_str_idx($2))); delete[] $2; }
+        | '[' exp_list ']'                  { C(NEW_ARRAY, $2); }
+        | '@' NAME                          { C(LOAD_LIB, get_str_idx($2)); delete[] $2; }
 
-op_or_dummy     :   { C(DUP); C(JUMP_IF); C(0); $$ = get_pos(); C(POP); }
+op_or_dummy     :   { C(DUP); $$ = get_pos(); C(JUMP_IF); C(POP); }
 
-op_and_dummy    :   { C(DUP); C(JUMP_UNLESS); C(0); $$ = get_pos(); C(POP); }
+op_and_dummy    :   { C(DUP); $$ = get_pos(); C(JUMP_UNLESS); C(POP); }
 
 op_cond_body    : op_cond_dummy exp {
-                                        C(JUMP); C(0); $$ = get_pos();
-                                        E(parse_jump_target($1));
+                                        $$ = get_pos(); C(JUMP);
+                                        parse_jump_target($1);
                                     }
 
-op_cond_dummy   :   { C(JUMP_UNLESS); C(0); $$ = get_pos(); }
+op_cond_dummy   :   { $$ = get_pos(); C(JUMP_UNLESS); }
 
 lv      : NAME              { $$ = {lval::VAR, $1}; }
         | super_name        {
-                                uint8_t level = (uint8_t)$1.level;
+                                int level = $1.level;
+                                bc_segment * seg = get_super_segment(level);
+                                if (seg)
+                                {
+                                    if (level) seg->escapes = true;
+                                    else seg->super_names.insert($1.s);
+                                }
                                 if (level)
                                 {
-                                    C(PUSH_SUPER);
-                                    C((uint8_t)$1.level);
+                                    C(PUSH_SUPER, level);
                                     $$ = {lval::FIELD, $1.s};
                                 }
                                 else $$ = {lval::SUPER, $1.s};
@@ -325,36 +472,75 @@ lv      : NAME              { $$ = {lval::VAR, $1}; }
         | exp '[' exp ']'   { $$ = {lval::ITEM, nullptr}; }
 
 super_name  : '$' NAME          { $$ = {0, $2}; }
-            | '$' super_name    { $$ = $2; if (++$$.level >= 256) panic("ERROR: Too high level of super (>= 256)"); }
+            | '$' super_name    { $$ = $2; ++$$.level; }
 
 exp_list:                   { $$ = 0; }
         | exp               { $$ = 1; }
-        | exp ',' exp_list  { $$ = $3 + 1; if ($$ >= 256) panic("ERROR: Too many arguments (>= 256)"); }
+        | exp ',' exp_list  { $$ = $3 + 1; }
 
 closure_begin   :   { begin_closure(); }
 %%
 
-int main(int argc, char ** argv)
+static compiled_script * parse(FILE * f, bool optimized)
+{
+    std::lock_guard<std::mutex> lock(compile_mutex);
+    compile_state state;
+    cs = &state;
+    lex_start(f);
+    begin_segment();
+    compiled_script * out = nullptr;
+    if (!yyparse())
+    {
+        end_segment();
+        out = new compiled_script;
+        try { out->code = get_script(optimized); }
+        catch (const char * e)
+        {
+            puts(e);
+            delete out;
+            out = nullptr;
+        }
+    }
+    if (out)
+    {
+        out->strings = std::move(state.string_pool);
+        out->s = {{out->code.data(), out->code.size()}, {out->strings.begin(), out->strings.end()},
+                  state.cache_count, false};
+    }
+    cs = nullptr;
+    return out;
+}
+
+namespace cute
+{
+
+compiled_script * compiler::compile_file(const char * path) const
 {
-    if (argc != 2)
+    FILE * f = fopen(path, "r");
+    if (!f)
     {
-        printf("Usage: %s filename\n", argv[0]);
-        return 1;
+        printf("Failed to read from script file %s\n", path);
+        return nullptr;
     }
-    if (!(yyin = fopen(argv[1], "r")))
+    compiled_script * out = parse(f, optimized);
+    fclose(f);
+    return out;
+}
+
+compiled_script * compiler::compile(std::string_view source) const
+{
+    // An empty view may have no buffer at all
+    FILE * f = fmemopen((void *)(source.empty() ? "" : source.data()), source.size(), "r");
+    if (!f)
     {
-        printf("Failed to read from script file %s\n", argv[1]);
-        return 1;
+        printf("Failed to read script source\n");
+        return nullptr;
     }
-    int rt = yyparse();
-    if (rt) return rt;
-    fclose(yyin);
-    script script;
-    script.string_pool = string_pool;
-    try { script.code = get_script(); } catch (const char * e) { puts(e); return 1; }
-    /* dump_code(script); */
-    run_script(script);
-    return 0;
+    compiled_script * out = parse(f, optimized);
+    fclose(f);
+    return out;
+}
+
 }
 
 void yyerror(const char * s)
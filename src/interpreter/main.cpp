@@ -0,0 +1,115 @@
+#include <cstdio>
+#include <cstdlib>
+#include "vm.h"
+#include "bytecode.h"
+#include "compiler.h"
+#include "runner.h"
+
+// Scripts and the compiled or mapped files owning them
+struct loaded_scripts
+{
+    std::vector<const script *> scripts;
+    std::vector<compiled_script *> compiled;
+    std::vector<mapped_script *> mapped;
+
+    ~loaded_scripts()
+    {
+        for (compiled_script * cs : compiled) delete cs;
+        for (mapped_script * ms : mapped) delete ms;
+    }
+    // Prints the error and returns false if the file cannot be loaded
+    bool load(const char * filename, const cute::compiler & compiler)
+    {
+        if (is_bytecode_file(filename))
+        {
+            mapped_script * ms = load_script(filename);
+            if (!ms) return false;
+            mapped.push_back(ms);
+            scripts.push_back(&ms->s);
+            return true;
+        }
+        compiled_script * cs = compiler.compile_file(filename);
+        if (!cs) return false;
+        compiled.push_back(cs);
+        scripts.push_back(&cs->s);
+        return true;
+    }
+};
+
+// Run every script runs times on threads threads, returns the exit code
+static int run_batch(const loaded_scripts & loaded, int runs, int threads, bool jit)
+{
+    std::vector<const script *> jobs;
+    for (int i = 0; i < runs; i++)
+        jobs.insert(jobs.end(), loaded.scripts.begin(), loaded.scripts.end());
+    return cute::run_parallel(jobs, threads, jit) ? 1 : 0;
+}
+
+int main(int argc, char ** argv)
+{
+    bool optimized = true; // -O0 turns off the bytecode optimizer
+    bool dump = false; // -d prints the bytecode instead of running it
+    bool compile = false; // -c writes the bytecode to a file
+    bool jit = false; // --jit compiles hot closures to machine code
+    int threads = -1; // -j runs all the scripts on this many threads, 0 for all cores
+    int runs = 1; // -n runs every script this many times, with -j
+    std::vector<const char *> filenames;
+    std::string output;
+    bool usage = false;
+    for (int i = 1; i < argc && !usage; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-O0") optimized = false;
+        else if (arg == "-d") dump = true;
+        else if (arg == "-c") compile = true;
+        else if (arg == "--jit") jit = true;
+        else if (arg == "-o" && i + 1 < argc) output = argv[++i];
+        else if (arg == "-j" && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (arg == "-n" && i + 1 < argc) runs = atoi(argv[++i]);
+        else if (arg[0] == '-') usage = true;
+        else filenames.push_back(argv[i]);
+    }
+    bool batch = threads >= 0;
+    if (batch ? compile || dump || runs < 1 || filenames.empty() : runs != 1 || filenames.size() != 1)
+        usage = true;
+    if (usage)
+    {
+        printf("Usage: %s [-O0] [-d] [--jit] filename\n", argv[0]);
+        printf("       %s -c [-O0] filename [-o output]\n", argv[0]);
+        printf("       %s -j threads [-n runs] [-O0] [--jit] filename...\n", argv[0]);
+        return 1;
+    }
+    cute::compiler compiler;
+    compiler.optimized = optimized;
+    if (batch)
+    {
+        loaded_scripts loaded;
+        for (const char * filename : filenames)
+            if (!loaded.load(filename, compiler)) return 1;
+        return run_batch(loaded, runs, threads, jit);
+    }
+    const char * filename = filenames[0];
+    if (!compile && is_bytecode_file(filename))
+    {
+        mapped_script * ms = load_script(filename);
+        if (!ms) return 1;
+        if (dump) dump_code(ms->s);
+        else cute::vm().run(ms->s, jit);
+        delete ms;
+        return 0;
+    }
+    compiled_script * cs = compiler.compile_file(filename);
+    if (!cs) return 1;
+    int rt = 0;
+    if (compile)
+    {
+        if (output.empty()) output = std::string(filename) + "c";
+        rt = save_script(cs->s, output.c_str()) ? 0 : 1;
+    }
+    else if (dump)
+        dump_code(cs->s);
+    else
+        cute::vm().run(cs->s, jit);
+    delete cs;
+    return rt;
+}
@@ -0,0 +1,314 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "types.h"
+#include "vm.h"
+#include "optimizer.h"
+
+bool is_jump(uint8_t op)
+{
+    switch (op)
+    {
+    case JUMP:
+    case JUMP_IF:
+    case JUMP_UNLESS:
+    case JUMP_UNLESS_EQ:
+    case JUMP_UNLESS_NE:
+    case JUMP_UNLESS_GT:
+    case JUMP_UNLESS_LT:
+    case JUMP_UNLESS_GE:
+    case JUMP_UNLESS_LE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static std::vector<bool> find_labels(const std::vector<bc_instr> & bc)
+{
+    std::vector<bool> labels(bc.size() + 1);
+    for (const bc_instr & ins : bc)
+        if (is_jump(ins.op))
+            labels[ins.arg[0]] = true;
+    return labels;
+}
+
+// Drop removed instructions, a jump to one of them goes to the next
+// instruction that is kept
+static void compact(std::vector<bc_instr> & bc, const std::vector<bool> & removed)
+{
+    std::vector<size_t> index(bc.size() + 1);
+    size_t kept = 0;
+    for (size_t i = 0; i < bc.size(); i++)
+    {
+        index[i] = kept;
+        if (!removed[i]) kept++;
+    }
+    index[bc.size()] = kept;
+    size_t out = 0;
+    for (size_t i = 0; i < bc.size(); i++)
+    {
+        if (removed[i]) continue;
+        bc_instr ins = bc[i];
+        if (is_jump(ins.op))
+            ins.arg[0] = index[ins.arg[0]];
+        bc[out++] = ins;
+    }
+    bc.resize(out);
+}
+
+// The instructions kept so far while scanning a segment. Rules rewrite the
+// last few of them, which is only allowed when no jump lands inside.
+struct window
+{
+    std::vector<bc_instr> & bc;
+    std::vector<bool> labels;
+    std::vector<bool> removed;
+    std::vector<size_t> kept;
+
+    window(std::vector<bc_instr> & bc): bc(bc), labels(find_labels(bc)), removed(bc.size()) {}
+
+    // Whether the last n instructions can be merged, only the first of them
+    // may be a jump target
+    bool mergeable(size_t n) const
+    {
+        if (kept.size() < n) return false;
+        for (size_t i = 0; i + 1 < n; i++)
+            if (labels[kept[kept.size() - 1 - i]]) return false;
+        return true;
+    }
+
+    // The n-th instruction from the end, 0 is the last one
+    bc_instr & back(size_t n)
+    {
+        return bc[kept[kept.size() - 1 - n]];
+    }
+
+    void drop(size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            removed[kept.back()] = true;
+            kept.pop_back();
+        }
+    }
+};
+
+static void peephole(std::vector<bc_instr> & bc, bool (*rule)(window &))
+{
+    window w(bc);
+    for (size_t i = 0; i < bc.size(); i++)
+    {
+        w.kept.push_back(i);
+        while (rule(w));
+    }
+    compact(bc, w.removed);
+}
+
+static bool is_const(const bc_instr & ins)
+{
+    return ins.op == PUSH_INT || ins.op == PUSH_FLOAT || ins.op == PUSH_STRING;
+}
+
+static bc_instr push_float(double f)
+{
+    return {PUSH_FLOAT, {*(int64_t *)&f}};
+}
+
+// Same results as the VM, operations that would fail or are undefined at
+// run time are left alone so they still report the error there
+static bool fold_unary(uint8_t op, const bc_instr & a, bc_instr & r)
+{
+    if (a.op == PUSH_INT)
+    {
+        uint64_t i = a.arg[0];
+        switch (op)
+        {
+        case POS: r = {PUSH_INT, {(int64_t)i}}; return true;
+        case NEG: r = {PUSH_INT, {(int64_t)-i}}; return true;
+        case BINV: r = {PUSH_INT, {(int64_t)~i}}; return true;
+        }
+    }
+    else if (a.op == PUSH_FLOAT)
+    {
+        double f = *(double *)&a.arg[0];
+        switch (op)
+        {
+        case POS: r = push_float(f); return true;
+        case NEG: r = push_float(-f); return true;
+        }
+    }
+    else if (op == LEN)
+    {
+        r = {PUSH_INT, {(int64_t)get_str(a.arg[0]).size()}};
+        return true;
+    }
+    return false;
+}
+
+static bool fold_binary(uint8_t op, const bc_instr & a, const bc_instr & b, bc_instr & r)
+{
+    if (a.op != b.op) return false;
+    if (a.op == PUSH_INT)
+    {
+        int64_t i1 = a.arg[0], i2 = b.arg[0];
+        uint64_t u1 = i1, u2 = i2;
+        bool div_ok = i2 != 0 && !(i1 == INT64_MIN && i2 == -1);
+        bool shift_ok = i2 >= 0 && i2 < 64;
+        int64_t i;
+        switch (op)
+        {
+        case ADD: i = u1 + u2; break;
+        case SUB: i = u1 - u2; break;
+        case MUL: i = u1 * u2; break;
+        case DIV: if (!div_ok) return false; i = i1 / i2; break;
+        case REM: if (!div_ok) return false; i = i1 % i2; break;
+        case BAND: i = i1 & i2; break;
+        case BOR: i = i1 | i2; break;
+        case BXOR: i = i1 ^ i2; break;
+        case SHL: if (!shift_ok) return false; i = u1 << i2; break;
+        case SHR: if (!shift_ok) return false; i = i1 >> i2; break;
+        case USHR: if (!shift_ok) return false; i = u1 >> i2; break;
+        default: return false;
+        }
+        r = {PUSH_INT, {i}};
+        return true;
+    }
+    if (a.op == PUSH_FLOAT)
+    {
+        double f1 = *(double *)&a.arg[0], f2 = *(double *)&b.arg[0];
+        switch (op)
+        {
+        case ADD: r = push_float(f1 + f2); return true;
+        case SUB: r = push_float(f1 - f2); return true;
+        case MUL: r = push_float(f1 * f2); return true;
+        case DIV: r = push_float(f1 / f2); return true;
+        default: return false;
+        }
+    }
+    if (op == ADD)
+    {
+        std::string s = get_str(a.arg[0]) + get_str(b.arg[0]);
+        r = {PUSH_STRING, {(int64_t)get_str_idx(s.c_str())}};
+        return true;
+    }
+    return false;
+}
+
+static bool fold_constants(window & w)
+{
+    bc_instr r;
+    if (w.mergeable(3) && is_const(w.back(2)) && is_const(w.back(1))
+        && fold_binary(w.back(0).op, w.back(2), w.back(1), r))
+    {
+        w.back(2) = r;
+        w.drop(2);
+        return true;
+    }
+    if (w.mergeable(2) && is_const(w.back(1)) && fold_unary(w.back(0).op, w.back(1), r))
+    {
+        w.back(1) = r;
+        w.drop(1);
+        return true;
+    }
+    return false;
+}
+
+static bool fuse_instructions(window & w)
+{
+    if (!w.mergeable(2)) return false;
+    bc_instr & a = w.back(1);
+    const bc_instr & b = w.back(0);
+    if (a.op == LOAD_LOCAL && b.op == LOAD_FIELD)
+        a = {LOAD_LOCAL_FIELD, {a.arg[0], b.arg[0], b.arg[1]}};
+    else if (a.op == PUSH_INT && a.arg[0] >= INT8_MIN && a.arg[0] <= INT8_MAX && b.op == ADD)
+        a = {ADD_BINT, {a.arg[0]}};
+    else if (a.op >= CMP_EQ && a.op <= CMP_LE && b.op == JUMP_UNLESS)
+        a = {(uint8_t)(JUMP_UNLESS_EQ + (a.op - CMP_EQ)), {b.arg[0]}};
+    else
+        return false;
+    w.drop(1);
+    return true;
+}
+
+// Shorten paths through jumps. Besides following jump chains, this turns
+// the value test of '||' and '&&' (DUP, conditional jump, POP) into a single
+// jump when the value is tested again at the target.
+static bool thread_jumps(std::vector<bc_instr> & bc)
+{
+    std::vector<bool> labels = find_labels(bc);
+    std::vector<bool> removed(bc.size());
+    bool changed = false;
+    for (size_t i = 0; i < bc.size(); i++)
+    {
+        bc_instr & ins = bc[i];
+        if (ins.op != JUMP && ins.op != JUMP_IF && ins.op != JUMP_UNLESS) continue;
+        for (int n = 0; n < 16 && bc[ins.arg[0]].op == JUMP && bc[ins.arg[0]].arg[0] != ins.arg[0]; n++)
+        {
+            ins.arg[0] = bc[ins.arg[0]].arg[0];
+            changed = true;
+        }
+        size_t t = ins.arg[0];
+        if (ins.op == JUMP)
+        {
+            if (bc[t].op == RETURN)
+            {
+                ins = {RETURN};
+                changed = true;
+            }
+            else if (t == i + 1)
+            {
+                removed[i] = true;
+                changed = true;
+            }
+            continue;
+        }
+        bool tested = i > 0 && bc[i - 1].op == DUP && !removed[i - 1] && !labels[i];
+        if (!tested) continue;
+        if (bc[t].op == DUP && bc[t + 1].op == ins.op && !removed[t])
+        {
+            ins.arg[0] = bc[t + 1].arg[0];
+            changed = true;
+        }
+        else if ((bc[t].op == JUMP_IF || bc[t].op == JUMP_UNLESS) && t != i
+                 && bc[i + 1].op == POP && !labels[i + 1])
+        {
+            ins.arg[0] = bc[t].op == ins.op ? bc[t].arg[0] : t + 1;
+            removed[i - 1] = removed[i + 1] = true;
+            changed = true;
+        }
+    }
+    compact(bc, removed);
+    return changed;
+}
+
+static bool remove_unreachable(std::vector<bc_instr> & bc)
+{
+    std::vector<bool> removed(bc.size(), true);
+    std::vector<size_t> work = {0};
+    while (!work.empty())
+    {
+        size_t i = work.back();
+        work.pop_back();
+        if (i >= bc.size() || !removed[i]) continue;
+        removed[i] = false;
+        if (is_jump(bc[i].op))
+            work.push_back(bc[i].arg[0]);
+        if (bc[i].op != JUMP && bc[i].op != RETURN)
+            work.push_back(i + 1);
+    }
+    for (bool r : removed)
+        if (r)
+        {
+            compact(bc, removed);
+            return true;
+        }
+    return false;
+}
+
+void optimize(std::vector<bc_instr> & bc)
+{
+    peephole(bc, fold_constants);
+    while (thread_jumps(bc) | remove_unreachable(bc));
+    peephole(bc, fuse_instructions);
+}
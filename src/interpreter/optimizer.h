@@ -0,0 +1,6 @@
+// Provided by the parser
+const std::string & get_str(size_t idx);
+size_t get_str_idx(const char * s);
+
+bool is_jump(uint8_t op);
+void optimize(std::vector<bc_instr> & bc);
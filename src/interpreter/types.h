@@ -1,3 +1,5 @@
+#include <cstdint>
+
 struct lval
 {
     enum type {VAR, SUPER, FIELD, ITEM};
@@ -10,3 +12,12 @@ struct super
     int level;
     char * s;
 };
+
+// Instruction before encoding. Operands are kept at full width, jumps refer
+// to instruction indices and PUSH_CLOSURE to a segment, get_script() picks
+// the byte encoding once the whole program is known.
+struct bc_instr
+{
+    uint8_t op;
+    int64_t arg[3];
+};
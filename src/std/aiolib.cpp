@@ -0,0 +1,238 @@
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "vm.h"
+#include "gc.h"
+#include "loop.h"
+#include "aiolib.h"
+
+// Descriptors are plain ints. Those made here are non-blocking, so that a
+// read or write that cannot go on suspends the task running it until epoll
+// reports the descriptor ready, while other tasks run. Outside of tasks
+// the same calls block. See loop.h.
+
+const size_t read_max = 64 << 10;
+
+static bool get_fd(const type_and_value * args, uint32_t arg_cnt, int & fd)
+{
+    if (arg_cnt < 1 || args[0].t() != INT)
+        return false;
+    fd = args[0].i();
+    return true;
+}
+
+// Unix socket address of path, false if path does not fit
+static bool unix_address(const type_and_value & path, sockaddr_un & addr)
+{
+    std::string_view p = path.s()->value.data();
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    if (p.empty() || p.size() >= sizeof(addr.sun_path) || p.find('\0') != std::string_view::npos)
+        return false;
+    memcpy(addr.sun_path, p.data(), p.size());
+    return true;
+}
+
+// @aio.spawn(fn, args...): runs fn(args...) as a task of the event loop,
+// once the script body returns or the running task suspends. fn is a
+// closure or a coroutine that was not started. Returns the task.
+static const char * lib_spawn(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1 || args[0].t() != CLOSURE || args[0].c()->value.native)
+        return "aio.spawn expects a closure";
+    result = args[0].c()->value.s ? new_coroutine(args[0]) : args[0];
+    type_and_value task_args = nil_value();
+    if (arg_cnt > 1)
+        task_args = new_array(args + 1, args + arg_cnt);
+    loop_spawn(result, task_args);
+    return nullptr;
+}
+
+// @aio.pipe(): [read end, write end], null on failure
+static const char * lib_pipe(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC))
+        return nullptr;
+    type_and_value ends[2] = {int_value(fds[0]), int_value(fds[1])};
+    result = new_array(ends, ends + 2);
+    return nullptr;
+}
+
+// @aio.listen(path): Unix socket listening at path, null on failure
+static const char * lib_listen(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1 || args[0].t() != STRING)
+        return "aio.listen expects a path";
+    sockaddr_un addr;
+    if (!unix_address(args[0], addr))
+        return nullptr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return nullptr;
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN))
+    {
+        close(fd);
+        return nullptr;
+    }
+    result = int_value(fd);
+    return nullptr;
+}
+
+// @aio.accept(fd): next connection to the listening socket fd, null on
+// failure
+static const char * lib_accept(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    int fd;
+    if (!get_fd(args, arg_cnt, fd))
+        return "aio.accept expects a descriptor";
+    while (1)
+    {
+        int conn = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn >= 0)
+        {
+            result = int_value(conn);
+            return nullptr;
+        }
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return nullptr;
+        if (const char * err = loop_wait(fd, EPOLLIN))
+            return err;
+    }
+}
+
+// @aio.connect(path): socket connected to the Unix socket at path, null on
+// failure, including when its backlog is full
+static const char * lib_connect(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1 || args[0].t() != STRING)
+        return "aio.connect expects a path";
+    sockaddr_un addr;
+    if (!unix_address(args[0], addr))
+        return nullptr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return nullptr;
+    int rc;
+    while ((rc = connect(fd, (sockaddr *)&addr, sizeof(addr))) && errno == EINTR) {}
+    if (rc)
+    {
+        close(fd);
+        return nullptr;
+    }
+    result = int_value(fd);
+    return nullptr;
+}
+
+// @aio.read(fd[, max]): up to max bytes (64K by default), as soon as there
+// are any. null at the end of input or on failure.
+static const char * lib_read(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    int fd;
+    if (!get_fd(args, arg_cnt, fd))
+        return "aio.read expects a descriptor";
+    size_t max = read_max;
+    if (arg_cnt > 1)
+    {
+        if (args[1].t() != INT || args[1].i() <= 0)
+            return "aio.read expects a positive size";
+        max = std::min((size_t)args[1].i(), read_max);
+    }
+    char buf[read_max];
+    while (1)
+    {
+        ssize_t n = read(fd, buf, max);
+        if (n > 0)
+        {
+            result = new_string({buf, (size_t)n});
+            return nullptr;
+        }
+        if (n == 0)
+            return nullptr;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return nullptr;
+        if (const char * err = loop_wait(fd, EPOLLIN))
+            return err;
+    }
+}
+
+// @aio.write(fd, s): writes all of s, false on failure
+static const char * lib_write(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    int fd;
+    if (!get_fd(args, arg_cnt, fd) || arg_cnt < 2 || args[1].t() != STRING)
+        return "aio.write expects a descriptor and a string";
+    // A closed reader must fail the write rather than end the process
+    static const bool no_sigpipe = signal(SIGPIPE, SIG_IGN) != SIG_ERR;
+    (void)no_sigpipe;
+    std::string_view s = args[1].s()->value.data();
+    // What an earlier call of a suspended task wrote already
+    std::unordered_map<int, size_t> & written = loop_current->written;
+    auto p = written.find(fd);
+    size_t pos = p == written.end() ? 0 : p->second;
+    while (pos < s.size())
+    {
+        ssize_t n = write(fd, s.data() + pos, s.size() - pos);
+        if (n >= 0)
+        {
+            pos += n;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            break;
+        const char * err = loop_wait(fd, EPOLLOUT);
+        if (err == native_suspend)
+            written[fd] = pos;
+        if (err)
+            return err;
+    }
+    written.erase(fd);
+    result = bool_value(pos == s.size());
+    return nullptr;
+}
+
+// @aio.close(fd): tasks waiting on fd go on and fail
+static const char * lib_close(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    int fd;
+    if (!get_fd(args, arg_cnt, fd))
+        return "aio.close expects a descriptor";
+    loop_forget(fd);
+    close(fd);
+    return nullptr;
+}
+
+// @aio.sleep(ms): lets other tasks run for ms milliseconds
+static const char * lib_sleep(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1 || args[0].t() != INT && args[0].t() != FLOAT)
+        return "aio.sleep expects a number of milliseconds";
+    double ms = args[0].t() == INT ? args[0].i() : args[0].f();
+    return loop_sleep(std::max(ms, 0.0));
+}
+
+void load_aio(obj_def & libs)
+{
+    type_and_value aio = new_empty_object();
+    obj_def & od = aio.o()->value;
+    od.set("spawn", new_native(lib_spawn));
+    od.set("pipe", new_native(lib_pipe));
+    od.set("listen", new_native(lib_listen));
+    od.set("accept", new_native(lib_accept));
+    od.set("connect", new_native(lib_connect));
+    od.set("read", new_native(lib_read));
+    od.set("write", new_native(lib_write));
+    od.set("close", new_native(lib_close));
+    od.set("sleep", new_native(lib_sleep));
+    libs.set("aio", aio);
+}
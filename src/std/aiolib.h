@@ -0,0 +1 @@
+void load_aio(obj_def & libs);
@@ -0,0 +1,188 @@
+#include "vm.h"
+#include "gc.h"
+#include "array.h"
+#include "arrlib.h"
+
+static bool array_arg(const type_and_value * args, uint32_t arg_cnt, uint32_t idx, arr *& a)
+{
+    if (idx >= arg_cnt || args[idx].t() != ARRAY) return false;
+    a = args[idx].a();
+    return true;
+}
+
+static bool size_arg(const type_and_value * args, uint32_t arg_cnt, uint32_t idx, size_t & n)
+{
+    if (idx >= arg_cnt || args[idx].t() != INT || args[idx].i() < 0) return false;
+    n = args[idx].i();
+    return true;
+}
+
+// arr.new(n[, v]): array of n elements, all v or null
+static const char * arr_new(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    size_t n;
+    if (!size_arg(args, arg_cnt, 0, n))
+        return "arr.new expects a size";
+    type_and_value tv = arg_cnt > 1 ? args[1] : nil_value();
+    result = new_array(nullptr, nullptr);
+    result.a()->value.resize(n, tv);
+    gc_account(n * sizeof(type_and_value));
+    return nullptr;
+}
+
+// arr.push(a, v...): append the values
+static const char * arr_push(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    if (!array_arg(args, arg_cnt, 0, a))
+        return "arr.push expects an array";
+    for (uint32_t i = 1; i < arg_cnt; i++)
+    {
+        a->value.push(args[i]);
+        gc_write_barrier(a, args[i]);
+        gc_account(sizeof(type_and_value));
+    }
+    return nullptr;
+}
+
+// arr.pop(a): remove and return the last element, null if a is empty
+static const char * arr_pop(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    if (!array_arg(args, arg_cnt, 0, a))
+        return "arr.pop expects an array";
+    result = a->value.pop();
+    return nullptr;
+}
+
+// arr.resize(a, n[, v]): grow or shrink a to n elements, new ones are v
+static const char * arr_resize(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    size_t n;
+    if (!array_arg(args, arg_cnt, 0, a) || !size_arg(args, arg_cnt, 1, n))
+        return "arr.resize expects an array and a size";
+    type_and_value tv = arg_cnt > 2 ? args[2] : nil_value();
+    if (n > a->value.size())
+        gc_account((n - a->value.size()) * sizeof(type_and_value));
+    a->value.resize(n, tv);
+    gc_write_barrier(a, tv);
+    return nullptr;
+}
+
+// arr.slice(a, start[, len]): new array of the elements from start, out of
+// range positions are clamped
+static const char * arr_slice(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    size_t start, len;
+    if (!array_arg(args, arg_cnt, 0, a) || !size_arg(args, arg_cnt, 1, start))
+        return "arr.slice expects an array and a start index";
+    const arr_def & src = a->value;
+    size_t n = src.size();
+    start = std::min(start, n);
+    len = n - start;
+    if (arg_cnt > 2 && !size_arg(args, arg_cnt, 2, len))
+        return "arr.slice expects a length";
+    len = std::min(len, n - start);
+    result = new_array(nullptr, nullptr);
+    arr_def & dst = result.a()->value;
+    dst.kind = len ? src.kind : arr_def::INTS;
+    switch (dst.kind)
+    {
+    case arr_def::INTS:
+        dst.ints.assign(src.ints.begin() + start, src.ints.begin() + start + len);
+        break;
+    case arr_def::FLOATS:
+        dst.floats.assign(src.floats.begin() + start, src.floats.begin() + start + len);
+        break;
+    case arr_def::BOOLS:
+        dst.bools.assign(src.bools.begin() + start, src.bools.begin() + start + len);
+        break;
+    case arr_def::VALUES:
+        dst.values.assign(src.values.begin() + start, src.values.begin() + start + len);
+        break;
+    }
+    return nullptr;
+}
+
+// arr.sum(a), arr.min(a), arr.max(a), arr.dot(a, b): reductions over arrays
+// of ints or of floats
+static const char * arr_sum(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    if (!array_arg(args, arg_cnt, 0, a))
+        return "arr.sum expects an array";
+    return array_sum(a->value, result);
+}
+
+static const char * arr_min(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    if (!array_arg(args, arg_cnt, 0, a))
+        return "arr.min expects an array";
+    return array_min(a->value, result);
+}
+
+static const char * arr_max(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    if (!array_arg(args, arg_cnt, 0, a))
+        return "arr.max expects an array";
+    return array_max(a->value, result);
+}
+
+static const char * arr_dot(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a, * b;
+    if (!array_arg(args, arg_cnt, 0, a) || !array_arg(args, arg_cnt, 1, b))
+        return "arr.dot expects two arrays";
+    return array_dot(a->value, b->value, result);
+}
+
+// arr.scale(a, f): multiply every element by f in place
+static const char * arr_scale(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    if (!array_arg(args, arg_cnt, 0, a) || arg_cnt < 2)
+        return "arr.scale expects an array and a factor";
+    return array_scale(a, args[1]);
+}
+
+// arr.fill(a, v): set every element to v
+static const char * arr_fill(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * a;
+    if (!array_arg(args, arg_cnt, 0, a) || arg_cnt < 2)
+        return "arr.fill expects an array and a value";
+    array_fill(a, args[1]);
+    return nullptr;
+}
+
+// arr.copy(dst, src): overwrite the start of dst with the elements of src
+static const char * arr_copy(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    arr * dst, * src;
+    if (!array_arg(args, arg_cnt, 0, dst) || !array_arg(args, arg_cnt, 1, src))
+        return "arr.copy expects two arrays";
+    return array_copy(dst, src->value);
+}
+
+void load_arr(obj_def & libs)
+{
+    type_and_value lib = new_empty_object();
+    obj_def & od = lib.o()->value;
+    od.set("new", new_native(arr_new));
+    od.set("push", new_native(arr_push));
+    od.set("pop", new_native(arr_pop));
+    od.set("resize", new_native(arr_resize));
+    od.set("slice", new_native(arr_slice));
+    od.set("sum", new_native(arr_sum));
+    od.set("min", new_native(arr_min));
+    od.set("max", new_native(arr_max));
+    od.set("dot", new_native(arr_dot));
+    od.set("scale", new_native(arr_scale));
+    od.set("fill", new_native(arr_fill));
+    od.set("copy", new_native(arr_copy));
+    libs.set("arr", lib);
+}
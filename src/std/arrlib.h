@@ -0,0 +1 @@
+void load_arr(obj_def & libs);
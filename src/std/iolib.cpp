@@ -0,0 +1,120 @@
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "vm.h"
+#include "gc.h"
+#include "io.h"
+#include "iolib.h"
+
+// A file mapped read-only into memory, unmapped once collected. Strings
+// read from it are slices of the mapping that keep it alive.
+struct mapped_file_def
+{
+    const char * addr;
+    size_t size;
+    size_t pos; // start of the next record
+    std::string sep; // empty to read lines
+    mapped_file_def(const char * addr, size_t size, std::string sep):
+        addr(addr), size(size), pos(0), sep(sep) {}
+    ~mapped_file_def()
+    {
+        if (addr) munmap((void *)addr, size);
+    }
+};
+
+typedef gc_obj<mapped_file_def> mapped_file;
+
+// nullptr if the file cannot be read
+static mapped_file * map_file(const type_and_value & path, const std::string & sep)
+{
+    int fd = open(std::string(path.s()->value.data()).c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void * addr = nullptr;
+    bool ok = !fstat(fd, &st) && S_ISREG(st.st_mode);
+    if (ok && st.st_size > 0)
+    {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            ok = false;
+        else
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (!ok) return nullptr;
+    return new_obj<mapped_file_def>((const char *)addr, (size_t)st.st_size, sep);
+}
+
+// reader.next(): the next record, null after the last one
+static const char * reader_next(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    mapped_file * f = (mapped_file *)fn.data;
+    mapped_file_def & mf = f->value;
+    if (mf.pos >= mf.size) return nullptr;
+    std::string_view rest(mf.addr + mf.pos, mf.size - mf.pos);
+    size_t end = mf.sep.empty() ? rest.find('\n') : rest.find(mf.sep);
+    std::string_view record = rest.substr(0, end);
+    if (end == std::string_view::npos)
+        mf.pos = mf.size;
+    else
+        mf.pos += end + (mf.sep.empty() ? 1 : mf.sep.size());
+    if (mf.sep.empty() && !record.empty() && record.back() == '\r')
+        record.remove_suffix(1);
+    result = new_string_slice(f, record);
+    return nullptr;
+}
+
+// @io.open(path[, separator]): a reader over the records of the file, split
+// at separator or into lines without their line breaks. null if the file
+// cannot be read.
+static const char * lib_open(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1 || args[0].t() != STRING)
+        return "io.open expects a file name";
+    std::string sep;
+    if (arg_cnt > 1)
+    {
+        if (args[1].t() != STRING || !args[1].s()->value.size())
+            return "io.open expects a non-empty separator";
+        sep = args[1].s()->value.data();
+    }
+    mapped_file * f = map_file(args[0], sep);
+    if (!f) return nullptr;
+    result = new_empty_object();
+    obj_def & reader = result.o()->value;
+    reader.set("next", new_native(reader_next, f));
+    reader.set("size", int_value(f->value.size));
+    return nullptr;
+}
+
+// @io.read(path): the whole file as one string, null if it cannot be read
+static const char * lib_read(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1 || args[0].t() != STRING)
+        return "io.read expects a file name";
+    mapped_file * f = map_file(args[0], "");
+    if (f)
+        result = new_string_slice(f, {f->value.addr, f->value.size});
+    return nullptr;
+}
+
+// @io.read_line(): the next line of stdin, null at the end of input
+static const char * lib_read_line(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view line;
+    if (io_read_line(line))
+        result = new_string(line);
+    return nullptr;
+}
+
+void load_io(obj_def & libs)
+{
+    type_and_value io = new_empty_object();
+    obj_def & od = io.o()->value;
+    od.set("open", new_native(lib_open));
+    od.set("read", new_native(lib_read));
+    od.set("read_line", new_native(lib_read_line));
+    libs.set("io", io);
+}
@@ -0,0 +1 @@
+void load_io(obj_def & libs);
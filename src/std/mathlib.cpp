@@ -0,0 +1,171 @@
+#include <cmath>
+#include "vm.h"
+#include "mathlib.h"
+
+static bool number_arg(const type_and_value * args, uint32_t arg_cnt, uint32_t idx, double & x)
+{
+    if (idx >= arg_cnt) return false;
+    switch (args[idx].t())
+    {
+    case INT: x = args[idx].i(); return true;
+    case FLOAT: x = args[idx].f(); return true;
+    default: return false;
+    }
+}
+
+// Functions of one number, ints are taken as floats
+#define CUTE_MATH_UNARY(X) \
+    X(sqrt) X(exp) X(log) X(log2) X(log10) \
+    X(sin) X(cos) X(tan) X(asin) X(acos) X(atan)
+
+#define X(name)                                                     \
+    static const char * math_##name(const closure_def & fn,         \
+        const type_and_value * args, uint32_t arg_cnt,              \
+        type_and_value & result)                                    \
+    {                                                               \
+        double x;                                                   \
+        if (!number_arg(args, arg_cnt, 0, x))                       \
+            return "math." #name " expects a number";               \
+        result = float_value(std::name(x));                         \
+        return nullptr;                                             \
+    }
+CUTE_MATH_UNARY(X)
+#undef X
+
+static const char * math_pow(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    double x, y;
+    if (!number_arg(args, arg_cnt, 0, x) || !number_arg(args, arg_cnt, 1, y))
+        return "math.pow expects two numbers";
+    result = float_value(std::pow(x, y));
+    return nullptr;
+}
+
+static const char * math_atan2(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    double y, x;
+    if (!number_arg(args, arg_cnt, 0, y) || !number_arg(args, arg_cnt, 1, x))
+        return "math.atan2 expects two numbers";
+    result = float_value(std::atan2(y, x));
+    return nullptr;
+}
+
+// Float to int, false if it is not finite or out of range
+static bool float_to_int(double x, int64_t & i)
+{
+    // Both bounds are exact doubles, 2^63 itself is out of range
+    if (!(x >= -9223372036854775808.0 && x < 9223372036854775808.0))
+        return false;
+    i = (int64_t)x;
+    return true;
+}
+
+// Float to int functions, ints are returned unchanged
+#define CUTE_MATH_ROUNDING(X) X(floor) X(ceil) X(round) X(trunc)
+
+#define X(name)                                                         \
+    static const char * math_##name(const closure_def & fn,             \
+        const type_and_value * args, uint32_t arg_cnt,                  \
+        type_and_value & result)                                        \
+    {                                                                   \
+        int64_t i;                                                      \
+        if (arg_cnt < 1 || args[0].t() != INT && args[0].t() != FLOAT)  \
+            return "math." #name " expects a number";                   \
+        if (args[0].t() == INT)                                         \
+            result = args[0];                                           \
+        else if (float_to_int(std::name(args[0].f()), i))               \
+            result = int_value(i);                                      \
+        else                                                            \
+            return "math." #name " result does not fit in an int";      \
+        return nullptr;                                                 \
+    }
+CUTE_MATH_ROUNDING(X)
+#undef X
+
+static const char * math_int(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    int64_t i;
+    if (arg_cnt >= 1 && args[0].t() == INT)
+        result = args[0];
+    else if (arg_cnt < 1 || args[0].t() != FLOAT)
+        return "math.int expects a number";
+    else if (float_to_int(std::trunc(args[0].f()), i))
+        result = int_value(i);
+    else
+        return "math.int result does not fit in an int";
+    return nullptr;
+}
+
+static const char * math_float(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    double x;
+    if (!number_arg(args, arg_cnt, 0, x))
+        return "math.float expects a number";
+    result = float_value(x);
+    return nullptr;
+}
+
+static const char * math_abs(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt >= 1 && args[0].t() == INT)
+        result = int_value(args[0].i() < 0 ? (int64_t)(0 - (uint64_t)args[0].i()) : args[0].i());
+    else if (arg_cnt >= 1 && args[0].t() == FLOAT)
+        result = float_value(std::fabs(args[0].f()));
+    else
+        return "math.abs expects a number";
+    return nullptr;
+}
+
+// Smallest or largest of one or more ints, or of floats with NaN if any
+// of them is NaN
+template<bool is_max>
+static const char * extreme(const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1 || args[0].t() != INT && args[0].t() != FLOAT)
+        return is_max ? "math.max expects numbers" : "math.min expects numbers";
+    type best = args[0].t();
+    for (uint32_t i = 1; i < arg_cnt; i++)
+        if (args[i].t() != best)
+            return is_max ? "math.max expects numbers of one type" : "math.min expects numbers of one type";
+    result = args[0];
+    for (uint32_t i = 1; i < arg_cnt; i++)
+    {
+        const type_and_value & tv = args[i];
+        if (best == INT ? (is_max ? tv.i() > result.i() : tv.i() < result.i())
+            : tv.f() != tv.f() || (is_max ? tv.f() > result.f() : tv.f() < result.f()))
+            result = tv;
+        if (best == FLOAT && result.f() != result.f())
+            break;
+    }
+    return nullptr;
+}
+
+static const char * math_min(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    return extreme<false>(args, arg_cnt, result);
+}
+
+static const char * math_max(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    return extreme<true>(args, arg_cnt, result);
+}
+
+void load_math(obj_def & libs)
+{
+    type_and_value math = new_empty_object();
+    obj_def & od = math.o()->value;
+#define X(name) od.set(#name, new_native(math_##name));
+    CUTE_MATH_UNARY(X)
+    CUTE_MATH_ROUNDING(X)
+#undef X
+    od.set("pow", new_native(math_pow));
+    od.set("atan2", new_native(math_atan2));
+    od.set("int", new_native(math_int));
+    od.set("float", new_native(math_float));
+    od.set("abs", new_native(math_abs));
+    od.set("min", new_native(math_min));
+    od.set("max", new_native(math_max));
+    od.set("pi", float_value(M_PI));
+    od.set("e", float_value(M_E));
+    libs.set("math", math);
+}
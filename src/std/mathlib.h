@@ -0,0 +1 @@
+void load_math(obj_def & libs);
@@ -5,16 +5,16 @@
 void load_misc(obj_def & libs)
 {
     // The 'global' object
-    libs["G"] = new_empty_object();
+    libs.set("G", new_empty_object());
 
     // The nil constant
-    libs["null"] = {NIL};
+    libs.set("null", nil_value());
 
     // Boolean constants
-    libs["true"] = {BOOL, {.b = true}};
-    libs["false"] = {BOOL, {.b = false}};
+    libs.set("true", bool_value(true));
+    libs.set("false", bool_value(false));
 
     // Float constants
-    libs["nan"] = {FLOAT, {.f = NAN}};
-    libs["inf"] = {FLOAT, {.f = INFINITY}};
+    libs.set("nan", float_value(NAN));
+    libs.set("inf", float_value(INFINITY));
 }
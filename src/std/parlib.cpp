@@ -0,0 +1,605 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include "vm.h"
+#include "gc.h"
+#include "marshal.h"
+#include "parlib.h"
+
+// The functions split an array into chunks, several per thread, which the
+// threads of a pool and the calling thread take one at a time until none
+// are left, so uneven chunks even out. Each thread taking part in a call
+// runs the closure in a vm of its own, on copies made with marshal. Packed
+// arrays are read in place, since the calling thread does nothing else
+// until the call returns.
+//
+// One call runs at a time. A call goes through phases, e.g. sorting the
+// chunks and then merging them, and starts a phase once the previous one
+// is done.
+
+struct par_job;
+
+// What a thread needs to run closures for a call, set up on its first task
+struct par_helper
+{
+    cute::vm * vm;
+    type_and_value fn;
+    type_and_value copy; // sort: the whole array, unless packed
+};
+
+struct par_phase
+{
+    void (* run)(par_job & job, par_helper & h, size_t task);
+    size_t tasks;
+    std::atomic<size_t> next; // first task nobody took yet
+    std::atomic<size_t> done;
+};
+
+struct par_job
+{
+    const arr_def * in;
+    size_t n;
+    size_t chunks;
+    std::string fn; // marshaled closure, empty for sort without one
+    // Elements of VALUES arrays, marshaled one by one
+    std::string items;
+    std::vector<size_t> offsets;
+    // map, reduce: marshaled results of each chunk
+    bool keep_results;
+    std::vector<std::string> out;
+    // reduce
+    std::string init;
+    std::string result;
+    // sort: sorted runs of indices between the bounds, in perm or tmp
+    std::string copy;
+    std::vector<size_t> perm, tmp, bounds;
+    bool in_tmp;
+    // Guarded by the pool lock
+    std::list<par_phase> phases;
+    par_phase * phase;
+    uint64_t phase_no;
+    bool finished;
+    unsigned active; // pool threads taking part
+    std::string error;
+    std::atomic<bool> failed;
+};
+
+struct par_pool
+{
+    std::mutex jobs; // held by the caller during a call
+    std::mutex lock;
+    std::condition_variable wake; // new job, phase or end of a job
+    std::condition_variable idle; // phase done or thread left
+    par_job * job;
+    uint64_t generation;
+    unsigned threads; // including the caller
+};
+
+// Set while running a task, calls from there would wait for themselves
+static thread_local bool in_task = false;
+static thread_local std::string par_error;
+
+static void pool_worker(par_pool * p);
+
+// CUTE_PAR_THREADS is clamped to 1..max_threads
+static const long max_threads = 1024;
+
+static par_pool * start_pool()
+{
+    par_pool * p = new par_pool;
+    p->job = nullptr;
+    p->generation = 0;
+    long n = std::thread::hardware_concurrency();
+    if (const char * env = getenv("CUTE_PAR_THREADS"))
+        n = strtol(env, nullptr, 10);
+    p->threads = std::clamp(n, 1L, max_threads);
+    for (unsigned t = 1; t < p->threads; t++)
+        std::thread(pool_worker, p).detach();
+    return p;
+}
+
+// Started on first use and never freed, its threads wait for work until
+// the process exits
+static par_pool * get_pool()
+{
+    static par_pool * p = start_pool();
+    return p;
+}
+
+static void fail(par_job & job, const std::string & err)
+{
+    std::lock_guard<std::mutex> l(get_pool()->lock);
+    if (!job.failed)
+        job.error = err;
+    job.failed = true;
+}
+
+static void set_up(const par_job & job, par_helper & h)
+{
+    if (h.vm) return;
+    h.vm = new cute::vm;
+    h.vm->begin();
+    const char * p = job.fn.data();
+    h.fn = unmarshal(p);
+    h.vm->keep(h.fn);
+    if (!job.copy.empty())
+    {
+        p = job.copy.data();
+        h.copy = unmarshal(p);
+        h.vm->keep(h.copy);
+    }
+}
+
+static void tear_down(par_helper & h)
+{
+    if (!h.vm) return;
+    h.vm->end();
+    delete h.vm;
+    h.vm = nullptr;
+}
+
+static bool call(par_job & job, par_helper & h, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string err;
+    if (h.vm->call(h.fn, args, arg_cnt, result, err))
+        return true;
+    fail(job, err);
+    return false;
+}
+
+static size_t chunk_start(const par_job & job, size_t chunk)
+{
+    return job.n * chunk / job.chunks;
+}
+
+// Element i of the array, copied to the current heap unless it is packed
+static type_and_value element(const par_job & job, size_t i)
+{
+    if (job.in->kind != arr_def::VALUES)
+        return job.in->get(i);
+    const char * p = job.items.data() + job.offsets[i];
+    return unmarshal(p);
+}
+
+static void run_tasks(par_pool * p, par_job & job, par_phase & ph, par_helper & h)
+{
+    bool was_in_task = in_task;
+    in_task = true;
+    size_t t;
+    while ((t = ph.next++) < ph.tasks)
+    {
+        if (!job.failed)
+            ph.run(job, h, t);
+        if (++ph.done == ph.tasks)
+        {
+            std::lock_guard<std::mutex> l(p->lock);
+            p->idle.notify_all();
+        }
+    }
+    in_task = was_in_task;
+}
+
+// Runs tasks of every phase until the job is finished. The lock is held
+// while waiting for the next phase.
+static void take_part(par_pool * p, par_job & job, std::unique_lock<std::mutex> & l)
+{
+    par_helper h{};
+    uint64_t seen = 0;
+    for (;;)
+    {
+        while (!job.finished && job.phase_no == seen)
+            p->wake.wait(l);
+        if (job.finished) break;
+        seen = job.phase_no;
+        par_phase & ph = *job.phase;
+        l.unlock();
+        run_tasks(p, job, ph, h);
+        l.lock();
+    }
+    l.unlock();
+    tear_down(h);
+    l.lock();
+}
+
+static void pool_worker(par_pool * p)
+{
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> l(p->lock);
+    for (;;)
+    {
+        while (p->generation == seen)
+            p->wake.wait(l);
+        seen = p->generation;
+        par_job * job = p->job;
+        if (!job || job->finished) continue;
+        job->active++;
+        take_part(p, *job, l);
+        job->active--;
+        p->idle.notify_all();
+    }
+}
+
+static void start_job(par_pool * p, par_job & job)
+{
+    p->jobs.lock();
+    std::lock_guard<std::mutex> l(p->lock);
+    p->job = &job;
+    p->generation++;
+    p->wake.notify_all();
+}
+
+// The calling thread takes tasks as well, then waits for the phase to end
+static void run_phase(par_pool * p, par_job & job, par_helper & h,
+                      void (* run)(par_job & job, par_helper & h, size_t task), size_t tasks)
+{
+    par_phase * ph;
+    {
+        std::lock_guard<std::mutex> l(p->lock);
+        ph = &job.phases.emplace_back();
+        ph->run = run;
+        ph->tasks = tasks;
+        job.phase = ph;
+        job.phase_no++;
+        p->wake.notify_all();
+    }
+    run_tasks(p, job, *ph, h);
+    std::unique_lock<std::mutex> l(p->lock);
+    while (ph->done < ph->tasks)
+        p->idle.wait(l);
+}
+
+// Waits for the pool threads to leave. Frees the vm of the calling thread,
+// so that its own heap is current again.
+static void finish_job(par_pool * p, par_job & job, par_helper & h)
+{
+    {
+        std::unique_lock<std::mutex> l(p->lock);
+        job.finished = true;
+        p->wake.notify_all();
+        while (job.active)
+            p->idle.wait(l);
+        p->job = nullptr;
+    }
+    tear_down(h);
+    p->jobs.unlock();
+}
+
+static const char * job_error(const par_job & job)
+{
+    par_error = job.error;
+    return par_error.c_str();
+}
+
+// Copies what the tasks need from the caller's heap
+static const char * prepare(par_pool * p, par_job & job, const type_and_value & atv, const type_and_value * fn, bool elements)
+{
+    if (in_task)
+        return "par functions cannot be called from a par closure";
+    job.in = &atv.a()->value;
+    job.n = job.in->size();
+    job.chunks = std::min<size_t>(job.n, p->threads * 8);
+    if (fn)
+        if (const char * err = marshal(*fn, job.fn))
+            return err;
+    if (elements && job.in->kind == arr_def::VALUES)
+    {
+        job.offsets.reserve(job.n);
+        for (const type_and_value & tv : job.in->values)
+        {
+            job.offsets.push_back(job.items.size());
+            if (const char * err = marshal(tv, job.items))
+                return err;
+        }
+    }
+    return nullptr;
+}
+
+static void map_task(par_job & job, par_helper & h, size_t task)
+{
+    set_up(job, h);
+    size_t end = chunk_start(job, task + 1);
+    for (size_t i = chunk_start(job, task); i < end && !job.failed; i++)
+    {
+        type_and_value args[2] = {element(job, i), int_value(i)};
+        type_and_value result;
+        if (!call(job, h, args, 2, result)) return;
+        if (!job.keep_results) continue;
+        if (const char * err = marshal(result, job.out[task]))
+        {
+            fail(job, err);
+            return;
+        }
+    }
+}
+
+static const char * run_map(const type_and_value * args, type_and_value & result, bool keep_results)
+{
+    par_pool * p = get_pool();
+    par_job job{};
+    if (const char * err = prepare(p, job, args[0], &args[1], true))
+        return err;
+    result = keep_results ? new_array(nullptr, nullptr) : nil_value();
+    if (!job.n) return nullptr;
+    job.keep_results = keep_results;
+    job.out.resize(job.chunks);
+    par_helper h{};
+    start_job(p, job);
+    run_phase(p, job, h, map_task, job.chunks);
+    finish_job(p, job, h);
+    if (job.failed) return job_error(job);
+    if (!keep_results) return nullptr;
+    std::vector<type_and_value> values;
+    values.reserve(job.n);
+    for (const std::string & s : job.out)
+    {
+        const char * q = s.data();
+        while (q < s.data() + s.size())
+            values.push_back(unmarshal(q));
+    }
+    result = new_array(values.data(), values.data() + values.size());
+    gc_account(values.size() * sizeof(type_and_value));
+    return nullptr;
+}
+
+// par.map(a, fn): new array of fn(x, i) for the elements x of a and their
+// indices i
+static const char * par_map(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 2 || args[0].t() != ARRAY || args[1].t() != CLOSURE)
+        return "par.map expects an array and a closure";
+    return run_map(args, result, true);
+}
+
+// par.for_each(a, fn): calls fn(x, i) for the elements x of a. Changes to
+// captured variables stay in the copies the threads have.
+static const char * par_for_each(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 2 || args[0].t() != ARRAY || args[1].t() != CLOSURE)
+        return "par.for_each expects an array and a closure";
+    return run_map(args, result, false);
+}
+
+// Folds a chunk starting from its first element
+static void reduce_task(par_job & job, par_helper & h, size_t task)
+{
+    set_up(job, h);
+    size_t i = chunk_start(job, task), end = chunk_start(job, task + 1);
+    type_and_value acc = element(job, i);
+    for (i++; i < end && !job.failed; i++)
+    {
+        type_and_value args[2] = {acc, element(job, i)};
+        if (!call(job, h, args, 2, acc)) return;
+    }
+    if (const char * err = marshal(acc, job.out[task]))
+        fail(job, err);
+}
+
+// Folds the results of the chunks, in order, starting from init
+static void reduce_final(par_job & job, par_helper & h, size_t)
+{
+    set_up(job, h);
+    const char * p = job.init.data();
+    type_and_value acc = unmarshal(p);
+    for (size_t c = 0; c < job.chunks && !job.failed; c++)
+    {
+        p = job.out[c].data();
+        type_and_value args[2] = {acc, unmarshal(p)};
+        if (!call(job, h, args, 2, acc)) return;
+    }
+    if (const char * err = marshal(acc, job.result))
+        fail(job, err);
+}
+
+// par.reduce(a, fn, init): fn(...fn(fn(init, a[0]), a[1])..., a[n - 1]),
+// except that chunks are folded on their own and fn(x, y) must therefore
+// be associative
+static const char * par_reduce(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 3 || args[0].t() != ARRAY || args[1].t() != CLOSURE)
+        return "par.reduce expects an array, a closure and an initial value";
+    par_pool * p = get_pool();
+    par_job job{};
+    if (const char * err = prepare(p, job, args[0], &args[1], true))
+        return err;
+    result = args[2];
+    if (!job.n) return nullptr;
+    if (const char * err = marshal(args[2], job.init))
+        return err;
+    job.out.resize(job.chunks);
+    par_helper h{};
+    start_job(p, job);
+    run_phase(p, job, h, reduce_task, job.chunks);
+    if (!job.failed)
+        run_phase(p, job, h, reduce_final, 1);
+    finish_job(p, job, h);
+    if (job.failed) return job_error(job);
+    const char * q = job.result.data();
+    result = unmarshal(q);
+    return nullptr;
+}
+
+static double number(const type_and_value & tv)
+{
+    return tv.t() == INT ? tv.i() : tv.f();
+}
+
+// NaNs go last
+static bool less_float(double x, double y)
+{
+    return x < y || (y != y && x == x);
+}
+
+// Default order of generic elements: numbers by value, strings by their
+// bytes
+static bool less_value(const type_and_value & a, const type_and_value & b)
+{
+    if (a.t() == STRING)
+        return a.s()->value.data() < b.s()->value.data();
+    if (a.t() == INT && b.t() == INT)
+        return a.i() < b.i();
+    return less_float(number(a), number(b));
+}
+
+// Whether element a goes before element b. Errors fail the job, which
+// stops the sort.
+static bool before(par_job & job, par_helper & h, size_t a, size_t b)
+{
+    const arr_def & in = *job.in;
+    // Packed elements are compared where they are, since get() would box
+    // big ints before the thread has a heap
+    if (job.fn.empty())
+        switch (in.kind)
+        {
+        case arr_def::INTS: return in.ints[a] < in.ints[b];
+        case arr_def::FLOATS: return less_float(in.floats[a], in.floats[b]);
+        case arr_def::BOOLS: return !in.bools[a] && in.bools[b];
+        case arr_def::VALUES: return less_value(in.values[a], in.values[b]);
+        }
+    set_up(job, h);
+    type_and_value args[2];
+    if (in.kind == arr_def::VALUES)
+    {
+        const arr_def & copy = h.copy.a()->value;
+        args[0] = copy.values[a];
+        args[1] = copy.values[b];
+    }
+    else
+    {
+        args[0] = in.get(a);
+        args[1] = in.get(b);
+    }
+    type_and_value result;
+    if (!call(job, h, args, 2, result)) return false;
+    if (result.t() != BOOL)
+    {
+        fail(job, "par.sort expects the closure to return a bool");
+        return false;
+    }
+    return result.b();
+}
+
+// Merges the sorted runs [lo, mid) and [mid, hi) of src into dst. Equal
+// elements keep their order.
+static void merge(par_job & job, par_helper & h, const size_t * src, size_t * dst, size_t lo, size_t mid, size_t hi)
+{
+    size_t i = lo, j = mid, k = lo;
+    while (i < mid && j < hi && !job.failed)
+        dst[k++] = before(job, h, src[j], src[i]) ? src[j++] : src[i++];
+    while (i < mid) dst[k++] = src[i++];
+    while (j < hi) dst[k++] = src[j++];
+}
+
+// Bottom up merge sort of a chunk, which ends up in perm
+static void sort_task(par_job & job, par_helper & h, size_t task)
+{
+    size_t lo = job.bounds[task], hi = job.bounds[task + 1];
+    size_t * a = job.perm.data(), * b = job.tmp.data();
+    for (size_t w = 1; w < hi - lo && !job.failed; w *= 2)
+    {
+        for (size_t m = lo; m < hi; m += 2 * w)
+            merge(job, h, a, b, m, std::min(m + w, hi), std::min(m + 2 * w, hi));
+        std::swap(a, b);
+    }
+    if (a != job.perm.data())
+        std::copy(a + lo, a + hi, job.perm.data() + lo);
+}
+
+// Merges one pair of neighbouring runs, or copies the last run if it has
+// no partner
+static void merge_task(par_job & job, par_helper & h, size_t task)
+{
+    const size_t * src = job.in_tmp ? job.tmp.data() : job.perm.data();
+    size_t * dst = job.in_tmp ? job.perm.data() : job.tmp.data();
+    size_t last = job.bounds.size() - 1;
+    size_t lo = job.bounds[2 * task];
+    size_t mid = job.bounds[std::min(2 * task + 1, last)];
+    size_t hi = job.bounds[std::min(2 * task + 2, last)];
+    merge(job, h, src, dst, lo, mid, hi);
+}
+
+template<typename T>
+static void permute(std::vector<T> & v, const std::vector<size_t> & order)
+{
+    std::vector<T> sorted;
+    sorted.reserve(v.size());
+    for (size_t i : order)
+        sorted.push_back(v[i]);
+    v.swap(sorted);
+}
+
+// par.sort(a[, less]): sorts a in place and returns it. less(x, y) tells
+// whether x goes before y. Without it, the elements must all be numbers or
+// all be strings. Equal elements keep their order.
+static const char * par_sort(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1 || args[0].t() != ARRAY || (arg_cnt > 1 && args[1].t() != CLOSURE))
+        return "par.sort expects an array and optionally a closure";
+    arr_def & ad = args[0].a()->value;
+    bool custom = arg_cnt > 1;
+    if (!custom && ad.kind == arr_def::VALUES)
+    {
+        bool strings = ad.values.size() && ad.values[0].t() == STRING;
+        for (const type_and_value & tv : ad.values)
+        {
+            if (strings ? tv.t() != STRING : tv.t() != INT && tv.t() != FLOAT)
+                return "par.sort without a closure expects all numbers or all strings";
+            // Flat before other threads read them
+            if (strings) tv.s()->value.data();
+        }
+    }
+    par_pool * p = get_pool();
+    par_job job{};
+    if (const char * err = prepare(p, job, args[0], custom ? &args[1] : nullptr, false))
+        return err;
+    result = args[0];
+    if (job.n < 2) return nullptr;
+    if (custom && ad.kind == arr_def::VALUES)
+        if (const char * err = marshal(args[0], job.copy))
+            return err;
+    job.perm.resize(job.n);
+    std::iota(job.perm.begin(), job.perm.end(), 0);
+    job.tmp.resize(job.n);
+    for (size_t c = 0; c <= job.chunks; c++)
+        job.bounds.push_back(chunk_start(job, c));
+    par_helper h{};
+    start_job(p, job);
+    run_phase(p, job, h, sort_task, job.chunks);
+    while (job.bounds.size() > 2 && !job.failed)
+    {
+        run_phase(p, job, h, merge_task, job.bounds.size() / 2);
+        std::vector<size_t> bounds;
+        for (size_t i = 0; i < job.bounds.size(); i += 2)
+            bounds.push_back(job.bounds[i]);
+        if (bounds.back() != job.n)
+            bounds.push_back(job.n);
+        job.bounds.swap(bounds);
+        job.in_tmp = !job.in_tmp;
+    }
+    finish_job(p, job, h);
+    if (job.failed) return job_error(job);
+    const std::vector<size_t> & order = job.in_tmp ? job.tmp : job.perm;
+    switch (ad.kind)
+    {
+    case arr_def::INTS: permute(ad.ints, order); break;
+    case arr_def::FLOATS: permute(ad.floats, order); break;
+    case arr_def::BOOLS: permute(ad.bools, order); break;
+    case arr_def::VALUES: permute(ad.values, order); break;
+    }
+    return nullptr;
+}
+
+void load_par(obj_def & libs)
+{
+    type_and_value lib = new_empty_object();
+    obj_def & od = lib.o()->value;
+    od.set("map", new_native(par_map));
+    od.set("for_each", new_native(par_for_each));
+    od.set("reduce", new_native(par_reduce));
+    od.set("sort", new_native(par_sort));
+    libs.set("par", lib);
+}
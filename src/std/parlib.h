@@ -0,0 +1 @@
+void load_par(obj_def & libs);
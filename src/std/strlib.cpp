@@ -0,0 +1,250 @@
+#include <cstdlib>
+#include <cerrno>
+#include "vm.h"
+#include "io.h"
+#include "strlib.h"
+
+// Substrings at least this long share the characters of their string
+// instead of copying them
+static const size_t slice_min_size = 64;
+
+static bool string_arg(const type_and_value * args, uint32_t arg_cnt, uint32_t idx, std::string_view & s)
+{
+    if (idx >= arg_cnt || args[idx].t() != STRING) return false;
+    s = args[idx].s()->value.data();
+    return true;
+}
+
+// Optional int argument, clamped to [0, max]
+static bool index_arg(const type_and_value * args, uint32_t arg_cnt, uint32_t idx, size_t max, size_t & i)
+{
+    if (idx >= arg_cnt) return true;
+    if (args[idx].t() != INT) return false;
+    int64_t v = args[idx].i();
+    i = v < 0 ? 0 : (uint64_t)v > max ? max : v;
+    return true;
+}
+
+// The part of s, a flat string, at chars
+static type_and_value substring(str * s, std::string_view chars)
+{
+    if (chars.size() < slice_min_size)
+        return new_string(chars);
+    if (chars.size() == s->value.size())
+        return string_value(s);
+    // A slice of a slice keeps the original owner alive instead
+    gc_base_obj * owner = s->value.owner ? s->value.owner : s;
+    return new_string_slice(owner, chars);
+}
+
+// str.sub(s, start[, len]): the characters from start, out of range
+// positions are clamped
+static const char * str_sub(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s;
+    size_t start = 0, len;
+    if (!string_arg(args, arg_cnt, 0, s) || arg_cnt < 2
+        || !index_arg(args, arg_cnt, 1, s.size(), start))
+        return "str.sub expects a string and a start index";
+    len = s.size() - start;
+    if (!index_arg(args, arg_cnt, 2, s.size() - start, len))
+        return "str.sub expects an int length";
+    result = substring(args[0].s(), s.substr(start, len));
+    return nullptr;
+}
+
+// str.find(s, part[, start]): index of the first part at or after start, -1
+// if there is none
+static const char * str_find(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s, part;
+    size_t start = 0;
+    if (!string_arg(args, arg_cnt, 0, s) || !string_arg(args, arg_cnt, 1, part)
+        || !index_arg(args, arg_cnt, 2, s.size(), start))
+        return "str.find expects two strings";
+    size_t pos = s.find(part, start);
+    result = int_value(pos == std::string_view::npos ? -1 : (int64_t)pos);
+    return nullptr;
+}
+
+// str.byte(s, i): the byte at i as an int, null out of range
+static const char * str_byte(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s;
+    if (!string_arg(args, arg_cnt, 0, s) || arg_cnt < 2 || args[1].t() != INT)
+        return "str.byte expects a string and an index";
+    int64_t i = args[1].i();
+    if (i >= 0 && (uint64_t)i < s.size())
+        result = int_value((unsigned char)s[i]);
+    return nullptr;
+}
+
+// str.char(b...): the string of the given bytes
+static const char * str_char(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string s(arg_cnt, '\0');
+    for (uint32_t i = 0; i < arg_cnt; i++)
+    {
+        if (args[i].t() != INT || args[i].i() < 0 || args[i].i() > 255)
+            return "str.char expects bytes";
+        s[i] = (char)args[i].i();
+    }
+    result = new_string(s);
+    return nullptr;
+}
+
+template<bool upper>
+static const char * change_case(const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s;
+    if (!string_arg(args, arg_cnt, 0, s))
+        return upper ? "str.upper expects a string" : "str.lower expects a string";
+    std::string out(s);
+    for (char & c : out)
+        if (upper ? c >= 'a' && c <= 'z' : c >= 'A' && c <= 'Z')
+            c ^= 0x20;
+    result = new_string(out);
+    return nullptr;
+}
+
+// str.upper(s), str.lower(s): ASCII letters only
+static const char * str_upper(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    return change_case<true>(args, arg_cnt, result);
+}
+
+static const char * str_lower(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    return change_case<false>(args, arg_cnt, result);
+}
+
+// str.trim(s): s without leading and trailing whitespace
+static const char * str_trim(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s;
+    if (!string_arg(args, arg_cnt, 0, s))
+        return "str.trim expects a string";
+    const char * space = " \t\n\v\f\r";
+    size_t first = s.find_first_not_of(space);
+    if (first == std::string_view::npos)
+        s = {};
+    else
+        s = s.substr(first, s.find_last_not_of(space) - first + 1);
+    result = substring(args[0].s(), s);
+    return nullptr;
+}
+
+// str.split(s, sep): array of the parts of s between the separators
+static const char * str_split(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s, sep;
+    if (!string_arg(args, arg_cnt, 0, s) || !string_arg(args, arg_cnt, 1, sep) || sep.empty())
+        return "str.split expects a string and a non-empty separator";
+    std::vector<type_and_value> parts;
+    for (;;)
+    {
+        size_t end = s.find(sep);
+        parts.push_back(substring(args[0].s(), s.substr(0, end)));
+        if (end == std::string_view::npos) break;
+        s.remove_prefix(end + sep.size());
+    }
+    result = new_array(parts.data(), parts.data() + parts.size());
+    return nullptr;
+}
+
+// str.join(a[, sep]): the elements of a as OUT prints them, separated by sep
+static const char * str_join(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view sep;
+    if (arg_cnt < 1 || args[0].t() != ARRAY || arg_cnt > 1 && !string_arg(args, arg_cnt, 1, sep))
+        return "str.join expects an array and a string";
+    const arr_def & a = args[0].a()->value;
+    std::string out;
+    char buf[format_max];
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (i) out += sep;
+        out += format_value(a.get(i), buf);
+    }
+    result = new_string(out);
+    return nullptr;
+}
+
+// str.repeat(s, n): n copies of s
+static const char * str_repeat(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s;
+    if (!string_arg(args, arg_cnt, 0, s) || arg_cnt < 2 || args[1].t() != INT || args[1].i() < 0)
+        return "str.repeat expects a string and a count";
+    int64_t n = s.empty() ? 0 : args[1].i();
+    std::string out;
+    out.reserve(s.size() * n);
+    for (int64_t i = 0; i < n; i++)
+        out += s;
+    result = new_string(out);
+    return nullptr;
+}
+
+// str.to_string(v): v as OUT prints it
+static const char * str_to_string(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    if (arg_cnt < 1)
+        return "str.to_string expects a value";
+    if (args[0].t() == STRING)
+    {
+        result = args[0];
+        return nullptr;
+    }
+    char buf[format_max];
+    result = new_string(format_value(args[0], buf));
+    return nullptr;
+}
+
+// str.to_int(s), str.to_float(s): the number s spells, null if it is not
+// one
+static const char * str_to_int(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s;
+    if (!string_arg(args, arg_cnt, 0, s))
+        return "str.to_int expects a string";
+    std::string text(s);
+    char * end;
+    errno = 0;
+    long long i = strtoll(text.c_str(), &end, 10);
+    if (!text.empty() && !*end && !errno)
+        result = int_value(i);
+    return nullptr;
+}
+
+static const char * str_to_float(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    std::string_view s;
+    if (!string_arg(args, arg_cnt, 0, s))
+        return "str.to_float expects a string";
+    std::string text(s);
+    char * end;
+    double f = strtod(text.c_str(), &end);
+    if (!text.empty() && !*end)
+        result = float_value(f);
+    return nullptr;
+}
+
+void load_str(obj_def & libs)
+{
+    type_and_value lib = new_empty_object();
+    obj_def & od = lib.o()->value;
+    od.set("sub", new_native(str_sub));
+    od.set("find", new_native(str_find));
+    od.set("byte", new_native(str_byte));
+    od.set("char", new_native(str_char));
+    od.set("upper", new_native(str_upper));
+    od.set("lower", new_native(str_lower));
+    od.set("trim", new_native(str_trim));
+    od.set("split", new_native(str_split));
+    od.set("join", new_native(str_join));
+    od.set("repeat", new_native(str_repeat));
+    od.set("to_string", new_native(str_to_string));
+    od.set("to_int", new_native(str_to_int));
+    od.set("to_float", new_native(str_to_float));
+    libs.set("str", lib);
+}
@@ -0,0 +1 @@
+void load_str(obj_def & libs);
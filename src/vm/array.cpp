@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <limits>
+#include "vm.h"
+#include "gc.h"
+#include "array.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CUTE_X86_SIMD
+#endif
+
+// Float kernels keep four running lanes, lane j takes the elements at
+// i % 4 == j. The AVX2, SSE2 and scalar versions only differ in how many
+// lanes one instruction covers, and the tail and lane reduction are shared.
+
+// Same operand order as MINPD / MAXPD, which return the second operand
+// unless the first one compares less / greater
+template<bool is_max, typename T>
+static T pick(T a, T b)
+{
+    return (is_max ? a > b : a < b) ? a : b;
+}
+
+static void scale_scalar(double * x, size_t n, double f)
+{
+    for (size_t i = 0; i < n; i++)
+        x[i] *= f;
+}
+
+static uint64_t int_sum_scalar(const int64_t * x, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += (uint64_t)x[i];
+    return sum;
+}
+
+#ifdef CUTE_X86_SIMD
+
+// SSE2 is part of x86-64, two registers make up the four lanes
+
+static void sum_lanes_sse2(const double * x, size_t n, double acc[4])
+{
+    __m128d lo = _mm_loadu_pd(acc), hi = _mm_loadu_pd(acc + 2);
+    for (size_t i = 0; i + 4 <= n; i += 4)
+    {
+        lo = _mm_add_pd(lo, _mm_loadu_pd(x + i));
+        hi = _mm_add_pd(hi, _mm_loadu_pd(x + i + 2));
+    }
+    _mm_storeu_pd(acc, lo);
+    _mm_storeu_pd(acc + 2, hi);
+}
+
+static void dot_lanes_sse2(const double * x, const double * y, size_t n, double acc[4])
+{
+    __m128d lo = _mm_loadu_pd(acc), hi = _mm_loadu_pd(acc + 2);
+    for (size_t i = 0; i + 4 <= n; i += 4)
+    {
+        lo = _mm_add_pd(lo, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+        hi = _mm_add_pd(hi, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+    }
+    _mm_storeu_pd(acc, lo);
+    _mm_storeu_pd(acc + 2, hi);
+}
+
+template<bool is_max>
+static bool minmax_lanes_sse2(const double * x, size_t n, double m[4])
+{
+    __m128d lo = _mm_loadu_pd(m), hi = _mm_loadu_pd(m + 2);
+    __m128d nan = _mm_setzero_pd();
+    for (size_t i = 0; i + 4 <= n; i += 4)
+    {
+        __m128d a = _mm_loadu_pd(x + i), b = _mm_loadu_pd(x + i + 2);
+        lo = is_max ? _mm_max_pd(lo, a) : _mm_min_pd(lo, a);
+        hi = is_max ? _mm_max_pd(hi, b) : _mm_min_pd(hi, b);
+        nan = _mm_or_pd(nan, _mm_or_pd(_mm_cmpunord_pd(a, a), _mm_cmpunord_pd(b, b)));
+    }
+    _mm_storeu_pd(m, lo);
+    _mm_storeu_pd(m + 2, hi);
+    return _mm_movemask_pd(nan);
+}
+
+static void scale_sse2(double * x, size_t n, double f)
+{
+    __m128d v = _mm_set1_pd(f);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), v));
+    scale_scalar(x + i, n - i, f);
+}
+
+static uint64_t int_sum_sse2(const int64_t * x, size_t n)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i *)(x + i)));
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return lanes[0] + lanes[1] + int_sum_scalar(x + i, n - i);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void sum_lanes_avx2(const double * x, size_t n, double acc[4])
+{
+    __m256d v = _mm256_loadu_pd(acc);
+    for (size_t i = 0; i + 4 <= n; i += 4)
+        v = _mm256_add_pd(v, _mm256_loadu_pd(x + i));
+    _mm256_storeu_pd(acc, v);
+}
+
+AVX2 static void dot_lanes_avx2(const double * x, const double * y, size_t n, double acc[4])
+{
+    __m256d v = _mm256_loadu_pd(acc);
+    for (size_t i = 0; i + 4 <= n; i += 4)
+        v = _mm256_add_pd(v, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    _mm256_storeu_pd(acc, v);
+}
+
+template<bool is_max>
+AVX2 static bool minmax_lanes_avx2(const double * x, size_t n, double m[4])
+{
+    __m256d v = _mm256_loadu_pd(m);
+    __m256d nan = _mm256_setzero_pd();
+    for (size_t i = 0; i + 4 <= n; i += 4)
+    {
+        __m256d a = _mm256_loadu_pd(x + i);
+        v = is_max ? _mm256_max_pd(v, a) : _mm256_min_pd(v, a);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(a, a, _CMP_UNORD_Q));
+    }
+    _mm256_storeu_pd(m, v);
+    return _mm256_movemask_pd(nan);
+}
+
+AVX2 static void scale_avx2(double * x, size_t n, double f)
+{
+    __m256d v = _mm256_set1_pd(f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), v));
+    scale_scalar(x + i, n - i, f);
+}
+
+AVX2 static uint64_t int_sum_avx2(const int64_t * x, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *)(x + i)));
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + int_sum_scalar(x + i, n - i);
+}
+
+#undef AVX2
+
+static bool has_avx2()
+{
+    static const bool rt = __builtin_cpu_supports("avx2");
+    return rt;
+}
+
+#define SIMD_CALL(name, ...) \
+    (has_avx2() ? name##_avx2(__VA_ARGS__) : name##_sse2(__VA_ARGS__))
+
+#else
+
+static void sum_lanes_scalar(const double * x, size_t n, double acc[4])
+{
+    for (size_t i = 0; i + 4 <= n; i += 4)
+        for (int j = 0; j < 4; j++)
+            acc[j] += x[i + j];
+}
+
+static void dot_lanes_scalar(const double * x, const double * y, size_t n, double acc[4])
+{
+    for (size_t i = 0; i + 4 <= n; i += 4)
+        for (int j = 0; j < 4; j++)
+            acc[j] += x[i + j] * y[i + j];
+}
+
+template<bool is_max>
+static bool minmax_lanes_scalar(const double * x, size_t n, double m[4])
+{
+    bool nan = false;
+    for (size_t i = 0; i + 4 <= n; i += 4)
+        for (int j = 0; j < 4; j++)
+        {
+            m[j] = pick<is_max>(m[j], x[i + j]);
+            nan |= x[i + j] != x[i + j];
+        }
+    return nan;
+}
+
+#define SIMD_CALL(name, ...) name##_scalar(__VA_ARGS__)
+
+#endif
+
+static double reduce_sum(const double acc[4])
+{
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+static double float_sum(const double * x, size_t n)
+{
+    double acc[4] = {0, 0, 0, 0};
+    size_t body = n & ~(size_t)3;
+    SIMD_CALL(sum_lanes, x, n, acc);
+    for (size_t i = body; i < n; i++)
+        acc[i - body] += x[i];
+    return reduce_sum(acc);
+}
+
+static double float_dot(const double * x, const double * y, size_t n)
+{
+    double acc[4] = {0, 0, 0, 0};
+    size_t body = n & ~(size_t)3;
+    SIMD_CALL(dot_lanes, x, y, n, acc);
+    for (size_t i = body; i < n; i++)
+        acc[i - body] += x[i] * y[i];
+    return reduce_sum(acc);
+}
+
+// NaN if any element is NaN, n must not be 0
+template<bool is_max>
+static double float_minmax(const double * x, size_t n)
+{
+    double m[4] = {x[0], x[0], x[0], x[0]};
+    size_t body = n & ~(size_t)3;
+#ifdef CUTE_X86_SIMD
+    bool nan = has_avx2() ? minmax_lanes_avx2<is_max>(x, n, m) : minmax_lanes_sse2<is_max>(x, n, m);
+#else
+    bool nan = minmax_lanes_scalar<is_max>(x, n, m);
+#endif
+    for (size_t i = body; i < n; i++)
+    {
+        m[i - body] = pick<is_max>(m[i - body], x[i]);
+        nan |= x[i] != x[i];
+    }
+    if (nan) return std::numeric_limits<double>::quiet_NaN();
+    return pick<is_max>(pick<is_max>(m[0], m[1]), pick<is_max>(m[2], m[3]));
+}
+
+template<bool is_max>
+static const char * minmax(const arr_def & a, type_and_value & result)
+{
+    size_t n = a.size();
+    if (!n) return "Empty array has no minimum or maximum";
+    if (a.kind == arr_def::FLOATS)
+    {
+        result = float_value(float_minmax<is_max>(a.floats.data(), n));
+        return nullptr;
+    }
+    if (a.kind != arr_def::INTS) return "Array elements must be all int or all float";
+    int64_t m = a.ints[0];
+    for (int64_t x : a.ints)
+        m = pick<is_max>(m, x);
+    result = int_value(m);
+    return nullptr;
+}
+
+const char * array_sum(const arr_def & a, type_and_value & result)
+{
+    switch (a.kind)
+    {
+    case arr_def::INTS:
+        result = int_value((int64_t)SIMD_CALL(int_sum, a.ints.data(), a.ints.size()));
+        return nullptr;
+    case arr_def::FLOATS:
+        result = float_value(float_sum(a.floats.data(), a.floats.size()));
+        return nullptr;
+    default:
+        return "Array elements must be all int or all float";
+    }
+}
+
+const char * array_dot(const arr_def & a, const arr_def & b, type_and_value & result)
+{
+    size_t n = a.size();
+    if (b.size() != n) return "Arrays differ in length";
+    // An empty array counts as either kind
+    arr_def::kind_t kind = n ? a.kind : arr_def::INTS;
+    if (n && b.kind != kind) return "Arrays differ in element type";
+    switch (kind)
+    {
+    case arr_def::INTS:
+    {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += (uint64_t)a.ints[i] * (uint64_t)b.ints[i];
+        result = int_value((int64_t)sum);
+        return nullptr;
+    }
+    case arr_def::FLOATS:
+        result = float_value(float_dot(a.floats.data(), b.floats.data(), n));
+        return nullptr;
+    default:
+        return "Array elements must be all int or all float";
+    }
+}
+
+const char * array_min(const arr_def & a, type_and_value & result)
+{
+    return minmax<false>(a, result);
+}
+
+const char * array_max(const arr_def & a, type_and_value & result)
+{
+    return minmax<true>(a, result);
+}
+
+const char * array_scale(arr * a, const type_and_value & factor)
+{
+    arr_def & def = a->value;
+    if (def.size() == 0) return nullptr;
+    if (def.kind == arr_def::FLOATS && factor.t() == FLOAT)
+    {
+        SIMD_CALL(scale, def.floats.data(), def.floats.size(), factor.f());
+        return nullptr;
+    }
+    if (def.kind == arr_def::INTS && factor.t() == INT)
+    {
+        for (int64_t & x : def.ints)
+            x = (int64_t)((uint64_t)x * (uint64_t)factor.i());
+        return nullptr;
+    }
+    return "Array and factor must be all int or all float";
+}
+
+void array_fill(arr * a, const type_and_value & tv)
+{
+    a->value.fill(tv);
+    gc_write_barrier(a, tv);
+}
+
+const char * array_copy(arr * dst, const arr_def & src)
+{
+    arr_def & def = dst->value;
+    size_t n = src.size();
+    if (n > def.size()) return "Cannot copy into a shorter array";
+    if (&def == &src || !n) return nullptr;
+    if (def.kind == src.kind && src.kind == arr_def::INTS)
+        std::copy(src.ints.begin(), src.ints.end(), def.ints.begin());
+    else if (def.kind == src.kind && src.kind == arr_def::FLOATS)
+        std::copy(src.floats.begin(), src.floats.end(), def.floats.begin());
+    else if (def.kind == src.kind && src.kind == arr_def::BOOLS)
+        std::copy(src.bools.begin(), src.bools.end(), def.bools.begin());
+    else
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            type_and_value tv = src.get(i);
+            def.set(i, tv);
+            gc_write_barrier(dst, tv);
+        }
+    }
+    return nullptr;
+}
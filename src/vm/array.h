@@ -0,0 +1,16 @@
+// Bulk operations on whole arrays. INTS and FLOATS arrays are processed in
+// their packed storage, with AVX2 or SSE2 kernels on x86-64 and a scalar
+// fallback elsewhere. Float sums visit the elements in the same order on
+// every path, so results do not depend on the machine.
+//
+// The functions return an error message, nullptr on success.
+
+const char * array_sum(const arr_def & a, type_and_value & result);
+const char * array_dot(const arr_def & a, const arr_def & b, type_and_value & result);
+const char * array_min(const arr_def & a, type_and_value & result);
+const char * array_max(const arr_def & a, type_and_value & result);
+// Multiply every element by factor, which must have the element type
+const char * array_scale(arr * a, const type_and_value & factor);
+void array_fill(arr * a, const type_and_value & tv);
+// Copy src to the start of dst
+const char * array_copy(arr * dst, const arr_def & src);
@@ -0,0 +1,150 @@
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "vm.h"
+#include "bytecode.h"
+
+static const size_t header_size = 32;
+static const char magic[4] = {'\x7f', 'C', 'U', 'T'};
+
+static uint64_t checksum(const uint8_t * p, size_t n)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static void put_le(std::vector<uint8_t> & buf, uint64_t v, int bytes)
+{
+    for (int n = 0; n < bytes; n++)
+        buf.push_back((uint8_t)(v >> (n * 8)));
+}
+
+static uint64_t get_le(const uint8_t * p, int bytes)
+{
+    uint64_t v = 0;
+    for (int n = 0; n < bytes; n++)
+        v |= (uint64_t)p[n] << (n * 8);
+    return v;
+}
+
+mapped_script::~mapped_script()
+{
+    munmap(addr, size);
+}
+
+bool is_bytecode_file(const char * path)
+{
+    FILE * f = fopen(path, "rb");
+    if (!f) return false;
+    char buf[4];
+    bool rt = fread(buf, 1, 4, f) == 4 && !memcmp(buf, magic, 4);
+    fclose(f);
+    return rt;
+}
+
+bool save_script(const script & s, const char * path)
+{
+    std::vector<uint8_t> body(s.code.data(), s.code.data() + s.code.size());
+    for (std::string_view str : s.string_pool)
+        put_le(body, str.size(), 4);
+    for (std::string_view str : s.string_pool)
+        body.insert(body.end(), str.begin(), str.end());
+    std::vector<uint8_t> header;
+    header.insert(header.end(), magic, magic + 4);
+    put_le(header, bytecode_version, 4);
+    put_le(header, checksum(body.data(), body.size()), 8);
+    put_le(header, s.code.size(), 4);
+    put_le(header, s.string_pool.size(), 4);
+    put_le(header, s.cache_count, 4);
+    put_le(header, 0, 4);
+    FILE * f = fopen(path, "wb");
+    if (!f)
+    {
+        printf("Failed to write to bytecode file %s\n", path);
+        return false;
+    }
+    bool rt = fwrite(header.data(), 1, header.size(), f) == header.size()
+        && fwrite(body.data(), 1, body.size(), f) == body.size();
+    rt = !fclose(f) && rt;
+    if (!rt)
+        printf("Failed to write to bytecode file %s\n", path);
+    return rt;
+}
+
+static const char * parse_script(const uint8_t * p, size_t size, script & s)
+{
+    if (size < header_size || memcmp(p, magic, 4))
+        return "not a bytecode file";
+    if (get_le(p + 4, 4) != bytecode_version)
+        return "unsupported bytecode version";
+    const uint8_t * body = p + header_size;
+    size_t body_size = size - header_size;
+    if (get_le(p + 8, 8) != checksum(body, body_size))
+        return "checksum mismatch";
+    uint64_t code_size = get_le(p + 16, 4);
+    uint64_t string_count = get_le(p + 20, 4);
+    uint64_t cache_count = get_le(p + 24, 4);
+    if (cache_count > INT32_MAX || code_size + string_count * 4 > body_size)
+        return "truncated file";
+    const uint8_t * lengths = body + code_size;
+    const char * data = (const char *)lengths + string_count * 4;
+    size_t left = body_size - code_size - string_count * 4;
+    s.code = {body, code_size};
+    s.string_pool.reserve(string_count);
+    for (uint64_t i = 0; i < string_count; i++)
+    {
+        uint64_t len = get_le(lengths + i * 4, 4);
+        if (len > left)
+            return "truncated file";
+        s.string_pool.emplace_back(data, len);
+        data += len;
+        left -= len;
+    }
+    if (left)
+        return "trailing data";
+    s.cache_count = cache_count;
+    return nullptr;
+}
+
+mapped_script * load_script(const char * path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Failed to read from bytecode file %s\n", path);
+        return nullptr;
+    }
+    struct stat st;
+    void * addr = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        printf("Failed to map bytecode file %s\n", path);
+        return nullptr;
+    }
+    mapped_script * ms = new mapped_script{{}, addr, (size_t)st.st_size};
+    const char * err = parse_script((const uint8_t *)addr, ms->size, ms->s);
+    if (err)
+    {
+        printf("ERROR: Invalid bytecode file %s: %s\n", path, err);
+        delete ms;
+        return nullptr;
+    }
+    if (!check_script(ms->s))
+    {
+        delete ms;
+        return nullptr;
+    }
+    ms->s.verified = true;
+    return ms;
+}
@@ -0,0 +1,32 @@
+// Precompiled script files, written by 'cute -c' and mapped into memory by
+// the interpreter so that the code runs in place without parsing.
+//
+// All numbers are little endian:
+//
+//     magic "\x7fCUT", version (u32), checksum (u64), code size (u32),
+//     string count (u32), cache count (u32), reserved (u32)
+//     code
+//     string lengths (u32 each)
+//     string data, without terminators
+//
+// The checksum is FNV-1a over everything after the header. The magic
+// starts with a byte that no source file can start with.
+
+// Bump whenever CUTE_INSTRUCTIONS or the layout above changes
+const uint32_t bytecode_version = 4;
+
+struct mapped_script
+{
+    script s; // points into the mapping
+    void * addr;
+    size_t size;
+
+    ~mapped_script();
+};
+
+bool is_bytecode_file(const char * path);
+// Prints the reason and returns false on failure
+bool save_script(const script & s, const char * path);
+// Maps and verifies a precompiled script, prints the reason and returns
+// nullptr on failure
+mapped_script * load_script(const char * path);
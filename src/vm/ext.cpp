@@ -0,0 +1,198 @@
+#include <new>
+#include <cstring>
+#include <dlfcn.h>
+#include <unistd.h>
+#include "vm.h"
+#include "gc.h"
+#include "ext.h"
+#include "cute_ext.h"
+
+static_assert(sizeof(type_and_value) <= sizeof(cute_value), "cute_value too small");
+
+struct ext_function_def
+{
+    cute_function fn;
+    ext_function_def(cute_function fn): fn(fn) {}
+};
+
+static type_and_value from_c(const cute_value * v)
+{
+    type_and_value tv;
+    memcpy(&tv, v, sizeof(tv));
+    return tv;
+}
+
+static void to_c(cute_value * out, const type_and_value & tv)
+{
+    memcpy(out, &tv, sizeof(tv));
+}
+
+static cute_type api_type(const cute_value * v)
+{
+    return (cute_type)from_c(v).t();
+}
+
+static int64_t api_get_int(const cute_value * v)
+{
+    type_and_value tv = from_c(v);
+    return tv.t() == INT ? tv.i() : 0;
+}
+
+static double api_get_float(const cute_value * v)
+{
+    type_and_value tv = from_c(v);
+    return tv.t() == FLOAT ? tv.f() : 0;
+}
+
+static int api_get_bool(const cute_value * v)
+{
+    type_and_value tv = from_c(v);
+    return tv.t() == BOOL && tv.b();
+}
+
+static const char * api_get_string(const cute_value * v, size_t * len)
+{
+    type_and_value tv = from_c(v);
+    std::string_view data = tv.t() == STRING ? tv.s()->value.data() : std::string_view();
+    *len = data.size();
+    return data.data();
+}
+
+static size_t api_array_size(const cute_value * v)
+{
+    type_and_value tv = from_c(v);
+    return tv.t() == ARRAY ? tv.a()->value.size() : 0;
+}
+
+static void api_array_get(const cute_value * v, size_t idx, cute_value * out)
+{
+    type_and_value tv = from_c(v);
+    bool ok = tv.t() == ARRAY && idx < tv.a()->value.size();
+    to_c(out, ok ? tv.a()->value.get(idx) : nil_value());
+}
+
+static void api_set_nil(cute_value * out)
+{
+    to_c(out, nil_value());
+}
+
+static void api_set_int(cute_value * out, int64_t i)
+{
+    to_c(out, int_value(i));
+}
+
+static void api_set_float(cute_value * out, double f)
+{
+    to_c(out, float_value(f));
+}
+
+static void api_set_bool(cute_value * out, int b)
+{
+    to_c(out, bool_value(b));
+}
+
+static void api_set_string(cute_value * out, const char * s, size_t len)
+{
+    to_c(out, new_string({s, len}));
+}
+
+static void api_set_array(cute_value * out, const cute_value * items, size_t n)
+{
+    std::vector<type_and_value> values;
+    values.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        values.push_back(from_c(items + i));
+    to_c(out, new_array(values.data(), values.data() + n));
+}
+
+static const char * call_extension(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result)
+{
+    cute_function f = ((gc_obj<ext_function_def> *)fn.data)->value.fn;
+    cute_value out;
+    to_c(&out, nil_value());
+    const char * err;
+#ifndef CUTE_NAN_BOXING
+    err = f((const cute_value *)args, arg_cnt, &out);
+#else
+    // Widen the 8 byte values to the layout of the C interface
+    const uint32_t small = 8;
+    cute_value buf[small];
+    std::vector<cute_value> big(arg_cnt > small ? arg_cnt : 0);
+    cute_value * c_args = arg_cnt > small ? big.data() : buf;
+    for (uint32_t i = 0; i < arg_cnt; i++)
+        to_c(c_args + i, args[i]);
+    err = f(c_args, arg_cnt, &out);
+#endif
+    result = from_c(&out);
+    return err;
+}
+
+static void api_add_function(cute_module * m, const char * name, cute_function fn)
+{
+    obj * o = (obj *)m;
+    o->value.set(name, new_native(call_extension, new_obj<ext_function_def>(fn)));
+}
+
+static void api_add_value(cute_module * m, const char * name, const cute_value * v)
+{
+    obj * o = (obj *)m;
+    o->value.set(name, from_c(v));
+}
+
+static const cute_api api =
+{
+    CUTE_EXT_VERSION,
+    api_type, api_get_int, api_get_float, api_get_bool, api_get_string,
+    api_array_size, api_array_get,
+    api_set_nil, api_set_int, api_set_float, api_set_bool, api_set_string, api_set_array,
+    api_add_function, api_add_value,
+};
+
+// Try the CUTE_PATH directories, then the system library path. err is set
+// when a library file exists but cannot be loaded. The current directory is
+// only searched when CUTE_PATH names it, so running a script from an
+// untrusted directory does not load code from there.
+static void * open_library(std::string_view name, const char *& err)
+{
+    std::string file = "libcute_" + std::string(name) + ".so";
+    const char * env = getenv("CUTE_PATH");
+    std::string_view dirs = env ? env : "";
+    for (;;)
+    {
+        size_t end = dirs.find(':');
+        std::string_view dir = dirs.substr(0, end);
+        if (!dir.empty())
+        {
+            std::string path = std::string(dir) + "/" + file;
+            if (!access(path.c_str(), F_OK))
+            {
+                void * handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+                if (handle) return handle;
+                err = dlerror();
+                return nullptr;
+            }
+        }
+        if (end == std::string_view::npos) break;
+        dirs.remove_prefix(end + 1);
+    }
+    return dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+}
+
+const char * load_extension(std::string_view name, type_and_value & lib)
+{
+    const char * err = nullptr;
+    void * handle = open_library(name, err);
+    if (!handle) return err;
+    typedef const char * (* init_fn)(const cute_api *, cute_module *);
+    init_fn init = (init_fn)dlsym(handle, "cute_ext_init");
+    if (!init)
+    {
+        dlclose(handle);
+        return "cute_ext_init not found";
+    }
+    // Never unloaded, its functions stay reachable through the library object
+    type_and_value module = new_empty_object();
+    err = init(&api, (cute_module *)module.o());
+    if (!err) lib = module;
+    return err;
+}
@@ -0,0 +1,6 @@
+// Native extensions loaded with dlopen, see include/cute_ext.h
+
+// Load libcute_<name>.so and build its library object. Returns an error
+// message, nullptr on success. lib is left null if there is no such
+// library.
+const char * load_extension(std::string_view name, type_and_value & lib);
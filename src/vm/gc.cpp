@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <cstdlib>
+#include "vm.h"
+#include "gc.h"
+
+struct gc_page
+{
+    size_t cls;
+    size_t slot_size;
+    char * top; // end of the slots handed out so far
+    bool young; // holds objects allocated since the last collection
+    uint64_t free_bits[gc_page_size / gc_slot_unit / 64];
+
+    char * begin();
+    bool is_free(size_t idx) const { return free_bits[idx / 64] >> (idx % 64) & 1; }
+    void set_free(size_t idx) { free_bits[idx / 64] |= (uint64_t)1 << (idx % 64); }
+    void clear_free(size_t idx) { free_bits[idx / 64] &= ~((uint64_t)1 << (idx % 64)); }
+};
+
+static const size_t page_header = (sizeof(gc_page) + gc_slot_unit - 1) / gc_slot_unit * gc_slot_unit;
+
+char * gc_page::begin()
+{
+    return (char *)this + page_header;
+}
+
+static gc_page * page_of(void * p)
+{
+    return (gc_page *)((uintptr_t)p & ~(uintptr_t)(gc_page_size - 1));
+}
+
+struct free_slot
+{
+    free_slot * next;
+};
+
+__thread gc_heap * gc_current;
+
+static const size_t gc_old_min_limit = 8 << 20;
+
+gc_heap::gc_heap():
+    cursors(), young_bytes(0), young_limit(1 << 20), classes(),
+    old_bytes(0), old_limit(gc_old_min_limit), major(false)
+{
+}
+
+static void set_young(gc_page * page)
+{
+    if (!page->young)
+    {
+        page->young = true;
+        gc_current->young_pages.push_back(page);
+    }
+}
+
+static void * new_page(size_t cls)
+{
+    gc_size_class & sc = gc_current->classes[cls];
+    gc_cursor & c = gc_current->cursors[cls];
+    if (sc.current)
+        sc.current->top = c.bump;
+    gc_page * page = (gc_page *)aligned_alloc(gc_page_size, gc_page_size);
+    if (!page)
+        throw std::bad_alloc();
+    page->cls = cls;
+    page->slot_size = (cls + 1) * gc_slot_unit;
+    page->young = false;
+    std::fill(std::begin(page->free_bits), std::end(page->free_bits), 0);
+    sc.pages.push_back(page);
+    sc.current = page;
+    set_young(page);
+    size_t slot_count = (gc_page_size - page_header) / page->slot_size;
+    c.bump = page->begin() + page->slot_size;
+    c.limit = page->begin() + slot_count * page->slot_size;
+    page->top = c.bump;
+    return page->begin();
+}
+
+void * gc_alloc_slow(size_t cls)
+{
+    gc_size_class & sc = gc_current->classes[cls];
+    free_slot * slot = sc.free_list;
+    if (!slot)
+        return new_page(cls);
+    sc.free_list = slot->next;
+    gc_page * page = page_of(slot);
+    page->clear_free(((char *)slot - page->begin()) / page->slot_size);
+    set_young(page);
+    return slot;
+}
+
+void gc_account(size_t size)
+{
+    gc_current->young_bytes += size;
+}
+
+void gc_remember(gc_base_obj * obj)
+{
+    obj->gc_flags |= GC_REMEMBERED;
+    gc_current->remembered.push_back(obj);
+}
+
+void gc_mark(gc_base_obj * obj)
+{
+    if (!obj || obj->gc_flags & (GC_MARKED | GC_PINNED))
+        return;
+    if (!gc_current->major && obj->gc_flags & GC_OLD)
+        return;
+    obj->gc_flags |= GC_MARKED;
+    gc_current->gray.push_back(obj);
+}
+
+void gc_mark(const type_and_value & tv)
+{
+    switch (tv.t())
+    {
+    case INT: gc_mark(tv.boxed()); break;
+    case STRING: gc_mark(tv.s()); break;
+    case OBJECT: gc_mark(tv.o()); break;
+    case ARRAY: gc_mark(tv.a()); break;
+    case CLOSURE: gc_mark(tv.c()); break;
+    }
+}
+
+template<>
+void gc_obj<str_def>::gc_trace()
+{
+    gc_mark(value.left);
+    gc_mark(value.right);
+    gc_mark(value.owner);
+}
+
+template<>
+void gc_obj<obj_def>::gc_trace()
+{
+    for (auto & tv : value.slots)
+        gc_mark(tv);
+    for (auto & e : value.dict)
+    {
+        gc_mark(e.key);
+        gc_mark(e.value);
+    }
+}
+
+template<>
+void gc_obj<arr_def>::gc_trace()
+{
+    for (auto & tv : value.values)
+        gc_mark(tv);
+}
+
+template<>
+void gc_obj<closure_def>::gc_trace()
+{
+    gc_mark(value.super);
+    gc_mark(value.data);
+}
+
+template<>
+void gc_obj<closure_info_def>::gc_trace()
+{
+    gc_mark(value.super);
+    gc_mark(value.self);
+}
+
+void gc_begin()
+{
+    gc_heap & h = *gc_current;
+    h.major = h.old_bytes >= h.old_limit;
+    if (!h.major)
+    {
+        // Old objects holding young references act as extra roots
+        for (gc_base_obj * obj : h.remembered)
+            obj->gc_trace();
+    }
+}
+
+static void drain_gray()
+{
+    std::vector<gc_base_obj *> & gray = gc_current->gray;
+    while (!gray.empty())
+    {
+        gc_base_obj * obj = gray.back();
+        gray.pop_back();
+        obj->gc_trace();
+    }
+}
+
+static void free_obj(gc_page * page, size_t idx, gc_base_obj * obj)
+{
+    obj->~gc_base_obj();
+    page->set_free(idx);
+}
+
+// Sweep one page, returns the number of live objects left on it.
+// Only young objects are considered unless it is a major collection.
+static size_t sweep_page(gc_page * page, bool thread_free)
+{
+    gc_heap & h = *gc_current;
+    gc_size_class & sc = h.classes[page->cls];
+    size_t live = 0, idx = 0;
+    for (char * p = page->begin(); p < page->top; p += page->slot_size, idx++)
+    {
+        if (!page->is_free(idx))
+        {
+            gc_base_obj * obj = (gc_base_obj *)p;
+            if (obj->gc_flags & GC_MARKED || !h.major && obj->gc_flags & GC_OLD)
+            {
+                // A major collection recounts the old generation from zero
+                if (h.major || !(obj->gc_flags & GC_OLD))
+                    h.old_bytes += page->slot_size;
+                obj->gc_flags = GC_OLD;
+                live++;
+                continue;
+            }
+            free_obj(page, idx, obj);
+            if (!thread_free)
+            {
+                free_slot * slot = (free_slot *)p;
+                slot->next = sc.free_list;
+                sc.free_list = slot;
+            }
+        }
+        if (thread_free)
+        {
+            free_slot * slot = (free_slot *)p;
+            slot->next = sc.free_list;
+            sc.free_list = slot;
+        }
+    }
+    return live;
+}
+
+void gc_end()
+{
+    gc_heap & h = *gc_current;
+    drain_gray();
+    // Every young object will be dead or promoted. Cleared before the
+    // sweep, which frees remembered objects that died in a major collection.
+    for (gc_base_obj * obj : h.remembered)
+        obj->gc_flags &= ~GC_REMEMBERED;
+    h.remembered.clear();
+    for (size_t cls = 0; cls < gc_size_class_count; cls++)
+        if (h.classes[cls].current)
+            h.classes[cls].current->top = h.cursors[cls].bump;
+    if (h.major)
+    {
+        // Rebuild the free lists from scratch and give empty pages back
+        h.old_bytes = 0;
+        for (gc_size_class & sc : h.classes)
+        {
+            sc.free_list = nullptr;
+            size_t n = 0;
+            for (gc_page * page : sc.pages)
+            {
+                page->young = false;
+                free_slot * saved = sc.free_list;
+                if (sweep_page(page, true) || page == sc.current)
+                    sc.pages[n++] = page;
+                else
+                {
+                    sc.free_list = saved;
+                    free(page);
+                }
+            }
+            sc.pages.resize(n);
+        }
+    }
+    else
+    {
+        for (gc_page * page : h.young_pages)
+        {
+            sweep_page(page, false);
+            page->young = false;
+        }
+    }
+    h.young_pages.clear();
+    for (gc_size_class & sc : h.classes)
+        if (sc.current)
+            set_young(sc.current);
+    h.young_bytes = 0;
+    if (h.major)
+        h.old_limit = std::max(gc_old_min_limit, h.old_bytes * 2);
+}
+
+static void free_heap(gc_heap & h)
+{
+    for (size_t cls = 0; cls < gc_size_class_count; cls++)
+    {
+        gc_size_class & sc = h.classes[cls];
+        if (sc.current)
+            sc.current->top = h.cursors[cls].bump;
+        for (gc_page * page : sc.pages)
+        {
+            size_t idx = 0;
+            for (char * p = page->begin(); p < page->top; p += page->slot_size, idx++)
+                if (!page->is_free(idx))
+                    ((gc_base_obj *)p)->~gc_base_obj();
+            free(page);
+        }
+        sc = gc_size_class();
+        h.cursors[cls] = gc_cursor();
+    }
+    h.young_pages.clear();
+    h.remembered.clear();
+    h.young_bytes = 0;
+    h.old_bytes = 0;
+    h.old_limit = gc_old_min_limit;
+}
+
+void gc_cleanup()
+{
+    free_heap(*gc_current);
+}
+
+gc_heap::~gc_heap()
+{
+    free_heap(*this);
+    for (auto & p : intern_table)
+        delete p.second;
+}
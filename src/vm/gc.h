@@ -0,0 +1,112 @@
+// Generational mark-sweep collector.
+//
+// New objects are allocated young. A minor collection marks from the roots
+// and the remembered set without entering old objects, frees unreachable
+// young objects and promotes the survivors. A major collection marks and
+// sweeps the whole heap; it runs when the old generation outgrows its budget.
+//
+// Collections only happen when the mutator asks for one at a safe point
+// (gc_should_collect), since allocation never collects by itself.
+//
+// Objects live in GC-managed pages, one size class per page. Allocation
+// bumps a pointer through the current page of the size class and falls back
+// to the free slots left by earlier sweeps. Sweeping walks the pages.
+
+const size_t gc_page_size = 64 << 10;
+const size_t gc_slot_unit = 16;
+const size_t gc_size_class_count = 16;
+
+struct gc_cursor
+{
+    char * bump;
+    char * limit;
+};
+
+struct gc_page;
+struct free_slot;
+
+struct gc_size_class
+{
+    std::vector<gc_page *> pages;
+    gc_page * current;
+    free_slot * free_list;
+};
+
+// A heap holds the objects of one interpreter, along with the interned
+// strings and shapes they refer to. Allocation and collection work on the
+// current heap of the thread, so heaps on different threads are independent
+// and one thread can switch between several.
+struct gc_heap
+{
+    gc_cursor cursors[gc_size_class_count];
+    size_t young_bytes;
+    size_t young_limit;
+    gc_size_class classes[gc_size_class_count];
+    std::vector<gc_page *> young_pages;
+    std::vector<gc_base_obj *> remembered;
+    std::vector<gc_base_obj *> gray;
+    size_t old_bytes;
+    size_t old_limit;
+    bool major;
+    std::unordered_map<std::string_view, str *> intern_table;
+    shape root_shape;
+
+    gc_heap();
+    gc_heap(const gc_heap &) = delete;
+    // Frees all objects and interned strings, must not be current
+    ~gc_heap();
+};
+
+// __thread rather than thread_local, which would go through a wrapper
+// function on every allocation
+extern __thread gc_heap * gc_current;
+
+void * gc_alloc_slow(size_t cls);
+void gc_account(size_t size);
+
+template<typename T>
+inline void * gc_alloc()
+{
+    const size_t cls = (sizeof(T) - 1) / gc_slot_unit;
+    const size_t slot_size = (cls + 1) * gc_slot_unit;
+    static_assert(cls < gc_size_class_count, "Object too large for the gc heap");
+    gc_heap * h = gc_current;
+    h->young_bytes += slot_size;
+    gc_cursor & c = h->cursors[cls];
+    if (c.limit - c.bump >= slot_size)
+    {
+        void * p = c.bump;
+        c.bump += slot_size;
+        return p;
+    }
+    return gc_alloc_slow(cls);
+}
+
+template<typename T, typename ... Args>
+inline gc_obj<T> * new_obj(Args ... args)
+{
+    gc_obj<T> * obj = new (gc_alloc<gc_obj<T>>()) gc_obj<T>(args ...);
+    obj->gc_flags = 0;
+    return obj;
+}
+
+inline bool gc_should_collect()
+{
+    return gc_current->young_bytes >= gc_current->young_limit;
+}
+
+void gc_begin();
+void gc_mark(gc_base_obj * obj);
+void gc_mark(const type_and_value & tv);
+void gc_end();
+// Free every object of the current heap, interned strings stay
+void gc_cleanup();
+
+void gc_remember(gc_base_obj * obj);
+
+// Must be called whenever a reference is stored into an existing object
+inline void gc_write_barrier(gc_base_obj * container, const type_and_value & tv)
+{
+    if ((container->gc_flags & (GC_OLD | GC_REMEMBERED)) == GC_OLD && tv.is_ref())
+        gc_remember(container);
+}
@@ -0,0 +1,199 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <string_view>
+#include <unistd.h>
+#include "vm.h"
+#include "io.h"
+
+// Per thread, so that vms on different threads don't share buffers
+static thread_local std::vector<char> out_buf(1 << 16);
+static thread_local size_t out_len = 0;
+static thread_local bool out_held = false;
+
+static thread_local std::vector<char> in_buf(1 << 16);
+static thread_local size_t in_pos = 0, in_end = 0;
+static thread_local bool in_eof = false;
+
+// Writes larger than PIPE_BUF are not atomic, threads take turns so their
+// pieces don't interleave
+static std::mutex out_mutex;
+
+static void write_all(const char * p, size_t n)
+{
+    std::lock_guard<std::mutex> lock(out_mutex);
+    while (n)
+    {
+        ssize_t w = write(STDOUT_FILENO, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return; // nowhere to report it, like puts
+        p += w;
+        n -= w;
+    }
+}
+
+void io_flush()
+{
+    if (out_held) return;
+    write_all(out_buf.data(), out_len);
+    out_len = 0;
+}
+
+void io_hold(bool hold)
+{
+    out_held = hold;
+    if (hold) return;
+    io_flush();
+    // Don't keep a large run's buffer around
+    if (out_buf.size() > 1 << 16)
+    {
+        out_buf.resize(1 << 16);
+        out_buf.shrink_to_fit();
+    }
+}
+
+// Room for n more bytes at the end of the output buffer, grown instead of
+// flushed while output is held
+static char * out_reserve(size_t n)
+{
+    if (out_buf.size() - out_len < n)
+    {
+        if (out_held)
+            out_buf.resize(std::max(out_buf.size() * 2, out_len + n));
+        else
+            io_flush();
+    }
+    return out_buf.data() + out_len;
+}
+
+void io_write(std::string_view s)
+{
+    if (!out_held && s.size() >= out_buf.size())
+    {
+        io_flush();
+        write_all(s.data(), s.size());
+        return;
+    }
+    memcpy(out_reserve(s.size()), s.data(), s.size());
+    out_len += s.size();
+}
+
+static size_t format_int(char * p, int64_t i)
+{
+    char digits[20];
+    int n = 0;
+    uint64_t u = i < 0 ? 0 - (uint64_t)i : i;
+    do
+    {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    }
+    while (u);
+    size_t len = 0;
+    if (i < 0) p[len++] = '-';
+    while (n) p[len++] = digits[--n];
+    return len;
+}
+
+std::string_view format_value(const type_and_value & tv, char * buf)
+{
+    switch (tv.t())
+    {
+    case NIL: return "null";
+    case INT: return {buf, format_int(buf, tv.i())};
+    case FLOAT: return {buf, (size_t)snprintf(buf, format_max, "%f", tv.f())};
+    case BOOL: return tv.b() ? "true" : "false";
+    case STRING: return tv.s()->value.data();
+    case OBJECT: return {buf, (size_t)snprintf(buf, format_max, "object@%p", tv.o())};
+    case ARRAY: return {buf, (size_t)snprintf(buf, format_max, "array@%p", tv.a())};
+    case CLOSURE: return {buf, (size_t)snprintf(buf, format_max, "closure@%p", tv.c())};
+    default: return {};
+    }
+}
+
+void io_write_value(const type_and_value & tv)
+{
+    char * buf = out_reserve(format_max);
+    std::string_view text = format_value(tv, buf);
+    if (text.data() == buf)
+        out_len += text.size();
+    else
+        io_write(text);
+}
+
+// Read more input after the unconsumed part, which moves to the front of
+// the buffer. Returns false when nothing more came.
+static bool refill()
+{
+    if (in_eof) return false;
+    // Show prompts before blocking on input
+    io_flush();
+    memmove(in_buf.data(), in_buf.data() + in_pos, in_end - in_pos);
+    in_end -= in_pos;
+    in_pos = 0;
+    if (in_end == in_buf.size())
+        in_buf.resize(in_buf.size() * 2);
+    for (;;)
+    {
+        ssize_t r = read(STDIN_FILENO, in_buf.data() + in_end, in_buf.size() - in_end);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0)
+        {
+            in_eof = true;
+            return false;
+        }
+        in_end += r;
+        return true;
+    }
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c >= '\t' && c <= '\r';
+}
+
+bool io_read_token(std::string_view & token)
+{
+    for (;;)
+    {
+        while (in_pos < in_end && is_space(in_buf[in_pos]))
+            in_pos++;
+        if (in_pos < in_end) break;
+        if (!refill()) return false;
+    }
+    size_t len = 0;
+    for (;;)
+    {
+        while (in_pos + len < in_end && !is_space(in_buf[in_pos + len]))
+            len++;
+        if (in_pos + len < in_end || !refill()) break;
+    }
+    token = {in_buf.data() + in_pos, len};
+    in_pos += len;
+    return true;
+}
+
+bool io_read_line(std::string_view & line)
+{
+    size_t len = 0;
+    const char * nl;
+    while (!(nl = (const char *)memchr(in_buf.data() + in_pos + len, '\n', in_end - in_pos - len)))
+    {
+        len = in_end - in_pos;
+        if (!refill())
+        {
+            if (!len) return false;
+            line = {in_buf.data() + in_pos, len};
+            in_pos = in_end;
+            return true;
+        }
+    }
+    len = nl - (in_buf.data() + in_pos);
+    line = {in_buf.data() + in_pos, len};
+    in_pos += len + 1;
+    if (len && line[len - 1] == '\r')
+        line.remove_suffix(1);
+    return true;
+}
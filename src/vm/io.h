@@ -0,0 +1,31 @@
+// Buffered standard input and output behind IN and OUT.
+//
+// Output collects in a large buffer that is written out when full, before
+// reading input and on io_flush, which the VM calls when a script ends or
+// fails. Anything else printing to stdout must flush first.
+//
+// Reads return views into the input buffer, valid until the next read.
+//
+// Each thread has buffers of its own. Output of threads interleaves at
+// flushes, unless it is held, and threads reading stdin each get whatever
+// their reads return.
+
+// Longest text format_value writes
+const size_t format_max = 400; // "%f" of the largest double takes 316
+
+// Text of tv as OUT prints it. Numbers and references are written to buf,
+// which must have room for format_max characters.
+std::string_view format_value(const type_and_value & tv, char * buf);
+
+void io_write(std::string_view s);
+// Write the value as OUT prints it, without building a string for numbers
+void io_write_value(const type_and_value & tv);
+void io_flush();
+// While held, output of the thread is kept in memory however long it gets
+// and flushes do nothing. Releasing it writes it all out in one piece.
+void io_hold(bool hold);
+
+// Next whitespace separated token, false at the end of input
+bool io_read_token(std::string_view & token);
+// Next line without its line break, false at the end of input
+bool io_read_line(std::string_view & line);
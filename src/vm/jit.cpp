@@ -0,0 +1,568 @@
+#include <unordered_map>
+#include <cstring>
+#include <sys/mman.h>
+#include "vm.h"
+#include "jit.h"
+
+// The templates rely on the 16 byte type_and_value layout
+#if defined(__x86_64__) && defined(__linux__) && !defined(CUTE_NAN_BOXING)
+
+struct jit_code
+{
+    uint8_t * mem;
+    size_t size;
+    size_t max_depth;
+    std::unordered_map<int, uint32_t> entries; // pc -> offset in mem
+};
+
+static const int operand_counts[] =
+{
+#define X(op, args, imm) args,
+    CUTE_INSTRUCTIONS(X)
+#undef X
+};
+
+static const int immediate_sizes[] =
+{
+#define X(op, args, imm) imm,
+    CUTE_INSTRUCTIONS(X)
+#undef X
+};
+
+struct jit_instr
+{
+    int pc;
+    int next;
+    uint8_t op;
+    uint32_t arg[3];
+    int64_t imm;
+    int target; // jumps only
+};
+
+static uint64_t read_le(const uint8_t * p, int bytes)
+{
+    uint64_t v = 0;
+    for (int n = 0; n < bytes; n++)
+        v |= (uint64_t)p[n] << (n * 8);
+    return v;
+}
+
+// The code has passed verify_script, so decoding needs no checks
+static jit_instr decode(const code_view & code, int pc)
+{
+    jit_instr ins{pc};
+    bool wide = code[pc] == WIDE;
+    if (wide) pc++;
+    ins.op = code[pc++];
+    int width = wide ? 4 : 1;
+    for (int n = 0; n < operand_counts[ins.op]; n++, pc += width)
+        ins.arg[n] = read_le(code.data() + pc, width);
+    int imm = immediate_sizes[ins.op];
+    uint64_t v = read_le(code.data() + pc, imm);
+    ins.imm = imm && imm < 8 ? (int64_t)(v << (64 - imm * 8)) >> (64 - imm * 8) : v;
+    pc += imm;
+    ins.next = pc;
+    ins.target = -1;
+    switch (ins.op)
+    {
+    case JUMP:
+    case JUMP_IF:
+    case JUMP_UNLESS:
+    case JUMP_UNLESS_EQ:
+    case JUMP_UNLESS_NE:
+    case JUMP_UNLESS_GT:
+    case JUMP_UNLESS_LT:
+    case JUMP_UNLESS_GE:
+    case JUMP_UNLESS_LE:
+        ins.target = pc + (wide ? (int32_t)ins.arg[0] : (int8_t)ins.arg[0]);
+        break;
+    }
+    return ins;
+}
+
+// Change of the stack depth caused by an instruction
+static int stack_effect(const jit_instr & ins)
+{
+    switch (ins.op)
+    {
+    case LOAD: case LOAD_SUPER: case PUSH_BINT: case PUSH_WINT: case PUSH_DWINT:
+    case PUSH_INT: case PUSH_FLOAT: case PUSH_STRING: case PUSH_CLOSURE:
+    case PUSH_ARG: case PUSH_SELF: case PUSH_SUPER: case DUP: case IN:
+    case LOAD_LIB: case LOAD_LOCAL: case LOAD_LOCAL_FIELD:
+        return 1;
+    case LOAD_FIELD: case POS: case NEG: case BINV: case NOT: case LEN:
+    case JUMP: case RETURN: case ADD_BINT: case NEW_COROUTINE:
+        return 0;
+    case STORE_FIELD: case JUMP_UNLESS_EQ: case JUMP_UNLESS_NE: case JUMP_UNLESS_GT:
+    case JUMP_UNLESS_LT: case JUMP_UNLESS_GE: case JUMP_UNLESS_LE:
+        return -2;
+    case STORE_ITEM:
+        return -3;
+    case NEW_ARRAY:
+        return 1 - (int)ins.arg[0];
+    case CALL:
+        return -(int)ins.arg[0];
+    case ENTER:
+        return ins.arg[0];
+    default: // stores, binary operators and conditional jumps
+        return -1;
+    }
+}
+
+enum reg {RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI};
+
+// Machine code buffer with just the x86-64 encodings the templates use.
+// In templates rax holds value_stack::last, rbx the jit_context and r12
+// the value_stack.
+struct assembler
+{
+    std::vector<uint8_t> buf;
+
+    void b(std::initializer_list<uint8_t> bytes) { buf.insert(buf.end(), bytes); }
+    void d32(uint32_t v) { for (int n = 0; n < 4; n++) buf.push_back(v >> (n * 8)); }
+    void d64(uint64_t v) { for (int n = 0; n < 8; n++) buf.push_back(v >> (n * 8)); }
+    size_t pos() const { return buf.size(); }
+
+    // Jumps with a 32 bit displacement to be patched by bind()
+    size_t jmp() { b({0xE9}); d32(0); return pos() - 4; }
+    size_t jcc(uint8_t cc) { b({0x0F, (uint8_t)(0x80 | cc)}); d32(0); return pos() - 4; }
+    void bind(size_t fixup, size_t to)
+    {
+        uint32_t rel = (uint32_t)(to - (fixup + 4));
+        memcpy(&buf[fixup], &rel, 4);
+    }
+    void bind(size_t fixup) { bind(fixup, pos()); }
+
+    void load_last() { b({0x49, 0x8B, 0x44, 0x24, 0x08}); } // mov rax, [r12+8]
+    void store_last() { b({0x49, 0x89, 0x44, 0x24, 0x08}); } // mov [r12+8], rax
+    void adjust_last(int8_t n) { b({0x49, 0x83, 0x44, 0x24, 0x08, (uint8_t)n}); } // add qword [r12+8], n
+    void add_rax(int8_t n) { b({0x48, 0x83, 0xC0, (uint8_t)n}); } // add rax, n
+    // mov ecx, [rax+d]
+    void load_type(reg r, int8_t d) { b({0x8B, (uint8_t)(0x40 | r << 3), (uint8_t)d}); }
+    // mov r, [rax+d]
+    void load_value(reg r, int8_t d) { b({0x48, 0x8B, (uint8_t)(0x40 | r << 3), (uint8_t)d}); }
+    // mov [rax+d], r
+    void store_value(reg r, int8_t d) { b({0x48, 0x89, (uint8_t)(0x40 | r << 3), (uint8_t)d}); }
+    // mov dword [rax+d], t
+    void store_type(int8_t d, uint32_t t) { b({0xC7, 0x40, (uint8_t)d}); d32(t); }
+    // cmp dword [rax+d], t
+    void cmp_type(int8_t d, uint8_t t) { b({0x83, 0x78, (uint8_t)d, t}); }
+    // rcx = address of local slot n
+    void local_addr(uint32_t n)
+    {
+        b({0x49, 0x8B, 0x0C, 0x24}); // mov rcx, [r12]
+        b({0x48, 0x8B, 0x53, 0x08}); // mov rdx, [rbx+8]
+        b({0x48, 0x81, 0xC2}); d32(n); // add rdx, n
+        b({0x48, 0xC1, 0xE2, 0x04}); // shl rdx, 4
+        b({0x48, 0x01, 0xD1}); // add rcx, rdx
+    }
+    void call(const void * fn)
+    {
+        b({0x48, 0xB8}); d64((uint64_t)fn); // mov rax, fn
+        b({0xFF, 0xD0}); // call rax
+    }
+};
+
+enum cond : uint8_t {CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB,
+    CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF};
+
+struct compiler
+{
+    assembler a;
+    const jit_helpers & helpers;
+    std::vector<std::pair<size_t, int>> exits; // jump fixups to the exit of a pc
+    std::vector<std::pair<size_t, int>> jumps; // jump fixups to a pc
+    size_t exit_label; // offset of the common epilogue
+
+    compiler(const jit_helpers & helpers): helpers(helpers) {}
+
+    void deopt(size_t fixup, int pc) { exits.push_back({fixup, pc}); }
+
+    // Guard that the two top values have the same type and fall through
+    // for INT. The returned jump is to be bound to float_guard().
+    size_t number_guard(const jit_instr & ins)
+    {
+        a.load_last();
+        a.load_type(RCX, -32);
+        a.b({0x3B, 0x48, 0xF0}); // cmp ecx, [rax-16]
+        deopt(a.jcc(CC_NE), ins.pc);
+        a.b({0x83, 0xF9, INT}); // cmp ecx, INT
+        return a.jcc(CC_NE);
+    }
+
+    void float_guard(size_t to_float, const jit_instr & ins)
+    {
+        a.bind(to_float);
+        a.b({0x83, 0xF9, FLOAT}); // cmp ecx, FLOAT
+        deopt(a.jcc(CC_NE), ins.pc);
+    }
+
+    void arith(const jit_instr & ins)
+    {
+        size_t to_float = number_guard(ins);
+        size_t done = 0;
+        if (ins.op == DIV)
+            deopt(a.jmp(), ins.pc); // integer division can trap, leave it to the VM
+        else
+        {
+            a.load_value(RCX, -8);
+            switch (ins.op)
+            {
+            case ADD: a.b({0x48, 0x01, 0x48, 0xE8}); break; // add [rax-24], rcx
+            case SUB: a.b({0x48, 0x29, 0x48, 0xE8}); break; // sub [rax-24], rcx
+            case MUL:
+                a.load_value(RDX, -24);
+                a.b({0x48, 0x0F, 0xAF, 0xD1}); // imul rdx, rcx
+                a.store_value(RDX, -24);
+                break;
+            }
+            done = a.jmp();
+        }
+        float_guard(to_float, ins);
+        uint8_t sse = ins.op == ADD ? 0x58 : ins.op == SUB ? 0x5C : ins.op == MUL ? 0x59 : 0x5E;
+        a.b({0xF2, 0x0F, 0x10, 0x40, 0xE8}); // movsd xmm0, [rax-24]
+        a.b({0xF2, 0x0F, sse, 0x40, 0xF8}); // op xmm0, [rax-8]
+        a.b({0xF2, 0x0F, 0x11, 0x40, 0xE8}); // movsd [rax-24], xmm0
+        if (done) a.bind(done);
+        a.add_rax(-16);
+        a.store_last();
+    }
+
+    // Leaves the result of comparing the two top values in dl
+    void compare(const jit_instr & ins, uint8_t op)
+    {
+        size_t to_float = number_guard(ins);
+        a.load_value(RCX, -24);
+        a.b({0x48, 0x3B, 0x48, 0xF8}); // cmp rcx, [rax-8]
+        uint8_t cc = op == CMP_EQ ? CC_E : op == CMP_NE ? CC_NE : op == CMP_GT ? CC_G
+            : op == CMP_LT ? CC_L : op == CMP_GE ? CC_GE : CC_LE;
+        a.b({0x0F, (uint8_t)(0x90 | cc), 0xC2}); // setcc dl
+        size_t done = a.jmp();
+        float_guard(to_float, ins);
+        // Unordered compares (NaN) set ZF, PF and CF. The VM computes GE
+        // and LE as !(a < b) and !(a > b), so they hold for NaN.
+        bool swap = op == CMP_LT || op == CMP_GE;
+        a.b({0xF2, 0x0F, 0x10, 0x40, (uint8_t)(swap ? 0xF8 : 0xE8)}); // movsd xmm0, [a]
+        a.b({0x66, 0x0F, 0x2E, 0x40, (uint8_t)(swap ? 0xE8 : 0xF8)}); // ucomisd xmm0, [b]
+        switch (op)
+        {
+        case CMP_EQ:
+            a.b({0x0F, 0x94, 0xC2, 0x0F, 0x9B, 0xC1, 0x20, 0xCA}); // sete dl; setnp cl; and dl, cl
+            break;
+        case CMP_NE:
+            a.b({0x0F, 0x95, 0xC2, 0x0F, 0x9A, 0xC1, 0x08, 0xCA}); // setne dl; setp cl; or dl, cl
+            break;
+        case CMP_GT:
+        case CMP_LT:
+            a.b({0x0F, 0x97, 0xC2}); // seta dl
+            break;
+        default:
+            a.b({0x0F, 0x96, 0xC2}); // setbe dl
+            break;
+        }
+        a.bind(done);
+        a.b({0x0F, 0xB6, 0xD2}); // movzx edx, dl
+    }
+
+    void poll()
+    {
+        a.b({0x48, 0x89, 0xDF}); // mov rdi, rbx
+        a.call((const void *)helpers.poll);
+    }
+
+    void branch(const jit_instr & ins, uint8_t cc)
+    {
+        jumps.push_back({a.jcc(cc), ins.target});
+    }
+
+    void push_const(type t, int64_t v)
+    {
+        a.load_last();
+        a.store_type(0, t);
+        if (v >= INT32_MIN && v <= INT32_MAX)
+        {
+            a.b({0x48, 0xC7, 0x40, 0x08}); a.d32(v); // mov qword [rax+8], v
+        }
+        else
+        {
+            a.b({0x48, 0xB9}); a.d64(v); // mov rcx, v
+            a.store_value(RCX, 8);
+        }
+        a.add_rax(16);
+        a.store_last();
+    }
+
+    void call_helper(const jit_instr & ins, jit_helper fn)
+    {
+        a.b({0x48, 0x89, 0xDF}); // mov rdi, rbx
+        a.b({0xBE}); a.d32(ins.arg[0]); // mov esi, arg0
+        a.b({0xBA}); a.d32(ins.arg[1]); // mov edx, arg1
+        a.b({0xB9}); a.d32(ins.arg[2]); // mov ecx, arg2
+        a.call((const void *)fn);
+        a.b({0x85, 0xC0}); // test eax, eax
+        deopt(a.jcc(CC_NE), ins.pc);
+    }
+
+    // Emit the template of one instruction, false if it has none
+    bool emit(const jit_instr & ins)
+    {
+        switch (ins.op)
+        {
+        case PUSH_BINT:
+        case PUSH_WINT:
+        case PUSH_DWINT:
+        case PUSH_INT:
+            push_const(INT, ins.imm);
+            return true;
+        case PUSH_FLOAT:
+            push_const(FLOAT, ins.imm);
+            return true;
+        case POP:
+            a.adjust_last(-16);
+            return true;
+        case DUP:
+            a.load_last();
+            a.load_value(RCX, -16);
+            a.store_value(RCX, 0);
+            a.load_value(RCX, -8);
+            a.store_value(RCX, 8);
+            a.adjust_last(16);
+            return true;
+        case LOAD_LOCAL:
+            a.local_addr(ins.arg[0]);
+            a.load_last();
+            a.b({0x48, 0x8B, 0x11, 0x48, 0x89, 0x10}); // mov rdx, [rcx]; mov [rax], rdx
+            a.b({0x48, 0x8B, 0x51, 0x08, 0x48, 0x89, 0x50, 0x08}); // mov rdx, [rcx+8]; mov [rax+8], rdx
+            a.adjust_last(16);
+            return true;
+        case STORE_LOCAL:
+            a.local_addr(ins.arg[0]);
+            a.load_last();
+            a.add_rax(-16);
+            a.store_last();
+            a.b({0x48, 0x8B, 0x10, 0x48, 0x89, 0x11}); // mov rdx, [rax]; mov [rcx], rdx
+            a.b({0x48, 0x8B, 0x50, 0x08, 0x48, 0x89, 0x51, 0x08}); // mov rdx, [rax+8]; mov [rcx+8], rdx
+            return true;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+            arith(ins);
+            return true;
+        case ADD_BINT:
+            a.load_last();
+            a.cmp_type(-16, INT);
+            deopt(a.jcc(CC_NE), ins.pc);
+            a.b({0x48, 0x83, 0x40, 0xF8, (uint8_t)ins.imm}); // add qword [rax-8], imm
+            return true;
+        case NEG:
+            {
+                a.load_last();
+                a.cmp_type(-16, INT);
+                size_t to_float = a.jcc(CC_NE);
+                a.b({0x48, 0xF7, 0x58, 0xF8}); // neg qword [rax-8]
+                size_t done = a.jmp();
+                a.bind(to_float);
+                a.cmp_type(-16, FLOAT);
+                deopt(a.jcc(CC_NE), ins.pc);
+                a.b({0x48, 0xB9}); a.d64(1ull << 63); // mov rcx, sign bit
+                a.b({0x48, 0x31, 0x48, 0xF8}); // xor [rax-8], rcx
+                a.bind(done);
+            }
+            return true;
+        case NOT:
+            a.load_last();
+            a.cmp_type(-16, BOOL);
+            deopt(a.jcc(CC_NE), ins.pc);
+            a.b({0x80, 0x70, 0xF8, 0x01}); // xor byte [rax-8], 1
+            return true;
+        case CMP_EQ:
+        case CMP_NE:
+        case CMP_GT:
+        case CMP_LT:
+        case CMP_GE:
+        case CMP_LE:
+            compare(ins, ins.op);
+            a.store_type(-32, BOOL);
+            a.store_value(RDX, -24);
+            a.add_rax(-16);
+            a.store_last();
+            return true;
+        case JUMP_UNLESS_EQ:
+        case JUMP_UNLESS_NE:
+        case JUMP_UNLESS_GT:
+        case JUMP_UNLESS_LT:
+        case JUMP_UNLESS_GE:
+        case JUMP_UNLESS_LE:
+            if (ins.target <= ins.pc) poll();
+            compare(ins, CMP_EQ + (ins.op - JUMP_UNLESS_EQ));
+            a.add_rax(-32);
+            a.store_last();
+            a.b({0x84, 0xD2}); // test dl, dl
+            branch(ins, CC_E);
+            return true;
+        case JUMP:
+            if (ins.target <= ins.pc) poll();
+            jumps.push_back({a.jmp(), ins.target});
+            return true;
+        case JUMP_IF:
+        case JUMP_UNLESS:
+            if (ins.target <= ins.pc) poll();
+            a.load_last();
+            a.cmp_type(-16, BOOL);
+            deopt(a.jcc(CC_NE), ins.pc);
+            a.b({0x0F, 0xB6, 0x48, 0xF8}); // movzx ecx, byte [rax-8]
+            a.add_rax(-16);
+            a.store_last();
+            a.b({0x85, 0xC9}); // test ecx, ecx
+            branch(ins, ins.op == JUMP_IF ? CC_NE : CC_E);
+            return true;
+        default:
+            if (!helpers.ops[ins.op])
+                return false;
+            call_helper(ins, helpers.ops[ins.op]);
+            return true;
+        }
+    }
+};
+
+bool jit_supported()
+{
+    return true;
+}
+
+jit_code * jit_compile(const script & s, int addr, const jit_helpers & helpers)
+{
+    // Collect the instructions reachable from the entry with their depth
+    std::unordered_map<int, jit_instr> instrs;
+    std::unordered_map<int, int> depth;
+    std::vector<int> work = {addr};
+    depth[addr] = 0;
+    int max_depth = 0;
+    while (!work.empty())
+    {
+        int pc = work.back();
+        work.pop_back();
+        if (instrs.count(pc)) continue;
+        jit_instr ins = decode(s.code, pc);
+        instrs[pc] = ins;
+        int d = depth[pc] + stack_effect(ins);
+        if (d < 0) return nullptr;
+        max_depth = std::max(max_depth, d);
+        std::vector<int> succ;
+        if (ins.target >= 0) succ.push_back(ins.target);
+        if (ins.op != JUMP && ins.op != RETURN) succ.push_back(ins.next);
+        for (int next : succ)
+        {
+            if (!depth.count(next)) depth[next] = d;
+            work.push_back(next);
+        }
+    }
+    std::vector<int> order;
+    for (auto & p : instrs)
+        order.push_back(p.first);
+    std::sort(order.begin(), order.end());
+
+    compiler c(helpers);
+    assembler & a = c.a;
+    // Entry: jit_run calls mem(ctx, target)
+    a.b({0x53, 0x41, 0x54, 0x41, 0x55}); // push rbx; push r12; push r13
+    a.b({0x48, 0x89, 0xFB}); // mov rbx, rdi
+    a.b({0x4C, 0x8B, 0x23}); // mov r12, [rbx]
+    a.b({0xFF, 0xE6}); // jmp rsi
+    c.exit_label = a.pos();
+    a.b({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop r13; pop r12; pop rbx; ret
+
+    std::unordered_map<int, uint32_t> entries;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const jit_instr & ins = instrs[order[i]];
+        entries[ins.pc] = a.pos();
+        if (!c.emit(ins))
+        {
+            a.b({0xB8}); a.d32(ins.pc); // mov eax, pc
+            a.bind(a.jmp(), c.exit_label);
+            continue;
+        }
+        // Fall through into the next instruction unless it is laid out
+        // elsewhere (unreachable code in between)
+        if (ins.op != JUMP && (i + 1 == order.size() || order[i + 1] != ins.next))
+        {
+            a.b({0xB8}); a.d32(ins.next); // mov eax, next
+            a.bind(a.jmp(), c.exit_label);
+        }
+    }
+    // Deoptimization stubs, one per instruction that can leave
+    std::unordered_map<int, size_t> stubs;
+    for (auto & e : c.exits)
+    {
+        auto p = stubs.find(e.second);
+        if (p == stubs.end())
+        {
+            p = stubs.emplace(e.second, a.pos()).first;
+            a.b({0xB8}); a.d32(e.second); // mov eax, pc
+            a.bind(a.jmp(), c.exit_label);
+        }
+        a.bind(e.first, p->second);
+    }
+    for (auto & j : c.jumps)
+        a.bind(j.first, entries.at(j.second));
+
+    size_t size = (a.buf.size() + 4095) & ~(size_t)4095;
+    void * mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return nullptr;
+    memcpy(mem, a.buf.data(), a.buf.size());
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC))
+    {
+        munmap(mem, size);
+        return nullptr;
+    }
+    return new jit_code{(uint8_t *)mem, size, (size_t)max_depth, std::move(entries)};
+}
+
+void jit_free(jit_code * code)
+{
+    munmap(code->mem, code->size);
+    delete code;
+}
+
+size_t jit_max_depth(const jit_code * code)
+{
+    return code->max_depth;
+}
+
+int jit_run(const jit_code * code, jit_context * ctx, int pc)
+{
+    auto p = code->entries.find(pc);
+    if (p == code->entries.end())
+        return pc;
+    typedef int (* entry)(jit_context *, const void *);
+    return ((entry)code->mem)(ctx, code->mem + p->second);
+}
+
+#else
+
+bool jit_supported()
+{
+    return false;
+}
+
+jit_code * jit_compile(const script & s, int addr, const jit_helpers & helpers)
+{
+    return nullptr;
+}
+
+void jit_free(jit_code * code) {}
+
+size_t jit_max_depth(const jit_code * code)
+{
+    return 0;
+}
+
+int jit_run(const jit_code * code, jit_context * ctx, int pc)
+{
+    return pc;
+}
+
+#endif
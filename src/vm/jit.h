@@ -0,0 +1,45 @@
+// Baseline JIT for x86-64 Linux, enabled with 'cute --jit'. Not available
+// with CUTE_NAN_BOXING.
+//
+// Once a closure has been entered jit_hot_threshold times, its bytecode is
+// translated instruction by instruction into machine code templates:
+// stack traffic, constants, locals and INT/FLOAT arithmetic, comparisons
+// and jumps are inlined behind type guards, field and variable accesses
+// call back into the VM. Every instruction boundary is an entry point and
+// the code works on the interpreter's own value_stack, so leaving compiled
+// code is just returning the pc to continue interpreting at. That happens
+// when a guard fails (deoptimization), a helper declines and at
+// instructions without a template such as CALL and RETURN.
+
+const int jit_hot_threshold = 50;
+
+// Passed to compiled code and helpers, the VM keeps its own state behind vm
+struct jit_context
+{
+    value_stack * stack; // read by compiled code, must stay first
+    int64_t base; // stack index of local slot 0, read by compiled code
+    void * vm;
+};
+
+// Returns 0 when the instruction is done, anything else to leave compiled
+// code before the instruction so the interpreter runs it instead. Helpers
+// must not throw.
+typedef int (* jit_helper)(jit_context * ctx, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+struct jit_helpers
+{
+    jit_helper ops[256]; // nullptr leaves compiled code at the instruction
+    void (* poll)(jit_context * ctx); // safe point at backward jumps
+};
+
+struct jit_code;
+
+bool jit_supported();
+// Compile the closure whose ENTER is at addr, nullptr if nothing to compile
+jit_code * jit_compile(const script & s, int addr, const jit_helpers & helpers);
+void jit_free(jit_code * code);
+// Stack slots the code may push beyond the frame base
+size_t jit_max_depth(const jit_code * code);
+// Run from pc, returns the pc to continue interpreting at, which is pc
+// itself if that is not an instruction of the code
+int jit_run(const jit_code * code, jit_context * ctx, int pc);
@@ -0,0 +1,221 @@
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "vm.h"
+#include "gc.h"
+#include "loop.h"
+
+__thread event_loop * loop_current;
+
+void gc_mark(const event_loop & loop)
+{
+    for (const loop_task & t : loop.ready)
+    {
+        gc_mark(t.co);
+        gc_mark(t.args);
+    }
+    for (auto & p : loop.readers)
+        gc_mark(p.second);
+    for (auto & p : loop.writers)
+        gc_mark(p.second);
+    for (const loop_timer & t : loop.timers)
+        gc_mark(t.co);
+    gc_mark(loop.current);
+}
+
+event_loop::event_loop():
+    epfd(-1), round(0), timer_seq(0), current(nil_value()),
+    wait_fd(-1), wait_events(0), wait_until(-1), timer_fired(false)
+{
+}
+
+event_loop::~event_loop()
+{
+    if (epfd >= 0) close(epfd);
+}
+
+static double now_ms()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static bool later(const loop_timer & a, const loop_timer & b)
+{
+    return a.at > b.at || a.at == b.at && a.seq > b.seq;
+}
+
+// Register with epoll the events that tasks wait for on fd. Returns false
+// if epoll does not take fd, regular files for one.
+static bool update_interest(event_loop & loop, int fd)
+{
+    uint32_t events = (loop.readers.count(fd) ? EPOLLIN : 0) | (loop.writers.count(fd) ? EPOLLOUT : 0);
+    auto p = loop.interest.find(fd);
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (!events)
+    {
+        if (p != loop.interest.end())
+        {
+            epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, &ev);
+            loop.interest.erase(p);
+        }
+        return true;
+    }
+    if (loop.epfd < 0)
+        loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (p == loop.interest.end())
+    {
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev))
+            return false;
+        loop.interest.emplace(fd, events);
+    }
+    else if (p->second != events)
+    {
+        epoll_ctl(loop.epfd, EPOLL_CTL_MOD, fd, &ev);
+        p->second = events;
+    }
+    return true;
+}
+
+void loop_spawn(const type_and_value & co, const type_and_value & args)
+{
+    loop_current->ready.push_back({co, args, false});
+}
+
+const char * loop_wait(int fd, uint32_t events)
+{
+    event_loop & loop = *loop_current;
+    if (loop.current.t() == NIL)
+    {
+        pollfd p{fd, (short)(events & EPOLLIN ? POLLIN : POLLOUT), 0};
+        while (poll(&p, 1, -1) < 0 && errno == EINTR) {}
+        return nullptr;
+    }
+    auto & waiters = events & EPOLLIN ? loop.readers : loop.writers;
+    if (waiters.count(fd))
+        return "Another task is waiting on the same descriptor";
+    loop.wait_fd = fd;
+    loop.wait_events = events;
+    return native_suspend;
+}
+
+const char * loop_sleep(double ms)
+{
+    event_loop & loop = *loop_current;
+    if (loop.current.t() == NIL)
+    {
+        timespec ts{(time_t)(ms / 1e3), (long)(fmod(ms, 1e3) * 1e6)};
+        while (nanosleep(&ts, &ts) && errno == EINTR) {}
+        return nullptr;
+    }
+    if (loop.timer_fired)
+    {
+        loop.timer_fired = false;
+        return nullptr;
+    }
+    loop.wait_until = now_ms() + ms;
+    return native_suspend;
+}
+
+void loop_forget(int fd)
+{
+    event_loop & loop = *loop_current;
+    for (auto * waiters : {&loop.readers, &loop.writers})
+    {
+        auto p = waiters->find(fd);
+        if (p == waiters->end()) continue;
+        loop.ready.push_back({p->second, nil_value(), false});
+        waiters->erase(p);
+    }
+    loop.written.erase(fd);
+    update_interest(loop, fd);
+}
+
+static void wake(event_loop & loop, std::unordered_map<int, type_and_value> & waiters, int fd)
+{
+    auto p = waiters.find(fd);
+    if (p == waiters.end()) return;
+    loop.ready.push_back({p->second, nil_value(), false});
+    waiters.erase(p);
+}
+
+// Move the tasks whose descriptor is ready or whose timer expired to the
+// ready queue, waiting for the first one if block is set
+static void poll_events(event_loop & loop, bool block)
+{
+    int timeout = block ? -1 : 0;
+    if (block && !loop.timers.empty())
+        timeout = std::max(0.0, ceil(loop.timers.front().at - now_ms()));
+    if (loop.epfd >= 0)
+    {
+        epoll_event events[256];
+        int n = epoll_wait(loop.epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            uint32_t ev = events[i].events;
+            if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                wake(loop, loop.readers, fd);
+            if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                wake(loop, loop.writers, fd);
+            update_interest(loop, fd);
+        }
+    }
+    else if (timeout > 0)
+        poll(nullptr, 0, timeout);
+    double now = now_ms();
+    while (!loop.timers.empty() && loop.timers.front().at <= now)
+    {
+        std::pop_heap(loop.timers.begin(), loop.timers.end(), later);
+        loop.ready.push_back({loop.timers.back().co, nil_value(), true});
+        loop.timers.pop_back();
+    }
+}
+
+bool loop_next(event_loop & loop, loop_task & task)
+{
+    // Tasks that keep yielding cannot hold back those waiting for events
+    while (!loop.round)
+    {
+        bool waiting = !loop.readers.empty() || !loop.writers.empty() || !loop.timers.empty();
+        if (!waiting && loop.ready.empty())
+            return false;
+        if (waiting)
+            poll_events(loop, loop.ready.empty());
+        loop.round = loop.ready.size();
+    }
+    loop.round--;
+    task = loop.ready.front();
+    loop.ready.pop_front();
+    loop.timer_fired = task.timer;
+    return true;
+}
+
+void loop_park(event_loop & loop, const type_and_value & co)
+{
+    if (loop.wait_fd >= 0)
+    {
+        int fd = loop.wait_fd;
+        auto & waiters = loop.wait_events & EPOLLIN ? loop.readers : loop.writers;
+        waiters[fd] = co;
+        loop.wait_fd = -1;
+        if (update_interest(loop, fd))
+            return;
+        // Never blocks then, try again right away
+        waiters.erase(fd);
+    }
+    else if (loop.wait_until >= 0)
+    {
+        loop.timers.push_back({loop.wait_until, loop.timer_seq++, co});
+        std::push_heap(loop.timers.begin(), loop.timers.end(), later);
+        loop.wait_until = -1;
+        return;
+    }
+    loop.ready.push_back({co, nil_value(), false});
+}
@@ -0,0 +1,73 @@
+// Event loop of a vm, run by cute::vm::run once the script body returns.
+// Its tasks are roots for the collector, like the stack.
+//
+// Tasks are coroutines handed to the loop by @aio.spawn. The loop resumes
+// ready tasks one at a time, in the order they became ready, and waits in
+// epoll when none is. A native that cannot go on until a descriptor is
+// ready calls loop_wait and returns what it returns. In a task that is
+// native_suspend: the VM takes every frame of the task off the stack,
+// those of coroutines it resumed included, and calls the native again with
+// the same arguments once the descriptor is ready. Outside of tasks
+// loop_wait blocks instead. A task that yields goes to the back of the
+// queue.
+#include <deque>
+
+struct loop_task
+{
+    type_and_value co;
+    type_and_value args; // array of arguments for the first resume, or nil
+    bool timer; // resumed because its timer expired
+};
+
+struct loop_timer
+{
+    double at; // CLOCK_MONOTONIC in ms
+    uint64_t seq; // tasks sleeping until the same time wake up in order
+    type_and_value co;
+};
+
+struct event_loop
+{
+    int epfd; // -1 until a task waits on a descriptor
+    std::deque<loop_task> ready;
+    size_t round; // tasks to resume before looking for events again
+    std::unordered_map<int, type_and_value> readers;
+    std::unordered_map<int, type_and_value> writers;
+    std::unordered_map<int, uint32_t> interest; // events registered with epoll
+    std::unordered_map<int, size_t> written; // progress of suspended writes
+    std::vector<loop_timer> timers; // heap, earliest first
+    uint64_t timer_seq;
+    type_and_value current; // task being resumed, nil outside of tasks
+    // Set by loop_wait and loop_sleep for the task being suspended
+    int wait_fd;
+    uint32_t wait_events;
+    double wait_until;
+    bool timer_fired;
+
+    event_loop();
+    event_loop(const event_loop &) = delete;
+    ~event_loop();
+};
+
+void gc_mark(const event_loop & loop);
+
+// Loop of the vm that is running on this thread, see cute::vm::begin()
+extern __thread event_loop * loop_current;
+
+// Queue the coroutine co as a new task
+void loop_spawn(const type_and_value & co, const type_and_value & args);
+// Wait until fd is ready for events (EPOLLIN or EPOLLOUT). Returns
+// native_suspend in a task, an error message if another task waits for
+// the same, otherwise nullptr once the native can try again.
+const char * loop_wait(int fd, uint32_t events);
+// Same for ms milliseconds to pass. The call made again after a task
+// wakes up returns nullptr.
+const char * loop_sleep(double ms);
+// Must be called before fd is closed, tasks waiting on it are resumed
+void loop_forget(int fd);
+
+// Next task to resume, waiting for one if none is ready. Returns false
+// once no task is left.
+bool loop_next(event_loop & loop, loop_task & task);
+// Hand back the task resumed last, which has not returned
+void loop_park(event_loop & loop, const type_and_value & co);
@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include "vm.h"
+#include "gc.h"
+#include "marshal.h"
+
+// Every item starts with a tag byte. Objects, arrays, closures and scopes
+// are numbered in the order they are first written, later occurrences are
+// written as a REF to that number. Numbers are written in native byte
+// order, the bytes never leave the process.
+//
+// Scopes are copied with only the variables that the closures reaching
+// them use, found in their code by scope_uses. A first pass finds these
+// variables and everything they reference, the second writes the values.
+// Scope objects that are also reached as values are copied whole.
+enum marshal_tag : uint8_t
+{
+    M_NIL, M_INT, M_FLOAT, M_FALSE, M_TRUE, M_STRING, M_OBJECT, M_DICT, M_ARRAY,
+    M_CLOSURE, M_NATIVE, M_REF, M_SCOPE, M_NO_SCOPE, M_SCOPE_REF
+};
+
+// Deeper values fail instead of overflowing the stack
+const int max_depth = 10000;
+
+struct writer
+{
+    std::string & out;
+    std::unordered_map<const void *, uint32_t> values;
+    std::unordered_map<const void *, uint32_t> scopes;
+    // First pass: objects, arrays and closures reached as values, and the
+    // scopes to copy with the variables to copy from them
+    std::unordered_set<const void *> reached;
+    std::unordered_map<closure_info *, std::vector<std::string_view>> needed;
+    std::unordered_map<const script *, std::unordered_map<int, std::vector<scope_use>>> uses;
+};
+
+template<typename T>
+static void put(std::string & out, T x)
+{
+    out.append((const char *)&x, sizeof(x));
+}
+
+template<typename T>
+static T get(const char *& p)
+{
+    T x;
+    memcpy(&x, p, sizeof(x));
+    p += sizeof(x);
+    return x;
+}
+
+static void put_string(std::string & out, std::string_view s)
+{
+    put<uint64_t>(out, s.size());
+    out.append(s);
+}
+
+static std::string_view get_string(const char *& p)
+{
+    size_t n = get<uint64_t>(p);
+    std::string_view s(p, n);
+    p += n;
+    return s;
+}
+
+// Writes a REF and returns true if ptr was written before, otherwise
+// numbers it
+static bool seen(writer & w, std::unordered_map<const void *, uint32_t> & memo, const void * ptr, marshal_tag ref)
+{
+    auto p = memo.find(ptr);
+    if (p != memo.end())
+    {
+        put<uint8_t>(w.out, ref);
+        put<uint32_t>(w.out, p->second);
+        return true;
+    }
+    memo.emplace(ptr, (uint32_t)memo.size());
+    return false;
+}
+
+static const char * reach_value(writer & w, const type_and_value & tv, int depth);
+
+static bool wanted(const std::vector<std::string_view> * only, str * key)
+{
+    return !only || std::find(only->begin(), only->end(), key->value.data()) != only->end();
+}
+
+// Adds the variables of the scope that a closure uses to what is copied
+static const char * reach_scope(writer & w, closure_info * ci, const scope_use & use, int depth)
+{
+    std::vector<std::string_view> & names = w.needed[ci];
+    const type_and_value & self = ci->value.self;
+    if (self.t() != OBJECT)
+        return nullptr;
+    if (use.whole)
+        return reach_value(w, self, depth);
+    std::vector<std::string_view> added;
+    for (std::string_view name : use.names)
+        if (std::find(names.begin(), names.end(), name) == names.end())
+        {
+            names.push_back(name);
+            added.push_back(name);
+        }
+    if (added.empty())
+        return nullptr;
+    const obj_def & od = self.o()->value;
+    if (od.sh)
+    {
+        for (auto & e : od.sh->index)
+            if (wanted(&added, e.key))
+                if (const char * err = reach_value(w, od.slots[e.value], depth))
+                    return err;
+        return nullptr;
+    }
+    for (auto & e : od.dict)
+        if (wanted(&added, e.key))
+            if (const char * err = reach_value(w, e.value, depth))
+                return err;
+    return nullptr;
+}
+
+static const char * reach_closure(writer & w, const closure_def & c, int depth)
+{
+    if (c.native || !c.s)
+        return nullptr;
+    auto p = w.uses.find(c.s);
+    if (p == w.uses.end())
+        p = w.uses.emplace(c.s, scope_uses(*c.s)).first;
+    auto u = p->second.find(c.addr);
+    if (u == p->second.end())
+        return nullptr;
+    closure_info * ci = c.super;
+    for (const scope_use & use : u->second)
+    {
+        if (!ci) break;
+        if (const char * err = reach_scope(w, ci, use, depth + 1))
+            return err;
+        ci = ci->value.super;
+    }
+    return nullptr;
+}
+
+static const char * reach_value(writer & w, const type_and_value & tv, int depth)
+{
+    if (++depth > max_depth)
+        return "Value is nested too deeply to copy";
+    switch (tv.t())
+    {
+    case OBJECT:
+        {
+            if (!w.reached.insert(tv.o()).second) return nullptr;
+            const obj_def & od = tv.o()->value;
+            for (auto & slot : od.slots)
+                if (const char * err = reach_value(w, slot, depth))
+                    return err;
+            for (auto & e : od.dict)
+                if (const char * err = reach_value(w, e.value, depth))
+                    return err;
+            return nullptr;
+        }
+    case ARRAY:
+        if (!w.reached.insert(tv.a()).second) return nullptr;
+        for (const type_and_value & item : tv.a()->value.values)
+            if (const char * err = reach_value(w, item, depth))
+                return err;
+        return nullptr;
+    case CLOSURE:
+        if (!w.reached.insert(tv.c()).second) return nullptr;
+        return reach_closure(w, tv.c()->value, depth);
+    default:
+        return nullptr;
+    }
+}
+
+static const char * write_value(writer & w, const type_and_value & tv, int depth);
+static const char * write_object(writer & w, const obj_def & od, int depth, const std::vector<std::string_view> * only);
+
+static const char * write_scope(writer & w, closure_info * ci, int depth)
+{
+    auto p = ci ? w.needed.find(ci) : w.needed.end();
+    if (p == w.needed.end())
+    {
+        put<uint8_t>(w.out, M_NO_SCOPE);
+        return nullptr;
+    }
+    if (seen(w, w.scopes, ci, M_SCOPE_REF))
+        return nullptr;
+    put<uint8_t>(w.out, M_SCOPE);
+    const type_and_value & self = ci->value.self;
+    const char * err;
+    if (self.t() == OBJECT && !w.reached.count(self.o()))
+        err = seen(w, w.values, self.o(), M_REF) ? nullptr : write_object(w, self.o()->value, depth, &p->second);
+    else
+        err = write_value(w, self, depth);
+    return err ? err : write_scope(w, ci->value.super, depth + 1);
+}
+
+// Writes the fields of od, or only those named in only
+static const char * write_object(writer & w, const obj_def & od, int depth, const std::vector<std::string_view> * only)
+{
+    if (od.sh)
+    {
+        // In slot order, so that the copy ends up with the same shape
+        std::vector<std::pair<uint32_t, str *>> keys;
+        for (auto & e : od.sh->index)
+            if (wanted(only, e.key))
+                keys.push_back({e.value, e.key});
+        std::sort(keys.begin(), keys.end());
+        put<uint8_t>(w.out, M_OBJECT);
+        put<uint64_t>(w.out, keys.size());
+        for (auto & k : keys)
+        {
+            put_string(w.out, k.second->value.data());
+            if (const char * err = write_value(w, od.slots[k.first], depth))
+                return err;
+        }
+        return nullptr;
+    }
+    size_t n = 0;
+    for (auto & e : od.dict)
+        n += wanted(only, e.key);
+    put<uint8_t>(w.out, M_DICT);
+    put<uint64_t>(w.out, n);
+    for (auto & e : od.dict)
+    {
+        if (!wanted(only, e.key)) continue;
+        put_string(w.out, e.key->value.data());
+        if (const char * err = write_value(w, e.value, depth))
+            return err;
+    }
+    return nullptr;
+}
+
+static const char * write_array(writer & w, const arr_def & ad, int depth)
+{
+    put<uint8_t>(w.out, M_ARRAY);
+    put<uint8_t>(w.out, ad.kind);
+    put<uint64_t>(w.out, ad.size());
+    switch (ad.kind)
+    {
+    case arr_def::INTS:
+        w.out.append((const char *)ad.ints.data(), ad.ints.size() * sizeof(int64_t));
+        return nullptr;
+    case arr_def::FLOATS:
+        w.out.append((const char *)ad.floats.data(), ad.floats.size() * sizeof(double));
+        return nullptr;
+    case arr_def::BOOLS:
+        w.out.append((const char *)ad.bools.data(), ad.bools.size());
+        return nullptr;
+    case arr_def::VALUES:
+        for (const type_and_value & tv : ad.values)
+            if (const char * err = write_value(w, tv, depth))
+                return err;
+        return nullptr;
+    }
+    return nullptr;
+}
+
+static const char * write_closure(writer & w, const closure_def & c, int depth)
+{
+    if (c.native)
+    {
+        if (c.data)
+            return "Cannot copy a native function bound to data";
+        put<uint8_t>(w.out, M_NATIVE);
+        put<native_fn>(w.out, c.native);
+        return nullptr;
+    }
+    if (!c.s)
+        return "Cannot copy a coroutine";
+    put<uint8_t>(w.out, M_CLOSURE);
+    put<const script *>(w.out, c.s);
+    put<int32_t>(w.out, c.addr);
+    return write_scope(w, c.super, depth);
+}
+
+static const char * write_value(writer & w, const type_and_value & tv, int depth)
+{
+    if (++depth > max_depth)
+        return "Value is nested too deeply to copy";
+    switch (tv.t())
+    {
+    case NIL:
+        put<uint8_t>(w.out, M_NIL);
+        return nullptr;
+    case INT:
+        put<uint8_t>(w.out, M_INT);
+        put<int64_t>(w.out, tv.i());
+        return nullptr;
+    case FLOAT:
+        put<uint8_t>(w.out, M_FLOAT);
+        put<double>(w.out, tv.f());
+        return nullptr;
+    case BOOL:
+        put<uint8_t>(w.out, tv.b() ? M_TRUE : M_FALSE);
+        return nullptr;
+    case STRING:
+        put<uint8_t>(w.out, M_STRING);
+        put_string(w.out, tv.s()->value.data());
+        return nullptr;
+    case OBJECT:
+        if (seen(w, w.values, tv.o(), M_REF)) return nullptr;
+        return write_object(w, tv.o()->value, depth, nullptr);
+    case ARRAY:
+        if (seen(w, w.values, tv.a(), M_REF)) return nullptr;
+        return write_array(w, tv.a()->value, depth);
+    case CLOSURE:
+        if (seen(w, w.values, tv.c(), M_REF)) return nullptr;
+        return write_closure(w, tv.c()->value, depth);
+    }
+    return "Cannot copy a value of unknown type";
+}
+
+const char * marshal(const type_and_value & tv, std::string & out)
+{
+    writer w{out, {}, {}, {}, {}, {}};
+    if (const char * err = reach_value(w, tv, 0))
+        return err;
+    return write_value(w, tv, 0);
+}
+
+struct reader
+{
+    std::vector<type_and_value> values;
+    std::vector<closure_info *> scopes;
+};
+
+static type_and_value read_value(reader & r, const char *& p);
+
+static closure_info * read_scope(reader & r, const char *& p)
+{
+    switch (get<uint8_t>(p))
+    {
+    case M_NO_SCOPE:
+        return nullptr;
+    case M_SCOPE_REF:
+        return r.scopes[get<uint32_t>(p)];
+    default:
+        {
+            closure_info * ci = new_closure_info(nullptr, nil_value());
+            r.scopes.push_back(ci);
+            ci->value.self = read_value(r, p);
+            ci->value.super = read_scope(r, p);
+            return ci;
+        }
+    }
+}
+
+template<typename T>
+static void read_items(std::vector<T> & v, size_t n, const char *& p)
+{
+    v.resize(n);
+    memcpy(v.data(), p, n * sizeof(T));
+    p += n * sizeof(T);
+}
+
+static type_and_value read_value(reader & r, const char *& p)
+{
+    switch (get<uint8_t>(p))
+    {
+    case M_NIL: return nil_value();
+    case M_INT: return int_value(get<int64_t>(p));
+    case M_FLOAT: return float_value(get<double>(p));
+    case M_FALSE: return bool_value(false);
+    case M_TRUE: return bool_value(true);
+    case M_STRING: return new_string(get_string(p));
+    case M_REF: return r.values[get<uint32_t>(p)];
+    case M_OBJECT:
+    case M_DICT:
+        {
+            bool dict = p[-1] == M_DICT;
+            type_and_value tv = new_empty_object();
+            r.values.push_back(tv);
+            obj_def & od = tv.o()->value;
+            size_t n = get<uint64_t>(p);
+            for (size_t i = 0; i < n; i++)
+            {
+                // Only shape keys are interned, dictionaries can be large
+                std::string_view key = get_string(p);
+                str * k = dict ? new_string(key).s() : intern(key);
+                od.set(k, read_value(r, p));
+            }
+            return tv;
+        }
+    case M_ARRAY:
+        {
+            type_and_value tv = new_array(nullptr, nullptr);
+            r.values.push_back(tv);
+            arr_def & ad = tv.a()->value;
+            ad.kind = (arr_def::kind_t)get<uint8_t>(p);
+            size_t n = get<uint64_t>(p);
+            switch (ad.kind)
+            {
+            case arr_def::INTS: read_items(ad.ints, n, p); break;
+            case arr_def::FLOATS: read_items(ad.floats, n, p); break;
+            case arr_def::BOOLS: read_items(ad.bools, n, p); break;
+            case arr_def::VALUES:
+                ad.values.reserve(n);
+                for (size_t i = 0; i < n; i++)
+                    ad.values.push_back(read_value(r, p));
+                break;
+            }
+            gc_account(n * sizeof(type_and_value));
+            return tv;
+        }
+    case M_NATIVE:
+        {
+            type_and_value tv = new_native(get<native_fn>(p));
+            r.values.push_back(tv);
+            return tv;
+        }
+    case M_CLOSURE:
+        {
+            const script * s = get<const script *>(p);
+            int addr = get<int32_t>(p);
+            type_and_value tv = new_closure(nullptr, s, addr);
+            r.values.push_back(tv);
+            tv.c()->value.super = read_scope(r, p);
+            return tv;
+        }
+    }
+    return nil_value();
+}
+
+type_and_value unmarshal(const char *& p)
+{
+    reader r;
+    return read_value(r, p);
+}
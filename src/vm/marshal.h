@@ -0,0 +1,18 @@
+// Copying values between the heaps of different vms.
+//
+// marshal flattens a value and everything it references into bytes,
+// unmarshal rebuilds it on the current heap. Sharing and cycles within the
+// value are kept. Closures keep pointing to the code of their script and
+// bring along the variables of their scopes that their code uses, so a
+// closure copied to another vm sees copies of those. Coroutines and native
+// functions bound to a gc object cannot be copied.
+//
+// Marshaling only reads the value, except that ropes are flattened, so it
+// must run on the thread that owns the heap. The bytes can go anywhere.
+
+// Appends the bytes of tv to out. Returns an error message, nullptr on
+// success, in which case out may hold part of the value.
+const char * marshal(const type_and_value & tv, std::string & out);
+// Reads a value written by marshal at p and moves p past it. Allocates,
+// but never collects.
+type_and_value unmarshal(const char *& p);
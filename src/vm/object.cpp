@@ -0,0 +1,318 @@
+#include <string_view>
+#include "vm.h"
+#include "gc.h"
+
+size_t str_hash::operator()(str * s) const
+{
+    return s->value.get_hash();
+}
+
+bool str_equal::operator()(str * s1, str * s2) const
+{
+    if (s1 == s2) return true;
+    if (s1->value.interned && s2->value.interned) return false;
+    if (s1->value.size() != s2->value.size()) return false;
+    return s1->value.data() == s2->value.data();
+}
+
+str * intern(std::string_view s)
+{
+    auto & intern_table = gc_current->intern_table;
+    auto p = intern_table.find(s);
+    if (p != intern_table.end())
+        return p->second;
+    str * is = new str(std::string(s));
+    is->gc_flags = GC_OLD | GC_PINNED;
+    is->value.interned = true;
+    is->value.get_hash();
+    intern_table.emplace(is->value.chars, is);
+    return is;
+}
+
+str * find_interned(str * s)
+{
+    if (s->value.interned)
+        return s;
+    auto & intern_table = gc_current->intern_table;
+    auto p = intern_table.find(s->value.data());
+    return p == intern_table.end() ? nullptr : p->second;
+}
+
+str_def::str_def(str * left, str * right):
+    chars(nullptr, left->value.size() + right->value.size()),
+    left(left), right(right), owner(nullptr), hash(0), interned(false)
+{
+}
+
+void str_def::flatten() const
+{
+    // Iterative, appending in a loop makes ropes as deep as they are long
+    std::string out;
+    out.reserve(chars.size());
+    std::vector<const str_def *> todo{this};
+    while (!todo.empty())
+    {
+        const str_def * s = todo.back();
+        todo.pop_back();
+        if (s->left)
+        {
+            todo.push_back(&s->right->value);
+            todo.push_back(&s->left->value);
+        }
+        else
+            out += s->chars;
+    }
+    gc_account(out.size());
+    buf = std::move(out);
+    chars = buf;
+    left = right = nullptr;
+}
+
+shape::~shape()
+{
+    for (auto & p : transitions)
+        delete p.second;
+}
+
+shape * shape::add(str * key)
+{
+    auto p = transitions.find(key);
+    if (p != transitions.end())
+        return p->second;
+    shape * sh = new shape(this);
+    sh->index = index;
+    sh->index[key] = size();
+    transitions.emplace(key, sh);
+    return sh;
+}
+
+shape * root_shape()
+{
+    return &gc_current->root_shape;
+}
+
+const type_and_value * obj_def::find(str * key) const
+{
+    if (sh)
+    {
+        key = find_interned(key);
+        if (!key) return nullptr;
+        const uint32_t * idx = sh->index.find(key);
+        return idx ? &slots[*idx] : nullptr;
+    }
+    return dict.find(key);
+}
+
+void obj_def::set(str * key, const type_and_value & tv)
+{
+    if (sh)
+    {
+        str * ikey = find_interned(key);
+        if (ikey)
+        {
+            const uint32_t * idx = sh->index.find(ikey);
+            if (idx)
+            {
+                slots[*idx] = tv;
+                return;
+            }
+        }
+        if (ikey && sh->size() < shape::max_size)
+        {
+            sh = sh->add(ikey);
+            slots.push_back(tv);
+            return;
+        }
+        to_dict();
+    }
+    dict[key] = tv;
+}
+
+void obj_def::erase(str * key)
+{
+    if (sh)
+    {
+        key = find_interned(key);
+        if (!key || !sh->index.find(key))
+            return;
+        to_dict();
+    }
+    dict.erase(key);
+}
+
+void obj_def::to_dict()
+{
+    for (auto & e : sh->index)
+        dict[e.key] = slots[e.value];
+    sh = nullptr;
+    slots.clear();
+}
+
+static arr_def::kind_t kind_of(const type_and_value & tv)
+{
+    switch (tv.t())
+    {
+    case INT: return arr_def::INTS;
+    case FLOAT: return arr_def::FLOATS;
+    case BOOL: return arr_def::BOOLS;
+    default: return arr_def::VALUES;
+    }
+}
+
+arr_def::arr_def(const type_and_value * begin, const type_and_value * end)
+{
+    kind = begin == end ? INTS : kind_of(*begin);
+    for (const type_and_value * p = begin; p != end && kind != VALUES; p++)
+        if (kind_of(*p) != kind)
+            kind = VALUES;
+    size_t n = end - begin;
+    switch (kind)
+    {
+    case INTS:
+        ints.resize(n);
+        for (size_t i = 0; i < n; i++) ints[i] = begin[i].i();
+        break;
+    case FLOATS:
+        floats.resize(n);
+        for (size_t i = 0; i < n; i++) floats[i] = begin[i].f();
+        break;
+    case BOOLS:
+        bools.resize(n);
+        for (size_t i = 0; i < n; i++) bools[i] = begin[i].b();
+        break;
+    case VALUES:
+        values.assign(begin, end);
+        break;
+    }
+}
+
+size_t arr_def::size() const
+{
+    switch (kind)
+    {
+    case INTS: return ints.size();
+    case FLOATS: return floats.size();
+    case BOOLS: return bools.size();
+    default: return values.size();
+    }
+}
+
+type_and_value arr_def::get(size_t idx) const
+{
+    switch (kind)
+    {
+    case INTS: return int_value(ints[idx]);
+    case FLOATS: return float_value(floats[idx]);
+    case BOOLS: return bool_value(bools[idx]);
+    default: return values[idx];
+    }
+}
+
+void arr_def::set(size_t idx, const type_and_value & tv)
+{
+    switch (kind)
+    {
+    case INTS:
+        if (tv.t() != INT) break;
+        ints[idx] = tv.i();
+        return;
+    case FLOATS:
+        if (tv.t() != FLOAT) break;
+        floats[idx] = tv.f();
+        return;
+    case BOOLS:
+        if (tv.t() != BOOL) break;
+        bools[idx] = tv.b();
+        return;
+    case VALUES:
+        values[idx] = tv;
+        return;
+    }
+    to_values();
+    values[idx] = tv;
+}
+
+void arr_def::push(const type_and_value & tv)
+{
+    // An empty array takes the kind of its first element
+    if (!size()) kind = kind_of(tv);
+    switch (kind)
+    {
+    case INTS:
+        if (tv.t() != INT) break;
+        ints.push_back(tv.i());
+        return;
+    case FLOATS:
+        if (tv.t() != FLOAT) break;
+        floats.push_back(tv.f());
+        return;
+    case BOOLS:
+        if (tv.t() != BOOL) break;
+        bools.push_back(tv.b());
+        return;
+    case VALUES:
+        values.push_back(tv);
+        return;
+    }
+    to_values();
+    values.push_back(tv);
+}
+
+void arr_def::resize(size_t n, const type_and_value & tv)
+{
+    if (!size()) kind = kind_of(tv);
+    if (n > size() && kind != VALUES && kind_of(tv) != kind)
+        to_values();
+    switch (kind)
+    {
+    case INTS: ints.resize(n, tv.t() == INT ? tv.i() : 0); break;
+    case FLOATS: floats.resize(n, tv.t() == FLOAT ? tv.f() : 0); break;
+    case BOOLS: bools.resize(n, tv.t() == BOOL && tv.b()); break;
+    case VALUES: values.resize(n, tv); break;
+    }
+}
+
+type_and_value arr_def::pop()
+{
+    size_t n = size();
+    if (!n) return nil_value();
+    type_and_value tv = get(n - 1);
+    switch (kind)
+    {
+    case INTS: ints.pop_back(); break;
+    case FLOATS: floats.pop_back(); break;
+    case BOOLS: bools.pop_back(); break;
+    case VALUES: values.pop_back(); break;
+    }
+    return tv;
+}
+
+void arr_def::fill(const type_and_value & tv)
+{
+    size_t n = size();
+    ints.clear();
+    floats.clear();
+    bools.clear();
+    values.clear();
+    kind = kind_of(tv);
+    switch (kind)
+    {
+    case INTS: ints.assign(n, tv.i()); break;
+    case FLOATS: floats.assign(n, tv.f()); break;
+    case BOOLS: bools.assign(n, tv.b()); break;
+    case VALUES: values.assign(n, tv); break;
+    }
+}
+
+void arr_def::to_values()
+{
+    if (kind == VALUES) return;
+    size_t n = size();
+    values.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        values.push_back(get(i));
+    ints = std::vector<int64_t>();
+    floats = std::vector<double>();
+    bools = std::vector<uint8_t>();
+    kind = VALUES;
+}
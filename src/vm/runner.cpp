@@ -0,0 +1,49 @@
+#include <atomic>
+#include <thread>
+#include "vm.h"
+#include "io.h"
+#include "runner.h"
+
+struct batch
+{
+    const std::vector<const script *> * jobs;
+    bool use_jit;
+    std::atomic<size_t> next; // first job nobody took yet
+    std::atomic<size_t> failed;
+};
+
+// Take jobs until none are left, so fast and slow jobs even out
+static void worker(batch * b)
+{
+    cute::vm vm;
+    size_t i;
+    while ((i = b->next++) < b->jobs->size())
+    {
+        // Output of a run is written in one piece when it ends
+        io_hold(true);
+        if (!vm.run(*(*b->jobs)[i], b->use_jit))
+            b->failed++;
+        io_hold(false);
+    }
+}
+
+namespace cute
+{
+
+size_t run_parallel(const std::vector<const script *> & jobs, unsigned threads, bool use_jit)
+{
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, jobs.size());
+    batch b{&jobs, use_jit, {0}, {0}};
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+        pool.emplace_back(worker, &b);
+    // The calling thread takes jobs as well
+    if (threads) worker(&b);
+    for (std::thread & t : pool)
+        t.join();
+    return b.failed;
+}
+
+}
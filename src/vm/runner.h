@@ -0,0 +1,12 @@
+// Running batches of scripts on several threads, see cute::vm
+
+namespace cute
+{
+
+// Run every script of jobs once, on the given number of threads (all
+// cores if 0). Each thread has a vm of its own, kept warm across the jobs
+// it takes, while the scripts are shared read-only. Returns the number of
+// runs that failed.
+size_t run_parallel(const std::vector<const script *> & jobs, unsigned threads = 0, bool use_jit = false);
+
+}
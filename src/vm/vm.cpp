@@ -1,37 +1,69 @@
-#include <unordered_set>
+#include <new>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include "vm.h"
+#include "jit.h"
+#include "gc.h"
+#include "io.h"
+#include "ext.h"
+#include "loop.h"
 #include "misc.h"
-
-static char gc_current_status;
-static std::unordered_set<gc_base_obj *> gc_obj_list;
-
-template<typename T, typename ... Args>
-static gc_obj<T> * new_obj(Args ... args)
-{
-    gc_obj<T> * obj = new gc_obj<T>(args ...);
-    obj->gc_status = gc_current_status;
-    gc_obj_list.insert(obj);
-    return obj;
-};
-
-static void delete_obj(gc_base_obj * obj)
-{
-    if (gc_obj_list.erase(obj))
-        delete obj;
-}
+#include "iolib.h"
+#include "mathlib.h"
+#include "strlib.h"
+#include "arrlib.h"
+#include "parlib.h"
+#include "aiolib.h"
 
 struct stack_info
 {
-    closure_info * c_info;
+    closure_info * c_info; // created on first use, see materialize()
+    closure_info * super;
     const script * s;
     int param_count;
+    int base;
     int stack_return;
     int pc_return;
+    jit_code * jit; // compiled code of the closure, see run_jit()
 };
 
+// A closure running on a stack of its own, made by NEW_COROUTINE. The
+// first call starts the closure with the arguments of the call, like a
+// regular call, and later calls resume it after the YIELD that suspended
+// it. YIELD makes the call return, taking the frames of the coroutine off
+// the stack and into the coroutine, with stack positions relative to the
+// first frame. Once the closure returns, calls return null.
+//
+// While running, the closure value of the coroutine stays in the slot
+// below the arguments of its first frame, which tells that frame apart.
+struct coroutine_def
+{
+    enum state_t : uint8_t {NEW, SUSPENDED, RUNNING, DONE};
+
+    type_and_value fn;
+    std::vector<type_and_value> stack;
+    std::vector<stack_info> info;
+    int pc;
+    int ptr;
+    state_t state;
+};
+
+typedef gc_obj<coroutine_def> coroutine;
+
+template<>
+void gc_obj<coroutine_def>::gc_trace()
+{
+    gc_mark(value.fn);
+    for (const type_and_value & tv : value.stack)
+        gc_mark(tv);
+    for (const stack_info & si : value.info)
+    {
+        gc_mark(si.c_info);
+        gc_mark(si.super);
+    }
+}
+
 class vm_error
 {
     std::string msg;
@@ -39,106 +71,434 @@ public:
     template<typename ... Args>
     vm_error(const char * fmt, Args ... args)
     {
-        size_t len = strlen(fmt);
-        char * buf = new char[len + 20];
-        snprintf(buf, len + 20, fmt, args ...);
-        msg = buf;
-        delete[] buf;
+        int len = snprintf(nullptr, 0, fmt, args ...);
+        msg.resize(len);
+        snprintf(&msg[0], len + 1, fmt, args ...);
     }
+    const std::string & what() const { return msg; }
     void print() const
     {
-        printf("ERROR: %s\n", msg.c_str());
+        io_write("ERROR: ");
+        io_write(msg);
+        io_write("\n");
+        io_flush();
+    }
+};
+
+static void gc(const value_stack & stack, const std::vector<stack_info> & info)
+{
+    gc_begin();
+    for (const type_and_value & tv : stack)
+        gc_mark(tv);
+    for (const stack_info & si : info)
+    {
+        gc_mark(si.c_info);
+        gc_mark(si.super);
     }
+    gc_mark(*loop_current);
+    gc_end();
+}
+
+static void gc_poll(const value_stack & stack, const std::vector<stack_info> & info)
+{
+    if (gc_should_collect())
+        gc(stack, info);
+}
+
+static const char * type_name(int type)
+{
+    const char * const names[] = {"nil", "int", "float", "bool", "string", "object", "array", "closure"};
+    if (type < 0 || type >= 8)
+        return "[unknown type]";
+    return names[type];
+}
+
+#ifndef CUTE_FAST_DISPATCH
+static uint8_t code_next(const code_view * code, int & pc)
+{
+    if (pc < 0 || pc >= code->size())
+        throw vm_error("PC (=%d) goes out of script range", pc);
+    return (*code)[pc++];
+}
+
+static uint32_t code_next_wide(const code_view * code, int & pc)
+{
+    uint32_t arg = 0;
+    for (int n = 0; n < 4; n++)
+        arg |= (uint32_t)code_next(code, pc) << (8 * n);
+    return arg;
+}
+#else
+static uint32_t code_next_wide(const uint8_t * bc, int & pc)
+{
+    const uint8_t * p = bc + pc;
+    pc += 4;
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+#endif
+
+static const int operand_counts[] =
+{
+#define X(op, args, imm) args,
+    CUTE_INSTRUCTIONS(X)
+#undef X
 };
 
-static void mark_closure_info(closure_info * ci);
+static const int immediate_sizes[] =
+{
+#define X(op, args, imm) imm,
+    CUTE_INSTRUCTIONS(X)
+#undef X
+};
 
-static void mark(const type_and_value & tv)
+// Bytes following the opcode, -1 for unknown instructions
+static int operand_size(uint8_t op, bool wide)
 {
-    switch (tv.t)
+    if (op >= sizeof(operand_counts) / sizeof(operand_counts[0]))
+        return -1;
+    return operand_counts[op] * (wide ? 4 : 1) + immediate_sizes[op];
+}
+
+static uint32_t read_operand(const uint8_t * arg, int n, bool wide)
+{
+    if (!wide)
+        return arg[n];
+    const uint8_t * p = arg + n * 4;
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool is_enter(const code_view & code, size_t addr)
+{
+    if (addr < code.size() && code[addr] == WIDE)
+        addr++;
+    return addr < code.size() && code[addr] == ENTER;
+}
+
+// Values an instruction takes off and puts on the operand stack of its frame
+static void stack_use(uint8_t op, uint32_t arg0, int64_t & pops, int64_t & pushes)
+{
+    pops = 0;
+    pushes = 0;
+    switch (op)
     {
-    case STRING:
-        if (tv.v.o->gc_status != gc_current_status)
-            tv.v.s->gc_status = gc_current_status;
+    case LOAD: case LOAD_SUPER: case PUSH_BINT: case PUSH_WINT: case PUSH_DWINT:
+    case PUSH_INT: case PUSH_FLOAT: case PUSH_STRING: case PUSH_CLOSURE:
+    case PUSH_ARG: case PUSH_SELF: case PUSH_SUPER: case IN: case LOAD_LIB:
+    case LOAD_LOCAL: case LOAD_LOCAL_FIELD:
+        pushes = 1;
         break;
-    case OBJECT:
-        if (tv.v.o->gc_status != gc_current_status)
-        {
-            tv.v.o->gc_status = gc_current_status;
-            for (auto & p : tv.v.o->value)
-                mark(p.second);
-        }
+    case STORE: case STORE_SUPER: case POP: case JUMP_IF: case JUMP_UNLESS:
+    case RETURN: case OUT: case STORE_LOCAL: case YIELD:
+        pops = 1;
         break;
-    case ARRAY:
-        if (tv.v.o->gc_status != gc_current_status)
-        {
-            tv.v.a->gc_status = gc_current_status;
-            for (auto & tv : tv.v.a->value)
-                mark(tv);
-        }
+    case LOAD_FIELD: case POS: case NEG: case BINV: case NOT: case LEN:
+    case ADD_BINT: case NEW_COROUTINE:
+        pops = pushes = 1;
         break;
-    case CLOSURE:
-        if (tv.v.o->gc_status != gc_current_status)
-        {
-            tv.v.c->gc_status = gc_current_status;
-            mark_closure_info(tv.v.c->value.super);
-        }
+    case DUP:
+        pops = 1;
+        pushes = 2;
+        break;
+    case STORE_FIELD: case JUMP_UNLESS_EQ: case JUMP_UNLESS_NE: case JUMP_UNLESS_GT:
+    case JUMP_UNLESS_LT: case JUMP_UNLESS_GE: case JUMP_UNLESS_LE:
+        pops = 2;
+        break;
+    case STORE_ITEM:
+        pops = 3;
+        break;
+    case NEW_ARRAY:
+        pops = arg0;
+        pushes = 1;
         break;
+    case CALL:
+        pops = (int64_t)arg0 + 1;
+        pushes = 1;
+        break;
+    case JUMP: case ENTER:
+        break;
+    default: // binary operators and LOAD_ITEM
+        pops = 2;
+        pushes = 1;
     }
 }
 
-static void mark_closure_info(closure_info * ci)
+struct instr_info
 {
-    if (ci && ci->gc_status != gc_current_status)
+    int start;
+    uint8_t op;
+    uint32_t arg0;
+    int next;
+    bool jump;
+    int64_t target;
+};
+
+// Splits the code into instructions, checking their operands, and finds
+// the index of the instruction starting at each address and the sorted
+// start addresses of the closures
+static void decode_script(const script & s, std::vector<instr_info> & instrs,
+                          std::vector<int> & index, std::vector<uint32_t> & closures)
+{
+    const code_view & code = s.code;
+    index.assign(code.size(), -1);
+    closures = {0};
+    int pc = 0;
+    while (pc < code.size())
     {
-        ci->gc_status = gc_current_status;
-        mark(ci->value.self);
-        mark_closure_info(ci->value.super);
+        index[pc] = instrs.size();
+        int start = pc;
+        bool wide = code[pc] == WIDE;
+        if (wide && ++pc == code.size())
+            throw vm_error("Truncated instruction at %d", start);
+        uint8_t op = code[pc];
+        int len = operand_size(op, wide);
+        if (len < 0 || op > WIDE)
+            throw vm_error("Unknown instruction %d at %d", op, pc);
+        if (wide && (op == WIDE || operand_counts[op] == 0))
+            throw vm_error("WIDE prefix on instruction %d at %d", op, start);
+        if (pc + 1 + len > code.size())
+            throw vm_error("Truncated instruction at %d", start);
+        const uint8_t * arg = code.data() + pc + 1;
+        uint32_t arg0 = operand_counts[op] ? read_operand(arg, 0, wide) : 0;
+        int next = pc + 1 + len;
+        bool jump = false;
+        int64_t target = 0;
+        switch (op)
+        {
+        case LOAD_SUPER:
+        case STORE_SUPER:
+        case LOAD_FIELD:
+        case STORE_FIELD:
+            {
+                uint32_t cache = read_operand(arg, 1, wide);
+                if (cache >= s.cache_count)
+                    throw vm_error("Inline cache index (%u) out of range at %d", cache, start);
+            }
+            // fall through
+        case LOAD:
+        case STORE:
+        case PUSH_STRING:
+        case LOAD_LIB:
+            if (arg0 >= s.string_pool.size())
+                throw vm_error("String pool index (%u) out of range at %d", arg0, start);
+            break;
+        case PUSH_CLOSURE:
+            closures.push_back(arg0);
+            break;
+        case JUMP:
+        case JUMP_IF:
+        case JUMP_UNLESS:
+        case JUMP_UNLESS_EQ:
+        case JUMP_UNLESS_NE:
+        case JUMP_UNLESS_GT:
+        case JUMP_UNLESS_LT:
+        case JUMP_UNLESS_GE:
+        case JUMP_UNLESS_LE:
+            jump = true;
+            target = next + (int64_t)(wide ? (int32_t)arg0 : (int8_t)arg0);
+            break;
+        case LOAD_LOCAL_FIELD:
+            if (read_operand(arg, 1, wide) >= s.string_pool.size())
+                throw vm_error("String pool index (%u) out of range at %d", read_operand(arg, 1, wide), start);
+            if (read_operand(arg, 2, wide) >= s.cache_count)
+                throw vm_error("Inline cache index (%u) out of range at %d", read_operand(arg, 2, wide), start);
+            break;
+        }
+        instrs.push_back({start, op, arg0, next, jump, target});
+        pc = next;
     }
+    if (!is_enter(code, 0))
+        throw vm_error("Script does not start with ENTER");
+    for (uint32_t addr : closures)
+        if (addr >= code.size() || index[addr] < 0 || !is_enter(code, addr))
+            throw vm_error("Invalid closure address %u", addr);
+    std::sort(closures.begin(), closures.end());
+    closures.erase(std::unique(closures.begin(), closures.end()), closures.end());
 }
 
-static void gc(std::vector<type_and_value> stack, std::vector<stack_info> info)
+// Check once that the bytecode is well formed: every instruction and its
+// operands are in range, and the code splits into closures, one starting at
+// 0 and one at each PUSH_CLOSURE address, each with a single ENTER at its
+// start. Local slots are checked against the ENTER of their closure, jumps
+// stay inside it past the ENTER, and every path through it ends with RETURN
+// with one value on the stack, never popping what it has not pushed and
+// always reaching an instruction with the same stack depth. The fast
+// dispatcher and the JIT rely on it.
+void verify_script(const script & s)
 {
-    gc_current_status = 1 - gc_current_status;
-    for (const type_and_value & tv : stack)
-        mark(tv);
-    for (const stack_info & si : info)
-        mark_closure_info(si.c_info);
-    auto list = gc_obj_list;
-    for (auto p : list)
-        if (p->gc_status != gc_current_status)
-            delete_obj(p);
+    const code_view & code = s.code;
+    std::vector<instr_info> instrs;
+    std::vector<int> index; // instruction starting at each address
+    std::vector<uint32_t> closures;
+    decode_script(s, instrs, index, closures);
+
+    std::vector<int64_t> depth(instrs.size(), -1);
+    std::vector<size_t> work;
+    for (size_t c = 0; c < closures.size(); c++)
+    {
+        size_t first = index[closures[c]];
+        size_t end = c + 1 < closures.size() ? index[closures[c + 1]] : instrs.size();
+        int64_t locals = instrs[first].arg0;
+        int end_pc = c + 1 < closures.size() ? closures[c + 1] : code.size();
+        for (size_t i = first; i < end; i++)
+        {
+            const instr_info & ins = instrs[i];
+            if (ins.op == ENTER && i != first)
+                throw vm_error("ENTER at %d is not the start of a closure", ins.start);
+            if ((ins.op == LOAD_LOCAL || ins.op == STORE_LOCAL || ins.op == LOAD_LOCAL_FIELD) && ins.arg0 >= locals)
+                throw vm_error("Local slot (%u) out of range at %d", ins.arg0, ins.start);
+            if (ins.jump && (ins.target <= closures[c] || ins.target >= end_pc || index[ins.target] < 0))
+                throw vm_error("Invalid jump target %lld at %d", (long long)ins.target, ins.start);
+        }
+        if (instrs[end - 1].op != RETURN && instrs[end - 1].op != JUMP)
+            throw vm_error("Closure at %u does not end with RETURN or JUMP", closures[c]);
+        // Stack depth above the locals, along every path from the ENTER
+        depth[first] = 0;
+        work.push_back(first);
+        while (!work.empty())
+        {
+            const instr_info & ins = instrs[work.back()];
+            int64_t d = depth[work.back()];
+            work.pop_back();
+            int64_t pops, pushes;
+            stack_use(ins.op, ins.arg0, pops, pushes);
+            if (d < pops)
+                throw vm_error("Stack underflow at %d", ins.start);
+            if (ins.op == RETURN && d != 1)
+                throw vm_error("RETURN with %lld values on the stack at %d", (long long)d, ins.start);
+            d += pushes - pops;
+            int succ[2] = {-1, -1};
+            if (ins.op != JUMP && ins.op != RETURN)
+                succ[0] = index[ins.next];
+            if (ins.jump)
+                succ[1] = index[ins.target];
+            for (int i : succ)
+            {
+                if (i < 0)
+                    continue;
+                if (depth[i] < 0)
+                {
+                    depth[i] = d;
+                    work.push_back(i);
+                }
+                else if (depth[i] != d)
+                    throw vm_error("Inconsistent stack depth at %d", instrs[i].start);
+            }
+        }
+    }
 }
 
-static void cleanup()
+bool check_script(const script & s)
 {
-    for (auto p : gc_obj_list)
-        delete p;
+    try
+    {
+        verify_script(s);
+    }
+    catch (vm_error & e)
+    {
+        e.print();
+        return false;
+    }
+    return true;
 }
 
-static const char * type_name(int type)
+
+// The field through which the scope object pushed by the PUSH_SUPER at
+// instruction i is read or written, following every path until the object
+// is popped. Empty if it is used in any other way.
+static std::string_view super_field(const script & s, const std::vector<instr_info> & instrs,
+                                    const std::vector<int> & index, size_t i)
 {
-    const char * const names[] = {"nil", "int", "float", "bool", "string", "object", "array", "closure"};
-    if (type < 0 || type >= 8)
-        return "[unknown type]";
-    return names[type];
+    std::string_view name;
+    std::vector<bool> seen(instrs.size());
+    // Instructions with the number of values on the stack down to the object
+    std::vector<std::pair<size_t, int64_t>> work = {{index[instrs[i].next], 1}};
+    while (!work.empty())
+    {
+        auto [k, above] = work.back();
+        work.pop_back();
+        if (seen[k]) continue;
+        seen[k] = true;
+        const instr_info & ins = instrs[k];
+        int64_t pops, pushes;
+        stack_use(ins.op, ins.arg0, pops, pushes);
+        if (pops >= above)
+        {
+            if (!(ins.op == LOAD_FIELD && above == 1) && !(ins.op == STORE_FIELD && above == 2))
+                return {};
+            std::string_view field = s.string_pool[ins.arg0];
+            if (!name.empty() && name != field)
+                return {};
+            name = field;
+            continue;
+        }
+        above += pushes - pops;
+        if (ins.op != JUMP && ins.op != RETURN)
+            work.push_back({index[ins.next], above});
+        if (ins.jump)
+            work.push_back({index[ins.target], above});
+    }
+    return name;
 }
 
-static uint8_t code_next(const std::vector<uint8_t> * code, int & pc)
+static void add_use(std::vector<scope_use> & uses, size_t level, std::string_view name)
 {
-    if (pc < 0 || pc >= code->size())
-        throw vm_error("PC (=%d) goes out of script range", pc);
-    return (*code)[pc++];
+    if (uses.size() < level)
+        uses.resize(level);
+    scope_use & u = uses[level - 1];
+    if (name.empty())
+        u.whole = true;
+    else if (std::find(u.names.begin(), u.names.end(), name) == u.names.end())
+        u.names.push_back(name);
 }
 
-static const std::string & get_string(const std::vector<std::string> * string_pool, uint8_t idx)
+std::unordered_map<int, std::vector<scope_use>> scope_uses(const script & s)
 {
-    if (idx >= string_pool->size())
-        throw vm_error("String pool index (%d) out of range", idx);
-    return (*string_pool)[idx];
+    std::vector<instr_info> instrs;
+    std::vector<int> index;
+    std::vector<uint32_t> closures;
+    decode_script(s, instrs, index, closures);
+    // What each closure uses directly, and the closures it creates
+    std::unordered_map<int, std::vector<scope_use>> uses;
+    std::unordered_map<int, std::vector<int>> nested;
+    for (size_t c = 0; c < closures.size(); c++)
+    {
+        size_t end = c + 1 < closures.size() ? index[closures[c + 1]] : instrs.size();
+        std::vector<scope_use> & u = uses[closures[c]];
+        for (size_t i = index[closures[c]]; i < end; i++)
+        {
+            const instr_info & ins = instrs[i];
+            if (ins.op == LOAD_SUPER || ins.op == STORE_SUPER)
+                add_use(u, 1, s.string_pool[ins.arg0]);
+            else if (ins.op == PUSH_SUPER)
+                add_use(u, (size_t)ins.arg0 + 1, super_field(s, instrs, index, i));
+            else if (ins.op == PUSH_CLOSURE)
+                nested[closures[c]].push_back(ins.arg0);
+        }
+    }
+    // Nested closures see the scope of the closure that created them one
+    // level up. Their uses are added from the innermost out, the compiler
+    // emits closures after the one creating them.
+    for (size_t c = closures.size(); c-- > 0;)
+    {
+        std::vector<scope_use> & u = uses[closures[c]];
+        for (int addr : nested[closures[c]])
+        {
+            if (addr <= (int)closures[c]) continue;
+            const std::vector<scope_use> & inner = uses[addr];
+            for (size_t level = 2; level <= inner.size(); level++)
+            {
+                const scope_use & iu = inner[level - 1];
+                if (iu.whole)
+                    add_use(u, level - 1, {});
+                for (std::string_view name : iu.names)
+                    add_use(u, level - 1, name);
+            }
+        }
+    }
+    return uses;
 }
 
-static type_and_value stack_pop(std::vector<type_and_value> & stack, int ptr)
+static type_and_value stack_pop(value_stack & stack, int ptr)
 {
     if (stack.size() <= ptr)
         throw vm_error("Current stack frame empty");
@@ -147,7 +507,7 @@ static type_and_value stack_pop(std::vector<type_and_value> & stack, int ptr)
     return rt;
 }
 
-static type_and_value & stack_top(std::vector<type_and_value> & stack, int ptr, int offset = 0)
+static type_and_value & stack_top(value_stack & stack, int ptr, int offset = 0)
 {
     size_t sz = stack.size() - offset;
     if (sz <= ptr)
@@ -157,14 +517,14 @@ static type_and_value & stack_top(std::vector<type_and_value> & stack, int ptr,
 
 static void check_type(const type_and_value & tv, type t)
 {
-    if (tv.t == t) return;
-    throw vm_error("Invalid type %s, %s expected", type_name(tv.t), type_name(t));
+    if (tv.t() == t) return;
+    throw vm_error("Invalid type %s, %s expected", type_name(tv.t()), type_name(t));
 }
 
 static void check_types(const type_and_value & tv, int types)
 {
-    if (types & (1 << tv.t)) return;
-    throw vm_error("Invalid type %s", type_name(tv.t));
+    if (types & (1 << tv.t())) return;
+    throw vm_error("Invalid type %s", type_name(tv.t()));
 }
 
 static vm_error op_type_error(const char * op, type t1, type t2)
@@ -174,77 +534,58 @@ static vm_error op_type_error(const char * op, type t1, type t2)
 
 static bool is_equal(const type_and_value & tv1, const type_and_value & tv2)
 {
-    if (tv1.t != tv2.t) return false;
-    switch (tv1.t)
+    if (tv1.t() != tv2.t()) return false;
+    switch (tv1.t())
     {
     case NIL: return true;
-    case INT: return tv1.v.i == tv2.v.i;
-    case FLOAT: return tv1.v.f == tv2.v.f;
-    case BOOL: return tv1.v.b == tv2.v.b;
-    case STRING: return tv1.v.s->value == tv2.v.s->value;
-    case OBJECT: return tv1.v.o == tv2.v.o;
-    case ARRAY: return tv1.v.a == tv2.v.a;
-    case CLOSURE: return tv1.v.c == tv2.v.c;
-    default: throw vm_error("Unknown type %d", tv1.t);
+    case INT: return tv1.i() == tv2.i();
+    case FLOAT: return tv1.f() == tv2.f();
+    case BOOL: return tv1.b() == tv2.b();
+    case STRING: return str_equal()(tv1.s(), tv2.s());
+    case OBJECT: return tv1.o() == tv2.o();
+    case ARRAY: return tv1.a() == tv2.a();
+    case CLOSURE: return tv1.c() == tv2.c();
+    default: throw vm_error("Unknown type %d", tv1.t());
     }
 }
 
 static bool is_greater(const type_and_value & tv1, const type_and_value & tv2)
 {
-    if (tv1.t != tv2.t)
-        throw op_type_error(">", tv1.t, tv2.t);
-    switch (tv1.t)
+    if (tv1.t() != tv2.t())
+        throw op_type_error(">", tv1.t(), tv2.t());
+    switch (tv1.t())
     {
-    case INT: return tv1.v.i > tv2.v.i;
-    case FLOAT: return tv1.v.f > tv2.v.f;
-    case STRING: return tv1.v.s->value > tv2.v.s->value;
-    default: throw op_type_error(">", tv1.t, tv2.t);
+    case INT: return tv1.i() > tv2.i();
+    case FLOAT: return tv1.f() > tv2.f();
+    case STRING: return tv1.s()->value.data() > tv2.s()->value.data();
+    default: throw op_type_error(">", tv1.t(), tv2.t());
     }
 }
 
 static bool is_less(const type_and_value & tv1, const type_and_value & tv2)
 {
-    if (tv1.t != tv2.t)
-        throw op_type_error("<", tv1.t, tv2.t);
-    switch (tv1.t)
+    if (tv1.t() != tv2.t())
+        throw op_type_error("<", tv1.t(), tv2.t());
+    switch (tv1.t())
     {
-    case INT: return tv1.v.i < tv2.v.i;
-    case FLOAT: return tv1.v.f < tv2.v.f;
-    case STRING: return tv1.v.s->value < tv2.v.s->value;
-    default: throw op_type_error("<", tv1.t, tv2.t);
+    case INT: return tv1.i() < tv2.i();
+    case FLOAT: return tv1.f() < tv2.f();
+    case STRING: return tv1.s()->value.data() < tv2.s()->value.data();
+    default: throw op_type_error("<", tv1.t(), tv2.t());
     }
 }
 
-static type_and_value value_to_string(const type_and_value & tv)
-{
-    const int buf_len = 30;
-    static char buf[buf_len];
-    switch (tv.t)
-    {
-    case NIL: return new_string("null");
-    case INT: snprintf(buf, buf_len, "%lld", tv.v.i); break;
-    case FLOAT: snprintf(buf, buf_len, "%f", tv.v.f); break;
-    case BOOL: return tv.v.b ? new_string("true") : new_string("false");
-    case STRING: return tv;
-    case OBJECT: snprintf(buf, buf_len, "object@%p", tv.v.o); break;
-    case ARRAY: snprintf(buf, buf_len, "array@%p", tv.v.a); break;
-    case CLOSURE: snprintf(buf, buf_len, "closure@%p", tv.v.c); break;
-    default: throw vm_error("Unknown type %d", tv.t);
-    }
-    return new_string(buf);
-}
-
 // static void debug_print_value(const type_and_value & tv, int indent = 0)
 // {
-//     switch (tv.t)
+//     switch (tv.t())
 //     {
-//     case INT: printf("%lld", tv.v.i); break;
-//     case FLOAT: printf("%f", tv.v.f); break;
-//     case BOOL: printf(tv.v.b ? "true" : "false"); break;
-//     case STRING: printf("\"%s\"", tv.v.s->value.c_str()); break;
+//     case INT: printf("%lld", tv.i()); break;
+//     case FLOAT: printf("%f", tv.f()); break;
+//     case BOOL: printf(tv.b() ? "true" : "false"); break;
+//     case STRING: printf("\"%s\"", tv.s()->value.c_str()); break;
 //     case OBJECT:
 //         printf("{\n");
-//         for (auto & p : tv.v.o->value)
+//         for (auto & p : tv.o()->value)
 //         {
 //             for (int i = 0; i < indent + 2; i++) putchar(' ');
 //             printf("\"%s\": ", p.first.c_str());
@@ -269,28 +610,230 @@ static type_and_value value_to_string(const type_and_value & tv)
 //     }
 // }
 
-type_and_value new_string(const std::string & str)
+// The scope object of a call is only created once something stores into it
+// or captures it, so calls that only use arguments and locals allocate nothing
+static obj * materialize(stack_info * si)
+{
+    if (!si->c_info)
+        si->c_info = new_closure_info(si->super, new_empty_object());
+    return si->c_info->value.self.o();
+}
+
+static obj * scope_obj(const stack_info * si)
+{
+    return si->c_info ? si->c_info->value.self.o() : nullptr;
+}
+
+// Inline cache of a named field access site, mapping the shapes seen at the
+// site to the slot index of the field. A store that adds the field records
+// the shape transition as well.
+struct field_cache
+{
+    static const int size = 4;
+    static const uint32_t absent = UINT32_MAX;
+
+    int count;
+    shape * from[size];
+    shape * to[size];
+    uint32_t index[size];
+
+    void add(shape * f, shape * t, uint32_t idx)
+    {
+        if (count == size) return;
+        from[count] = f;
+        to[count] = t;
+        index[count] = idx;
+        count++;
+    }
+};
+
+// Run time state of a script: inline caches, the interned string pool and
+// the code that runs. That is the script's own code, which may be a mapped
+// file shared by every vm, until the first rewrite copies it, see quicken.
+struct script_state
+{
+    const script * s;
+    std::vector<field_cache> caches;
+    std::vector<str *> strings;
+    std::vector<uint8_t> code; // empty until the first rewrite
+    code_view view;
+    // Closures by address of their ENTER, only counted with the JIT on
+    std::unordered_map<int, int> calls;
+    std::unordered_map<int, jit_code *> jit;
+
+    ~script_state()
+    {
+        for (auto & p : jit)
+            if (p.second) jit_free(p.second);
+    }
+};
+
+typedef std::unordered_map<const script *, script_state *> script_states;
+
+static script_state * get_state(script_states & states, const script * s)
 {
-    return type_and_value{STRING, {.s = new_obj<str_def>(str)}};
+    auto p = states.find(s);
+    if (p != states.end())
+        return p->second;
+    if (!s->verified)
+        verify_script(*s);
+    script_state & state = *(states[s] = new script_state);
+    state.s = s;
+    state.caches.assign(s->cache_count, field_cache{});
+    for (std::string_view str : s->string_pool)
+        state.strings.push_back(intern(str));
+    state.view = s->code;
+    return &state;
+}
+
+// Rewrites the instruction at pc in this vm's copy of the code, made on
+// the first call. Frames still running the script's code are not affected,
+// the instructions of both copies do the same.
+static void quicken(script_state * state, int pc, uint8_t op)
+{
+    if (state->code.empty())
+    {
+        state->code.assign(state->s->code.data(), state->s->code.data() + state->s->code.size());
+        state->view = {state->code.data(), state->code.size()};
+    }
+    state->code[pc] = op;
+}
+
+static str * get_string(const script_state * state, uint32_t idx)
+{
+#ifndef CUTE_FAST_DISPATCH
+    if (idx >= state->strings.size())
+        throw vm_error("String pool index (%u) out of range", idx);
+#endif
+    return state->strings[idx];
+}
+
+static field_cache * get_cache(script_state * state, uint32_t idx)
+{
+#ifndef CUTE_FAST_DISPATCH
+    if (idx >= state->caches.size())
+        throw vm_error("Inline cache index (%u) out of range", idx);
+#endif
+    return &state->caches[idx];
+}
+
+static type_and_value load_field(obj * o, str * key, field_cache * fc)
+{
+    obj_def & od = o->value;
+    if (fc)
+    {
+        for (int i = 0; i < fc->count; i++)
+        {
+            if (fc->from[i] == od.sh)
+            {
+                uint32_t idx = fc->index[i];
+                return idx == field_cache::absent ? nil_value() : od.slots[idx];
+            }
+        }
+    }
+    const type_and_value * p = od.find(key);
+    if (fc && od.sh)
+        fc->add(od.sh, od.sh, p ? p - od.slots.data() : field_cache::absent);
+    return p ? *p : nil_value();
+}
+
+static void store_field(obj * o, str * key, const type_and_value & tv, field_cache * fc)
+{
+    obj_def & od = o->value;
+    if (tv.t() == NIL)
+    {
+        od.erase(key);
+        return;
+    }
+    gc_write_barrier(o, tv);
+    gc_write_barrier(o, string_value(key));
+    if (fc)
+    {
+        for (int i = 0; i < fc->count; i++)
+        {
+            if (fc->from[i] == od.sh)
+            {
+                if (fc->to[i] == od.sh)
+                    od.slots[fc->index[i]] = tv;
+                else
+                {
+                    od.sh = fc->to[i];
+                    od.slots.push_back(tv);
+                }
+                return;
+            }
+        }
+    }
+    shape * old_sh = od.sh;
+    od.set(key, tv);
+    if (fc && old_sh && od.sh)
+        fc->add(old_sh, od.sh, od.find(key) - od.slots.data());
+}
+
+type_and_value new_string(std::string_view str)
+{
+    gc_account(str.size());
+    return string_value(new_obj<str_def>(str));
+}
+
+type_and_value concat_strings(str * s1, str * s2)
+{
+    // Short results are cheaper to copy than to keep as a rope
+    const size_t rope_min_size = 64;
+    if (!s1->value.size()) return string_value(s2);
+    if (!s2->value.size()) return string_value(s1);
+    if (s1->value.size() + s2->value.size() < rope_min_size)
+    {
+        std::string buf(s1->value.data());
+        buf += s2->value.data();
+        return new_string(buf);
+    }
+    return string_value(new_obj<str_def>(s1, s2));
+}
+
+type_and_value new_string_slice(gc_base_obj * owner, std::string_view chars)
+{
+    return string_value(new_obj<str_def>(owner, chars));
 }
 
 type_and_value new_empty_object()
 {
-    return type_and_value{OBJECT, {.o = new_obj<obj_def>()}};
+    return object_value(new_obj<obj_def>());
 }
 
-type_and_value new_array(arr_def::const_iterator begin, arr_def::const_iterator end)
+type_and_value new_array(const type_and_value * begin, const type_and_value * end)
 {
-    return type_and_value{ARRAY, {.a = new_obj<arr_def>(begin, end)}};
+    gc_account((end - begin) * sizeof(type_and_value));
+    return array_value(new_obj<arr_def>(begin, end));
 }
 
+#ifdef CUTE_NAN_BOXING
+type_and_value new_big_int(int64_t i)
+{
+    return tagged_value(type_and_value::big_int_tag, (uintptr_t)new_obj<int64_t>(i));
+}
+#endif
+
 type_and_value new_closure(closure_info * super, const script * s, int addr)
 {
     closure * c = new_obj<closure_def>();
     c->value.super = super;
     c->value.s = s;
     c->value.addr = addr;
-    return type_and_value{CLOSURE, {.c = c}};
+    c->value.native = nullptr;
+    c->value.data = nullptr;
+    return closure_value(c);
+}
+
+type_and_value new_native(native_fn fn, gc_base_obj * data)
+{
+    closure * c = new_obj<closure_def>();
+    c->value.super = nullptr;
+    c->value.s = nullptr;
+    c->value.addr = 0;
+    c->value.native = fn;
+    c->value.data = data;
+    return closure_value(c);
 }
 
 closure_info * new_closure_info(closure_info * super, const type_and_value & self)
@@ -301,595 +844,1330 @@ closure_info * new_closure_info(closure_info * super, const type_and_value & sel
     return ci;
 }
 
-void run_script(const script & s)
+const char native_suspend[] = "Only tasks of the event loop can wait for I/O";
+
+type_and_value new_coroutine(const type_and_value & fn)
+{
+    coroutine * co = new_obj<coroutine_def>();
+    co->value.fn = fn;
+    co->value.state = coroutine_def::NEW;
+    return new_native(nullptr, co);
+}
+
+static coroutine * coroutine_of(const type_and_value & tv)
+{
+    if (tv.t() != CLOSURE) return nullptr;
+    const closure_def & c = tv.c()->value;
+    return c.s || c.native ? nullptr : (coroutine *)c.data;
+}
+
+// The coroutine whose first frame is si, if any
+static coroutine * frame_coroutine(value_stack & stack, const stack_info & si)
+{
+    size_t slot = si.base - si.param_count - 1;
+    return slot < stack.size() ? coroutine_of(stack[slot]) : nullptr;
+}
+
+// Start or continue co, called with the arg_cnt values on top of the stack
+// by the code at pc and ptr, which become those of the coroutine. Returns
+// false if it is done, leaving null in place of the call.
+static bool resume(value_stack & stack, std::vector<stack_info> & info, coroutine_def & co,
+                   uint32_t arg_cnt, int & pc, int & ptr)
+{
+    int slot = stack.size() - arg_cnt - 1;
+    if (co.state == coroutine_def::RUNNING)
+        throw vm_error("Trying to resume a running coroutine");
+    if (co.state == coroutine_def::DONE)
+    {
+        stack.resize(slot);
+        stack.push_back(nil_value());
+        return false;
+    }
+    if (co.state == coroutine_def::NEW)
+    {
+        const closure_def & body = co.fn.c()->value;
+        info.push_back({nullptr, body.super, body.s, (int)arg_cnt, (int)stack.size(), ptr, pc, nullptr});
+        pc = body.addr;
+        ptr = stack.size();
+    }
+    else
+    {
+        // Later arguments are ignored
+        stack.resize(slot);
+        for (const type_and_value & tv : co.stack)
+            stack.push_back(tv);
+        size_t first = info.size();
+        for (stack_info si : co.info)
+        {
+            si.base += slot;
+            si.stack_return += slot;
+            info.push_back(si);
+        }
+        info[first].stack_return = ptr;
+        info[first].pc_return = pc;
+        pc = co.pc;
+        ptr = co.ptr + slot;
+        co.stack.clear();
+        co.info.clear();
+    }
+    co.state = coroutine_def::RUNNING;
+    return true;
+}
+
+// Take the frames of co, from info[first] up, off the stack to go on at pc
+// when resumed, and leave tv in their place. pc and ptr become those of
+// the code that resumed it.
+static void suspend(value_stack & stack, std::vector<stack_info> & info, size_t first, coroutine * co,
+                    int & pc, int & ptr, const type_and_value & tv)
+{
+    coroutine_def & cd = co->value;
+    const stack_info & fi = info[first];
+    int slot = fi.base - fi.param_count - 1;
+    cd.stack.assign(stack.begin() + slot, stack.end());
+    cd.info.assign(info.begin() + first, info.end());
+    for (stack_info & si : cd.info)
+    {
+        si.base -= slot;
+        si.stack_return -= slot;
+    }
+    cd.pc = pc;
+    cd.ptr = ptr - slot;
+    cd.state = coroutine_def::SUSPENDED;
+    // Its stack was not covered by write barriers
+    if ((co->gc_flags & (GC_OLD | GC_REMEMBERED)) == GC_OLD)
+        gc_remember(co);
+    pc = fi.pc_return;
+    ptr = fi.stack_return;
+    info.resize(first);
+    stack.resize(slot);
+    stack.push_back(tv);
+}
+
+// What compiled code sees of the interpreter while it runs a frame
+struct jit_frame
+{
+    std::vector<stack_info> * info;
+    stack_info * cur_info;
+    obj ** cur_obj;
+    script_state * state;
+};
+
+// Helpers called from compiled code. They do what the interpreter does for
+// their instruction, but return nonzero instead of throwing so the
+// interpreter can run the instruction again and report the error. The code
+// has been verified, so operands are in range.
+static jit_frame & frame_of(jit_context * ctx)
+{
+    return *(jit_frame *)ctx->vm;
+}
+
+static int jit_load(jit_context * ctx, uint32_t str_idx, uint32_t, uint32_t)
+{
+    jit_frame & f = frame_of(ctx);
+    obj * o = *f.cur_obj;
+    ctx->stack->push_back(o ? load_field(o, f.state->strings[str_idx], nullptr) : nil_value());
+    return 0;
+}
+
+static int jit_store(jit_context * ctx, uint32_t str_idx, uint32_t, uint32_t)
+{
+    jit_frame & f = frame_of(ctx);
+    type_and_value tv = ctx->stack->back();
+    ctx->stack->pop_back();
+    if (!*f.cur_obj && tv.t() != NIL)
+        *f.cur_obj = materialize(f.cur_info);
+    if (*f.cur_obj)
+        store_field(*f.cur_obj, f.state->strings[str_idx], tv, nullptr);
+    return 0;
+}
+
+static obj * super_obj(const jit_frame & f)
+{
+    closure_info * c_info = f.cur_info->super;
+    if (!c_info || c_info->value.self.t() != OBJECT)
+        return nullptr;
+    return c_info->value.self.o();
+}
+
+static int jit_load_super(jit_context * ctx, uint32_t str_idx, uint32_t cache_idx, uint32_t)
+{
+    jit_frame & f = frame_of(ctx);
+    obj * o = super_obj(f);
+    if (!o) return 1;
+    ctx->stack->push_back(load_field(o, f.state->strings[str_idx], &f.state->caches[cache_idx]));
+    return 0;
+}
+
+static int jit_store_super(jit_context * ctx, uint32_t str_idx, uint32_t cache_idx, uint32_t)
+{
+    jit_frame & f = frame_of(ctx);
+    obj * o = super_obj(f);
+    if (!o) return 1;
+    type_and_value tv = ctx->stack->back();
+    ctx->stack->pop_back();
+    store_field(o, f.state->strings[str_idx], tv, &f.state->caches[cache_idx]);
+    return 0;
+}
+
+static int jit_load_field(jit_context * ctx, uint32_t str_idx, uint32_t cache_idx, uint32_t)
+{
+    jit_frame & f = frame_of(ctx);
+    type_and_value & tv = ctx->stack->back();
+    if (tv.t() != OBJECT) return 1;
+    tv = load_field(tv.o(), f.state->strings[str_idx], &f.state->caches[cache_idx]);
+    return 0;
+}
+
+static int jit_store_field(jit_context * ctx, uint32_t str_idx, uint32_t cache_idx, uint32_t)
+{
+    jit_frame & f = frame_of(ctx);
+    value_stack & stack = *ctx->stack;
+    const type_and_value & otv = stack[stack.size() - 2];
+    if (otv.t() != OBJECT) return 1;
+    store_field(otv.o(), f.state->strings[str_idx], stack.back(), &f.state->caches[cache_idx]);
+    stack.pop_back();
+    stack.pop_back();
+    return 0;
+}
+
+static int jit_load_local_field(jit_context * ctx, uint32_t slot, uint32_t str_idx, uint32_t cache_idx)
+{
+    jit_frame & f = frame_of(ctx);
+    const type_and_value & otv = (*ctx->stack)[ctx->base + slot];
+    if (otv.t() != OBJECT) return 1;
+    ctx->stack->push_back(load_field(otv.o(), f.state->strings[str_idx], &f.state->caches[cache_idx]));
+    return 0;
+}
+
+static int jit_load_item(jit_context * ctx, uint32_t, uint32_t, uint32_t)
+{
+    value_stack & stack = *ctx->stack;
+    const type_and_value & itv = stack.back();
+    type_and_value & otv = stack[stack.size() - 2];
+    if (otv.t() == OBJECT && itv.t() == STRING)
+        otv = load_field(otv.o(), itv.s(), nullptr);
+    else if (otv.t() == ARRAY && itv.t() == INT)
+    {
+        arr_def & arr = otv.a()->value;
+        int64_t idx = itv.i() >= 0 ? itv.i() : arr.size() + itv.i();
+        if (idx < 0 || idx >= arr.size()) return 1;
+        otv = arr.get(idx);
+    }
+    else
+        return 1;
+    stack.pop_back();
+    return 0;
+}
+
+static int jit_store_item(jit_context * ctx, uint32_t, uint32_t, uint32_t)
+{
+    value_stack & stack = *ctx->stack;
+    const type_and_value & tv = stack.back();
+    const type_and_value & itv = stack[stack.size() - 2];
+    const type_and_value & otv = stack[stack.size() - 3];
+    if (otv.t() == OBJECT && itv.t() == STRING)
+        store_field(otv.o(), itv.s(), tv, nullptr);
+    else if (otv.t() == ARRAY && itv.t() == INT)
+    {
+        arr_def & arr = otv.a()->value;
+        int64_t idx = itv.i() >= 0 ? itv.i() : arr.size() + itv.i();
+        if (idx < 0 || idx >= arr.size()) return 1;
+        gc_write_barrier(otv.a(), tv);
+        arr.set(idx, tv);
+    }
+    else
+        return 1;
+    stack.resize(stack.size() - 3);
+    return 0;
+}
+
+static int jit_push_string(jit_context * ctx, uint32_t str_idx, uint32_t, uint32_t)
+{
+    ctx->stack->push_back(string_value(frame_of(ctx).state->strings[str_idx]));
+    return 0;
+}
+
+static int jit_push_arg(jit_context * ctx, uint32_t arg_idx, uint32_t, uint32_t)
+{
+    const stack_info * si = frame_of(ctx).cur_info;
+    if (arg_idx < si->param_count)
+        ctx->stack->push_back((*ctx->stack)[si->base - si->param_count + arg_idx]);
+    else
+        ctx->stack->push_back(nil_value());
+    return 0;
+}
+
+static int jit_push_self(jit_context * ctx, uint32_t, uint32_t, uint32_t)
+{
+    jit_frame & f = frame_of(ctx);
+    *f.cur_obj = materialize(f.cur_info);
+    ctx->stack->push_back(f.cur_info->c_info->value.self);
+    return 0;
+}
+
+static int jit_push_super(jit_context * ctx, uint32_t level, uint32_t, uint32_t)
+{
+    closure_info * c_info = frame_of(ctx).cur_info->super;
+    for (int i = 0; c_info && i < level; i++)
+        c_info = c_info->value.super;
+    if (!c_info) return 1;
+    ctx->stack->push_back(c_info->value.self);
+    return 0;
+}
+
+static void jit_poll(jit_context * ctx)
+{
+    gc_poll(*ctx->stack, *frame_of(ctx).info);
+}
+
+static const jit_helpers jit_vm_helpers = []
+{
+    jit_helpers h{};
+    h.ops[LOAD] = jit_load;
+    h.ops[STORE] = jit_store;
+    h.ops[LOAD_SUPER] = jit_load_super;
+    h.ops[STORE_SUPER] = jit_store_super;
+    h.ops[LOAD_FIELD] = jit_load_field;
+    h.ops[STORE_FIELD] = jit_store_field;
+    h.ops[LOAD_LOCAL_FIELD] = jit_load_local_field;
+    h.ops[LOAD_ITEM] = jit_load_item;
+    h.ops[STORE_ITEM] = jit_store_item;
+    h.ops[PUSH_STRING] = jit_push_string;
+    h.ops[PUSH_ARG] = jit_push_arg;
+    h.ops[PUSH_SELF] = jit_push_self;
+    h.ops[PUSH_SUPER] = jit_push_super;
+    h.poll = jit_poll;
+    return h;
+}();
+
+// Continue the current frame in its compiled code from pc, returns the pc
+// to continue interpreting at
+static int run_jit(const jit_code * jc, value_stack & stack, std::vector<stack_info> & info,
+                   obj *& cur_obj, script_state * state, int pc)
 {
-    std::vector<type_and_value> stack = {new_empty_object()};
-    obj_def & libs = stack[0].v.o->value;
-    load_misc(libs);
-    std::vector<stack_info> info;
-    info.push_back({new_closure_info(nullptr, new_empty_object()), &s, 0, -1, -1});
     stack_info * cur_info = &info.back();
-    obj_def * cur_obj = &cur_info->c_info->value.self.v.o->value;
-    auto * code = &s.code;
-    auto * string_pool = &s.string_pool;
-    int pc = 0;
-    int ptr = 1;
+    stack.reserve(cur_info->base + jit_max_depth(jc));
+    jit_frame f{&info, cur_info, &cur_obj, state};
+    jit_context ctx{&stack, cur_info->base, &f};
+    return jit_run(jc, &ctx, pc);
+}
+
+// CUTE_FAST_DISPATCH selects direct threading (labels as values) with
+// unchecked operand decoding, otherwise a checked switch loop is used
+#ifdef CUTE_FAST_DISPATCH
+#define FETCH() (bc[pc++])
+#define FETCH_WIDE() code_next_wide(bc, pc)
+#define INSTR(op) L_##op:
+#define NEXT { wide = false; goto * labels[FETCH()]; }
+#else
+#define FETCH() code_next(code, pc)
+#define FETCH_WIDE() code_next_wide(code, pc)
+#define INSTR(op) case op:
+#define NEXT { wide = false; break; }
+#endif
+// Unsigned and signed operand, widened by a preceding WIDE
+#define ARG() (wide ? FETCH_WIDE() : (uint32_t)FETCH())
+#define SARG() (wide ? (int32_t)FETCH_WIDE() : (int32_t)(int8_t)FETCH())
+// Rewrite the instruction just fetched, which has no operands
+#define QUICKEN(op) (quicken(state, pc - 1, (op)), bc = code->data())
+// Specialize a generic comparison for INT or FLOAT operands
+#define QUICKEN_CMP(op_int)                                      \
+    if (tv.t() == tv2.t() && (tv.t() == INT || tv.t() == FLOAT)) \
+        QUICKEN(tv.t() == INT ? op_int : op_int + 1)
+// Quickened instruction on two operands of the given type. Other operands
+// undo the rewrite and run the generic instruction again.
+#define QUICKENED(op, generic, type_, stmt)                         \
+            INSTR(op)                                               \
+                {                                                   \
+                    type_and_value & tv2 = stack_top(stack, ptr);   \
+                    type_and_value & tv = stack_top(stack, ptr, 1); \
+                    if (tv.t() != type_ || tv2.t() != type_)        \
+                    {                                               \
+                        quicken(state, --pc, generic);              \
+                        NEXT;                                       \
+                    }                                               \
+                    stmt;                                           \
+                    stack.pop_back();                               \
+                }                                                   \
+                NEXT;
+
+// Stack and frames of the code a vm runs, see cute::vm::begin()
+struct vm_context
+{
+    value_stack stack; // stack[0] holds the libraries
+    std::vector<stack_info> info;
+    script_states * states;
+    bool use_jit;
+    event_loop loop;
+    event_loop * saved_loop; // loop_current before begin()
+};
+
+// Run the closure at addr of s on the current heap, called with the
+// arg_cnt values on top of the stack, below which is the closure itself.
+// Returns when the closure does, leaving its result in place of the
+// closure and the arguments. With s null the closure is a coroutine and
+// the call returns when it yields. c_info is the scope of the frame if it
+// exists up front. Errors are printed, or stored in err if given, and
+// leave null as the result.
+static bool execute(vm_context & ctx, const script * s, int addr, closure_info * c_info,
+                    closure_info * super, uint32_t arg_cnt, std::string * err)
+{
+    value_stack & stack = ctx.stack;
+    std::vector<stack_info> & info = ctx.info;
+    script_states & states = *ctx.states;
+    bool use_jit = ctx.use_jit;
+    obj_def & libs = stack[0].o()->value;
+    size_t depth = info.size();
+    size_t stack_size = stack.size();
+    stack_info * cur_info = nullptr;
+    obj * cur_obj = nullptr;
+    script_state * state = nullptr;
+    const code_view * code = nullptr;
+    const uint8_t * bc = nullptr;
+    int pc = addr;
+    int ptr = stack.size();
+    bool wide = false;
     try
     {
+        if (s)
+            info.push_back({c_info, super, s, (int)arg_cnt, (int)stack.size(), -1, -1, nullptr});
+        else
+        {
+            pc = ptr = -1;
+            if (!resume(stack, info, coroutine_of(stack[stack_size - arg_cnt - 1])->value, arg_cnt, pc, ptr))
+                return true;
+        }
+        cur_info = &info.back();
+        cur_obj = scope_obj(cur_info);
+        state = get_state(states, cur_info->s);
+        code = &state->view;
+        bc = code->data();
+#ifdef CUTE_FAST_DISPATCH
+        void * labels[256];
+        for (void *& label : labels)
+            label = &&L_UNKNOWN;
+#define X(op, args, imm) labels[op] = &&L_##op;
+        CUTE_INSTRUCTIONS(X)
+#undef X
+        NEXT;
+        {
+            {
+#else
         while (1)
         {
-            switch (code_next(code, pc))
+            switch (FETCH())
             {
-            case LOAD:
+#endif
+            INSTR(LOAD)
                 {
-                    uint8_t str_idx = code_next(code, pc);
-                    auto p = cur_obj->find(get_string(string_pool, str_idx));
-                    if (p == cur_obj->end()) stack.push_back({NIL});
-                    else stack.push_back(p->second);
+                    uint32_t str_idx = ARG();
+                    str * key = get_string(state, str_idx);
+                    if (!cur_obj) stack.push_back(nil_value());
+                    else stack.push_back(load_field(cur_obj, key, nullptr));
                 }
-                break;
-            case STORE:
+                NEXT;
+            INSTR(STORE)
                 {
-                    uint8_t str_idx = code_next(code, pc);
+                    uint32_t str_idx = ARG();
                     type_and_value tv = stack_pop(stack, ptr);
-                    if (tv.t == NIL)
-                        cur_obj->erase(get_string(string_pool, str_idx));
-                    else
-                        (*cur_obj)[get_string(string_pool, str_idx)] = tv;
+                    if (!cur_obj && tv.t() != NIL)
+                        cur_obj = materialize(cur_info);
+                    if (cur_obj)
+                        store_field(cur_obj, get_string(state, str_idx), tv, nullptr);
                 }
-                break;
-            case LOAD_SUPER:
+                NEXT;
+            INSTR(LOAD_SUPER)
                 {
-                    uint8_t str_idx = code_next(code, pc);
-                    closure_info * c_info = cur_info->c_info->value.super;
+                    uint32_t str_idx = ARG();
+                    field_cache * fc = get_cache(state, ARG());
+                    closure_info * c_info = cur_info->super;
                     if (!c_info)
                         throw vm_error("Trying to get level 0 super closure which does not exist");
                     type_and_value stv = c_info->value.self;
                     check_type(stv, OBJECT);
-                    obj_def * super_obj = &stv.v.o->value;
-                    auto p = super_obj->find(get_string(string_pool, str_idx));
-                    if (p == super_obj->end()) stack.push_back({NIL});
-                    else stack.push_back(p->second);
+                    stack.push_back(load_field(stv.o(), get_string(state, str_idx), fc));
                 }
-                break;
-            case STORE_SUPER:
+                NEXT;
+            INSTR(STORE_SUPER)
                 {
-                    uint8_t str_idx = code_next(code, pc);
-                    closure_info * c_info = cur_info->c_info->value.super;
+                    uint32_t str_idx = ARG();
+                    field_cache * fc = get_cache(state, ARG());
+                    closure_info * c_info = cur_info->super;
                     if (!c_info)
                         throw vm_error("Trying to get level 0 super closure which does not exist");
                     type_and_value stv = c_info->value.self;
                     check_type(stv, OBJECT);
-                    obj_def * super_obj = &stv.v.o->value;
                     type_and_value tv = stack_pop(stack, ptr);
-                    if (tv.t == NIL)
-                        super_obj->erase(get_string(string_pool, str_idx));
-                    else
-                        (*super_obj)[get_string(string_pool, str_idx)] = tv;
+                    store_field(stv.o(), get_string(state, str_idx), tv, fc);
                 }
-                break;
-            case LOAD_FIELD:
+                NEXT;
+            INSTR(LOAD_FIELD)
                 {
-                    uint8_t str_idx = code_next(code, pc);
+                    uint32_t str_idx = ARG();
+                    field_cache * fc = get_cache(state, ARG());
                     type_and_value otv = stack_pop(stack, ptr);
                     check_type(otv, OBJECT);
-                    obj_def & obj = otv.v.o->value;
-                    auto p = obj.find(get_string(string_pool, str_idx));
-                    if (p == obj.end()) stack.push_back({NIL});
-                    else stack.push_back(p->second);
+                    stack.push_back(load_field(otv.o(), get_string(state, str_idx), fc));
                 }
-                break;
-            case STORE_FIELD:
+                NEXT;
+            INSTR(STORE_FIELD)
                 {
-                    uint8_t str_idx = code_next(code, pc);
+                    uint32_t str_idx = ARG();
+                    field_cache * fc = get_cache(state, ARG());
                     type_and_value tv = stack_pop(stack, ptr);
                     type_and_value otv = stack_pop(stack, ptr);
                     check_type(otv, OBJECT);
-                    obj_def & obj = otv.v.o->value;
-                    if (tv.t == NIL)
-                        obj.erase(get_string(string_pool, str_idx));
-                    else
-                        obj[get_string(string_pool, str_idx)] = tv;
+                    store_field(otv.o(), get_string(state, str_idx), tv, fc);
                 }
-                break;
-            case LOAD_ITEM:
+                NEXT;
+            INSTR(LOAD_ITEM)
                 {
                     type_and_value itv = stack_pop(stack, ptr);
                     type_and_value otv = stack_pop(stack, ptr);
                     check_types(otv, (1 << OBJECT) | (1 << ARRAY));
-                    if (otv.t == OBJECT)
+                    if (otv.t() == OBJECT)
                     {
                         check_type(itv, STRING);
-                        obj_def & obj = otv.v.o->value;
-                        auto p = obj.find(itv.v.s->value);
-                        if (p == obj.end()) stack.push_back({NIL});
-                        else stack.push_back(p->second);
+                        stack.push_back(load_field(otv.o(), itv.s(), nullptr));
                     }
                     else
                     {
                         check_type(itv, INT);
-                        arr_def & arr = otv.v.a->value;
-                        int64_t idx = itv.v.i >= 0 ? itv.v.i : arr.size() + itv.v.i;
+                        arr_def & arr = otv.a()->value;
+                        int64_t idx = itv.i() >= 0 ? itv.i() : arr.size() + itv.i();
                         if (idx < 0 || idx >= arr.size())
                             throw vm_error("Array index (%lld) out of bound", idx);
-                        stack.push_back(arr[idx]);
+                        stack.push_back(arr.get(idx));
                     }
                 }
-                break;
-            case STORE_ITEM:
+                NEXT;
+            INSTR(STORE_ITEM)
                 {
                     type_and_value tv = stack_pop(stack, ptr);
                     type_and_value itv = stack_pop(stack, ptr);
                     type_and_value otv = stack_pop(stack, ptr);
                     check_types(otv, (1 << OBJECT) | (1 << ARRAY));
-                    if (otv.t == OBJECT)
+                    if (otv.t() == OBJECT)
                     {
                         check_type(itv, STRING);
-                        obj_def & obj = otv.v.o->value;
-                        if (tv.t == NIL)
-                            obj.erase(itv.v.s->value);
-                        else
-                            obj[itv.v.s->value] = tv;
+                        store_field(otv.o(), itv.s(), tv, nullptr);
                     }
                     else
                     {
                         check_type(itv, INT);
-                        arr_def & arr = otv.v.a->value;
-                        int64_t idx = itv.v.i >= 0 ? itv.v.i : arr.size() + itv.v.i;
+                        arr_def & arr = otv.a()->value;
+                        int64_t idx = itv.i() >= 0 ? itv.i() : arr.size() + itv.i();
                         if (idx < 0 || idx >= arr.size())
                             throw vm_error("Array index (%lld) out of bound", idx);
-                        arr[idx] = tv;
+                        gc_write_barrier(otv.a(), tv);
+                        arr.set(idx, tv);
                     }
                 }
-                break;
-            case PUSH_BINT:
+                NEXT;
+            INSTR(PUSH_BINT)
                 {
-                    int8_t i = code_next(code, pc);
-                    type_and_value tv{INT, {.i = i}};
-                    stack.push_back(tv);
+                    int8_t i = FETCH();
+                    stack.push_back(int_value(i));
                 }
-                break;
-            case PUSH_WINT:
+                NEXT;
+            INSTR(PUSH_WINT)
                 {
-                    int16_t i = (uint16_t)code_next(code, pc);
-                    i |= (uint16_t)code_next(code, pc) << 8;
-                    type_and_value tv{INT, {.i = i}};
-                    stack.push_back(tv);
+                    int16_t i = (uint16_t)FETCH();
+                    i |= (uint16_t)FETCH() << 8;
+                    stack.push_back(int_value(i));
                 }
-                break;
-            case PUSH_DWINT:
+                NEXT;
+            INSTR(PUSH_DWINT)
                 {
                     int32_t i = 0;
                     for (int n = 0; n < 4; n++)
-                        i |= (uint32_t)code_next(code, pc) << (8 * n);
-                    type_and_value tv{INT, {.i = i}};
-                    stack.push_back(tv);
+                        i |= (uint32_t)FETCH() << (8 * n);
+                    stack.push_back(int_value(i));
                 }
-                break;
-            case PUSH_INT:
+                NEXT;
+            INSTR(PUSH_INT)
                 {
                     int64_t i = 0;
                     for (int n = 0; n < 8; n++)
-                        i |= (uint64_t)code_next(code, pc) << (8 * n);
-                    type_and_value tv{INT, {.i = i}};
-                    stack.push_back(tv);
+                        i |= (uint64_t)FETCH() << (8 * n);
+                    stack.push_back(int_value(i));
                 }
-                break;
-            case PUSH_FLOAT:
+                NEXT;
+            INSTR(PUSH_FLOAT)
                 {
                     uint64_t i = 0;
                     for (int n = 0; n < 8; n++)
-                        i |= (uint64_t)code_next(code, pc) << (8 * n);
-                    type_and_value tv{FLOAT, {.f = *(double *)&i}};
-                    stack.push_back(tv);
+                        i |= (uint64_t)FETCH() << (8 * n);
+                    stack.push_back(float_value(*(double *)&i));
                 }
-                break;
-            case PUSH_STRING:
+                NEXT;
+            INSTR(PUSH_STRING)
                 {
-                    uint8_t str_idx = code_next(code, pc);
-                    stack.push_back(new_string(get_string(string_pool, str_idx)));
+                    uint32_t str_idx = ARG();
+                    stack.push_back(string_value(get_string(state, str_idx)));
                 }
-                break;
-            case PUSH_CLOSURE:
+                NEXT;
+            INSTR(PUSH_CLOSURE)
                 {
-                    uint8_t addr = code_next(code, pc);
+                    uint32_t addr = ARG();
+                    cur_obj = materialize(cur_info);
                     stack.push_back(new_closure(cur_info->c_info, cur_info->s, addr));
                 }
-                break;
-            case PUSH_ARG:
+                NEXT;
+            INSTR(PUSH_ARG)
                 {
-                    uint8_t arg_idx = code_next(code, pc);
+                    uint32_t arg_idx = ARG();
                     if (arg_idx < 0)
-                        throw vm_error("Trying to get argument with negative index %d", arg_idx);
+                        throw vm_error("Trying to get argument with negative index %u", arg_idx);
                     if (arg_idx < cur_info->param_count)
-                        stack.push_back(stack.at(ptr - cur_info->param_count + arg_idx));
+                        stack.push_back(stack.at(cur_info->base - cur_info->param_count + arg_idx));
                     else
-                        stack.push_back({NIL});
+                        stack.push_back(nil_value());
                 }
-                break;
-            case PUSH_SELF:
+                NEXT;
+            INSTR(PUSH_SELF)
+                cur_obj = materialize(cur_info);
                 stack.push_back(cur_info->c_info->value.self);
-                break;
-            case PUSH_SUPER:
+                NEXT;
+            INSTR(PUSH_SUPER)
                 {
-                    int level = code_next(code, pc);
-                    closure_info * c_info = cur_info->c_info;
-                    for (int i = 0; i < level + 1; i++)
-                    {
+                    uint32_t level = ARG();
+                    closure_info * c_info = cur_info->super;
+                    for (int i = 0; c_info && i < level; i++)
                         c_info = c_info->value.super;
-                        if (!c_info)
-                            throw vm_error("Trying to get level %d super closure which does not exist", level);
-                    }
+                    if (!c_info)
+                        throw vm_error("Trying to get level %u super closure which does not exist", level);
                     stack.push_back(c_info->value.self);
                 }
-                break;
-            case NEW_ARRAY:
+                NEXT;
+            INSTR(NEW_ARRAY)
                 {
-                    uint8_t cnt = code_next(code, pc);
+                    uint32_t cnt = ARG();
                     if (stack.size() - cnt < ptr)
                         throw vm_error("Current stack frame empty");
-                    type_and_value tv = new_array(stack.cend() - cnt, stack.cend());
+                    type_and_value tv = new_array(stack.end() - cnt, stack.end());
                     stack.resize(stack.size() - cnt);
                     stack.push_back(tv);
                 }
-                break;
-            case POP:
+                NEXT;
+            INSTR(POP)
                 stack_pop(stack, ptr);
-                break;
-            case DUP:
+                NEXT;
+            INSTR(DUP)
                 stack.push_back(stack_top(stack, ptr));
-                break;
-            case ADD:
+                NEXT;
+            INSTR(ADD)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != tv2.t || tv.t != INT && tv.t != FLOAT && tv.t != STRING)
-                        throw op_type_error("+", tv.t, tv2.t);
-                    if (tv.t == INT) tv.v.i += tv2.v.i;
-                    else if (tv.t == FLOAT) tv.v.f += tv2.v.f;
-                    else tv = new_string(tv.v.s->value + tv2.v.s->value);
+                    if (tv.t() != tv2.t() || tv.t() != INT && tv.t() != FLOAT && tv.t() != STRING)
+                        throw op_type_error("+", tv.t(), tv2.t());
+                    if (tv.t() == INT) tv = int_value(tv.i() + tv2.i());
+                    else if (tv.t() == FLOAT) tv = float_value(tv.f() + tv2.f());
+                    else tv = concat_strings(tv.s(), tv2.s());
+                    QUICKEN(tv.t() == INT ? ADD_INT : tv.t() == FLOAT ? ADD_FLOAT : ADD_STR);
                 }
-                break;
-            case SUB:
+                NEXT;
+            INSTR(SUB)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != tv2.t || tv.t != INT && tv.t != FLOAT)
-                        throw op_type_error("-", tv.t, tv2.t);
-                    if (tv.t == INT) tv.v.i -= tv2.v.i;
-                    else tv.v.f -= tv2.v.f;
+                    if (tv.t() != tv2.t() || tv.t() != INT && tv.t() != FLOAT)
+                        throw op_type_error("-", tv.t(), tv2.t());
+                    if (tv.t() == INT) tv = int_value(tv.i() - tv2.i());
+                    else tv = float_value(tv.f() - tv2.f());
+                    QUICKEN(tv.t() == INT ? SUB_INT : SUB_FLOAT);
                 }
-                break;
-            case MUL:
+                NEXT;
+            INSTR(MUL)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != tv2.t || tv.t != INT && tv.t != FLOAT)
-                        throw op_type_error("*", tv.t, tv2.t);
-                    if (tv.t == INT) tv.v.i *= tv2.v.i;
-                    else tv.v.f *= tv2.v.f;
+                    if (tv.t() != tv2.t() || tv.t() != INT && tv.t() != FLOAT)
+                        throw op_type_error("*", tv.t(), tv2.t());
+                    if (tv.t() == INT) tv = int_value(tv.i() * tv2.i());
+                    else tv = float_value(tv.f() * tv2.f());
+                    QUICKEN(tv.t() == INT ? MUL_INT : MUL_FLOAT);
                 }
-                break;
-            case DIV:
+                NEXT;
+            INSTR(DIV)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != tv2.t || tv.t != INT && tv.t != FLOAT)
-                        throw op_type_error("/", tv.t, tv2.t);
-                    if (tv.t == INT) tv.v.i /= tv2.v.i;
-                    else tv.v.f /= tv2.v.f;
+                    if (tv.t() != tv2.t() || tv.t() != INT && tv.t() != FLOAT)
+                        throw op_type_error("/", tv.t(), tv2.t());
+                    if (tv.t() == INT) tv = int_value(tv.i() / tv2.i());
+                    else tv = float_value(tv.f() / tv2.f());
                 }
-                break;
-            case REM:
+                NEXT;
+            INSTR(REM)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != tv2.t || tv.t != INT)
-                        throw op_type_error("%", tv.t, tv2.t);
-                    tv.v.i %= tv2.v.i;
+                    if (tv.t() != tv2.t() || tv.t() != INT)
+                        throw op_type_error("%", tv.t(), tv2.t());
+                    tv = int_value(tv.i() % tv2.i());
                 }
-                break;
-            case POS:
+                NEXT;
+            INSTR(POS)
                 {
                     type_and_value & tv = stack_top(stack, ptr);
                     check_types(tv, (1 << INT) | (1 << FLOAT));
                 }
-                break;
-            case NEG:
+                NEXT;
+            INSTR(NEG)
                 {
                     type_and_value & tv = stack_top(stack, ptr);
                     check_types(tv, (1 << INT) | (1 << FLOAT));
-                    if (tv.t == INT) tv.v.i = -tv.v.i;
-                    else tv.v.f = -tv.v.f;
+                    if (tv.t() == INT) tv = int_value(-tv.i());
+                    else tv = float_value(-tv.f());
                 }
-                break;
-            case BAND:
+                NEXT;
+            INSTR(BAND)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != INT || tv2.t != INT)
-                        throw op_type_error("&", tv.t, tv2.t);
-                    tv.v.i &= tv2.v.i;
+                    if (tv.t() != INT || tv2.t() != INT)
+                        throw op_type_error("&", tv.t(), tv2.t());
+                    tv = int_value(tv.i() & tv2.i());
                 }
-                break;
-            case BOR:
+                NEXT;
+            INSTR(BOR)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != INT || tv2.t != INT)
-                        throw op_type_error("|", tv.t, tv2.t);
-                    tv.v.i |= tv2.v.i;
+                    if (tv.t() != INT || tv2.t() != INT)
+                        throw op_type_error("|", tv.t(), tv2.t());
+                    tv = int_value(tv.i() | tv2.i());
                 }
-                break;
-            case BXOR:
+                NEXT;
+            INSTR(BXOR)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != INT || tv2.t != INT)
-                        throw op_type_error("^", tv.t, tv2.t);
-                    tv.v.i ^= tv2.v.i;
+                    if (tv.t() != INT || tv2.t() != INT)
+                        throw op_type_error("^", tv.t(), tv2.t());
+                    tv = int_value(tv.i() ^ tv2.i());
                 }
-                break;
-            case BINV:
+                NEXT;
+            INSTR(BINV)
                 {
                     type_and_value & tv = stack_top(stack, ptr);
                     check_type(tv, INT);
-                    tv.v.i = ~tv.v.i;
+                    tv = int_value(~tv.i());
                 }
-                break;
-            case SHL:
+                NEXT;
+            INSTR(SHL)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != INT || tv2.t != INT)
-                        throw op_type_error("<<", tv.t, tv2.t);
-                    tv.v.i <<= tv2.v.i;
+                    if (tv.t() != INT || tv2.t() != INT)
+                        throw op_type_error("<<", tv.t(), tv2.t());
+                    tv = int_value(tv.i() << tv2.i());
                 }
-                break;
-            case SHR:
+                NEXT;
+            INSTR(SHR)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != INT || tv2.t != INT)
-                        throw op_type_error(">>", tv.t, tv2.t);
-                    tv.v.i >>= tv2.v.i;
+                    if (tv.t() != INT || tv2.t() != INT)
+                        throw op_type_error(">>", tv.t(), tv2.t());
+                    tv = int_value(tv.i() >> tv2.i());
                 }
-                break;
-            case USHR:
+                NEXT;
+            INSTR(USHR)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value & tv = stack_top(stack, ptr);
-                    if (tv.t != INT || tv2.t != INT)
-                        throw op_type_error(">>>", tv.t, tv2.t);
-                    tv.v.i = (uint64_t)tv.v.i >> tv2.v.i;
+                    if (tv.t() != INT || tv2.t() != INT)
+                        throw op_type_error(">>>", tv.t(), tv2.t());
+                    tv = int_value((uint64_t)tv.i() >> tv2.i());
                 }
-                break;
-            case CMP_EQ:
+                NEXT;
+            INSTR(CMP_EQ)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value tv = stack_pop(stack, ptr);
-                    stack.push_back({BOOL, {.b = is_equal(tv, tv2)}});
+                    stack.push_back(bool_value(is_equal(tv, tv2)));
+                    QUICKEN_CMP(CMP_EQ_INT);
                 }
-                break;
-            case CMP_NE:
+                NEXT;
+            INSTR(CMP_NE)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value tv = stack_pop(stack, ptr);
-                    stack.push_back({BOOL, {.b = !is_equal(tv, tv2)}});
+                    stack.push_back(bool_value(!is_equal(tv, tv2)));
+                    QUICKEN_CMP(CMP_NE_INT);
                 }
-                break;
-            case CMP_GT:
+                NEXT;
+            INSTR(CMP_GT)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value tv = stack_pop(stack, ptr);
-                    stack.push_back({BOOL, {.b = is_greater(tv, tv2)}});
+                    stack.push_back(bool_value(is_greater(tv, tv2)));
+                    QUICKEN_CMP(CMP_GT_INT);
                 }
-                break;
-            case CMP_LT:
+                NEXT;
+            INSTR(CMP_LT)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value tv = stack_pop(stack, ptr);
-                    stack.push_back({BOOL, {.b = is_less(tv, tv2)}});
+                    stack.push_back(bool_value(is_less(tv, tv2)));
+                    QUICKEN_CMP(CMP_LT_INT);
                 }
-                break;
-            case CMP_GE:
+                NEXT;
+            INSTR(CMP_GE)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value tv = stack_pop(stack, ptr);
-                    stack.push_back({BOOL, {.b = !is_less(tv, tv2)}});
+                    stack.push_back(bool_value(!is_less(tv, tv2)));
+                    QUICKEN_CMP(CMP_GE_INT);
                 }
-                break;
-            case CMP_LE:
+                NEXT;
+            INSTR(CMP_LE)
                 {
                     type_and_value tv2 = stack_pop(stack, ptr);
                     type_and_value tv = stack_pop(stack, ptr);
-                    stack.push_back({BOOL, {.b = !is_greater(tv, tv2)}});
+                    stack.push_back(bool_value(!is_greater(tv, tv2)));
+                    QUICKEN_CMP(CMP_LE_INT);
                 }
-                break;
-            case NOT:
+                NEXT;
+            INSTR(NOT)
                 {
                     type_and_value & tv = stack_top(stack, ptr);
                     check_type(tv, BOOL);
-                    tv.v.b = !tv.v.b;
+                    tv = bool_value(!tv.b());
                 }
-                break;
-            case LEN:
+                NEXT;
+            INSTR(LEN)
                 {
                     type_and_value tv = stack_pop(stack, ptr);
-                    type_and_value ltv{INT};
-                    switch (tv.t)
+                    type_and_value ltv;
+                    switch (tv.t())
                     {
-                    case STRING: ltv.v.i = tv.v.s->value.size(); break;
-                    case OBJECT: ltv.v.i = tv.v.o->value.size(); break;
-                    case ARRAY: ltv.v.i = tv.v.a->value.size(); break;
-                    default: throw vm_error("Cannot apply '#' on type %s", type_name(tv.t));
+                    case STRING: ltv = int_value(tv.s()->value.size()); break;
+                    case OBJECT: ltv = int_value(tv.o()->value.size()); break;
+                    case ARRAY: ltv = int_value(tv.a()->value.size()); break;
+                    default: throw vm_error("Cannot apply '#' on type %s", type_name(tv.t()));
                     }
                     stack.push_back(ltv);
                 }
-                break;
-            case JUMP:
-                pc += (int8_t)code_next(code, pc);
-                break;
-            case JUMP_IF:
+                NEXT;
+            INSTR(JUMP)
+                pc += SARG();
+                gc_poll(stack, info);
+                NEXT;
+            INSTR(JUMP_IF)
                 {
                     type_and_value tv = stack_pop(stack, ptr);
                     check_type(tv, BOOL);
-                    int8_t offset = (int8_t)code_next(code, pc);
-                    if (tv.v.b) pc += offset;
+                    int32_t offset = SARG();
+                    if (tv.b()) pc += offset;
+                    gc_poll(stack, info);
                 }
-                break;
-            case JUMP_UNLESS:
+                NEXT;
+            INSTR(JUMP_UNLESS)
                 {
                     type_and_value tv = stack_pop(stack, ptr);
                     check_type(tv, BOOL);
-                    int8_t offset = (int8_t)code_next(code, pc);
-                    if (!tv.v.b) pc += offset;
+                    int32_t offset = SARG();
+                    if (!tv.b()) pc += offset;
+                    gc_poll(stack, info);
                 }
-                break;
-            case CALL:
+                NEXT;
+            INSTR(CALL)
                 {
-                    uint8_t arg_cnt = code_next(code, pc);
+                    int call_pc = pc - (wide ? 2 : 1);
+                    uint32_t arg_cnt = ARG();
+                    gc_poll(stack, info);
                     const type_and_value & tv = stack_top(stack, ptr, arg_cnt);
                     check_type(tv, CLOSURE);
-                    const script * next_s = tv.v.c->value.s;
+                    const closure_def & fn = tv.c()->value;
+                    if (fn.native)
+                    {
+                        type_and_value result = nil_value();
+                        const char * err = fn.native(fn, stack.end() - arg_cnt, arg_cnt, result);
+                        if (err == native_suspend)
+                        {
+                            // Suspend the whole task, which makes the call
+                            // again once resumed
+                            coroutine * co = coroutine_of(ctx.loop.current);
+                            size_t first = info.size();
+                            bool found = false;
+                            while (co && !found && first > depth)
+                                found = frame_coroutine(stack, info[--first]) == co;
+                            if (!found)
+                                throw vm_error("%s", err);
+                            pc = call_pc;
+                            suspend(stack, info, first, co, pc, ptr, nil_value());
+                            if (info.size() == depth)
+                                goto done;
+                            cur_info = &info.back();
+                            cur_obj = scope_obj(cur_info);
+                            if (cur_info->s != state->s)
+                                state = get_state(states, cur_info->s);
+                            code = &state->view;
+                            bc = code->data();
+                            NEXT;
+                        }
+                        if (err)
+                            throw vm_error("%s", err);
+                        stack.resize(stack.size() - arg_cnt - 1);
+                        stack.push_back(result);
+                        NEXT;
+                    }
+                    if (!fn.s)
+                    {
+                        if (!resume(stack, info, ((coroutine *)fn.data)->value, arg_cnt, pc, ptr))
+                            NEXT;
+                        cur_info = &info.back();
+                        cur_obj = scope_obj(cur_info);
+                        if (cur_info->s != state->s)
+                            state = get_state(states, cur_info->s);
+                        code = &state->view;
+                        bc = code->data();
+                        NEXT;
+                    }
+                    const script * next_s = fn.s;
                     stack_info new_info
                     {
-                        new_closure_info(tv.v.c->value.super, new_empty_object()),
-                        next_s, arg_cnt, ptr, pc
+                        nullptr, fn.super,
+                        next_s, (int)arg_cnt, (int)stack.size(), ptr, pc, nullptr
                     };
                     info.push_back(new_info);
                     cur_info = &info.back();
-                    cur_obj = &cur_info->c_info->value.self.v.o->value;
-                    code = &next_s->code;
-                    string_pool = &next_s->string_pool;
-                    pc = tv.v.c->value.addr;
+                    cur_obj = nullptr;
+                    if (next_s != state->s)
+                        state = get_state(states, next_s);
+                    code = &state->view;
+                    bc = code->data();
+                    pc = fn.addr;
                     ptr = stack.size();
                 }
-                break;
-            case RETURN:
+                NEXT;
+            INSTR(RETURN)
                 {
                     if (stack.size() - 1 != ptr)
                         throw vm_error("Incorrect stack top position");
                     type_and_value tv = stack.back();
-                    stack.resize(stack.size() - cur_info->param_count - 2);
+                    if (coroutine * co = frame_coroutine(stack, *cur_info))
+                    {
+                        // Back to the caller that resumed it last
+                        co->value.state = coroutine_def::DONE;
+                        co->value.fn = nil_value();
+                        tv = nil_value();
+                    }
+                    stack.resize(cur_info->base - cur_info->param_count - 1);
                     stack.push_back(tv);
-                    if (info.size() <= 1)
-                        goto cleanup;
+                    if (info.size() == depth + 1)
+                    {
+                        info.pop_back();
+                        goto done;
+                    }
                     pc = cur_info->pc_return;
                     ptr = cur_info->stack_return;
                     info.pop_back();
                     cur_info = &info.back();
-                    cur_obj = &cur_info->c_info->value.self.v.o->value;
-                    code = &cur_info->s->code;
-                    string_pool = &cur_info->s->string_pool;
-                    gc(stack, info);
+                    cur_obj = scope_obj(cur_info);
+                    if (cur_info->s != state->s)
+                        state = get_state(states, cur_info->s);
+                    code = &state->view;
+                    bc = code->data();
+                    gc_poll(stack, info);
+                    if (cur_info->jit)
+                        pc = run_jit(cur_info->jit, stack, info, cur_obj, state, pc);
                 }
-                break;
-            case IN:
+                NEXT;
+            INSTR(IN)
                 {
-                    static char buf[1024];
-                    if (scanf("%1023s", buf) <= 0)
+                    std::string_view token;
+                    if (!io_read_token(token))
                         throw vm_error("Failed to read from stdin");
-                    stack.push_back(new_string(buf));
+                    stack.push_back(new_string(token));
                 }
-                break;
-            case OUT:
+                NEXT;
+            INSTR(OUT)
                 {
                     type_and_value tv = stack_pop(stack, ptr);
-                    type_and_value stv = value_to_string(tv);
-                    puts(stv.v.s->value.c_str());
+                    io_write_value(tv);
+                    io_write("\n");
                 }
-                break;
-            case LOAD_LIB:
+                NEXT;
+            INSTR(LOAD_LIB)
                 {
-                    uint8_t str_idx = code_next(code, pc);
-                    const std::string & str = get_string(string_pool, str_idx);
-                    auto p = libs.find(str);
-                    if (p == libs.end())
+                    uint32_t str_idx = ARG();
+                    str * name = get_string(state, str_idx);
+                    const type_and_value * p = libs.find(name);
+                    if (!p)
                     {
-                        // TODO: load library dynamically
-                        throw vm_error("Unknown library %s", str.c_str());
+                        std::string lib_name(name->value.data());
+                        type_and_value lib = nil_value();
+                        const char * err = load_extension(lib_name, lib);
+                        if (err)
+                            throw vm_error("Failed to load library %s: %s", lib_name.c_str(), err);
+                        if (lib.t() == NIL)
+                            throw vm_error("Unknown library %s", lib_name.c_str());
+                        libs.set(name, lib);
+                        gc_write_barrier(stack[0].o(), lib);
+                        stack.push_back(lib);
                     }
                     else
-                        stack.push_back(p->second);
+                        stack.push_back(*p);
+                }
+                NEXT;
+            INSTR(ENTER)
+                {
+                    uint32_t cnt = ARG();
+                    if (stack.size() != cur_info->base)
+                        throw vm_error("ENTER outside of function prologue");
+                    stack.resize(stack.size() + cnt, nil_value());
+                    ptr = stack.size();
+                    if (use_jit)
+                    {
+                        int addr = pc - (wide ? 6 : 2);
+                        jit_code *& jc = state->jit[addr];
+                        if (!jc && ++state->calls[addr] == jit_hot_threshold)
+                            jc = jit_compile(*cur_info->s, addr, jit_vm_helpers);
+                        cur_info->jit = jc;
+                        if (jc)
+                            pc = run_jit(jc, stack, info, cur_obj, state, pc);
+                    }
+                }
+                NEXT;
+            INSTR(LOAD_LOCAL)
+                {
+                    uint32_t slot = ARG();
+#ifndef CUTE_FAST_DISPATCH
+                    if (cur_info->base + slot >= ptr)
+                        throw vm_error("Local slot (%u) out of range", slot);
+#endif
+                    stack.push_back(stack[cur_info->base + slot]);
+                }
+                NEXT;
+            INSTR(STORE_LOCAL)
+                {
+                    uint32_t slot = ARG();
+#ifndef CUTE_FAST_DISPATCH
+                    if (cur_info->base + slot >= ptr)
+                        throw vm_error("Local slot (%u) out of range", slot);
+#endif
+                    stack[cur_info->base + slot] = stack_pop(stack, ptr);
+                }
+                NEXT;
+            INSTR(LOAD_LOCAL_FIELD)
+                {
+                    uint32_t slot = ARG();
+                    uint32_t str_idx = ARG();
+                    field_cache * fc = get_cache(state, ARG());
+#ifndef CUTE_FAST_DISPATCH
+                    if (cur_info->base + slot >= ptr)
+                        throw vm_error("Local slot (%u) out of range", slot);
+#endif
+                    const type_and_value & otv = stack[cur_info->base + slot];
+                    check_type(otv, OBJECT);
+                    stack.push_back(load_field(otv.o(), get_string(state, str_idx), fc));
+                }
+                NEXT;
+            INSTR(ADD_BINT)
+                {
+                    int8_t i = FETCH();
+                    type_and_value & tv = stack_top(stack, ptr);
+                    if (tv.t() != INT)
+                        throw op_type_error("+", tv.t(), INT);
+                    tv = int_value(tv.i() + i);
+                }
+                NEXT;
+            INSTR(JUMP_UNLESS_EQ)
+                {
+                    type_and_value tv2 = stack_pop(stack, ptr);
+                    type_and_value tv = stack_pop(stack, ptr);
+                    int32_t offset = SARG();
+                    if (!is_equal(tv, tv2)) pc += offset;
+                    gc_poll(stack, info);
+                }
+                NEXT;
+            INSTR(JUMP_UNLESS_NE)
+                {
+                    type_and_value tv2 = stack_pop(stack, ptr);
+                    type_and_value tv = stack_pop(stack, ptr);
+                    int32_t offset = SARG();
+                    if (is_equal(tv, tv2)) pc += offset;
+                    gc_poll(stack, info);
+                }
+                NEXT;
+            INSTR(JUMP_UNLESS_GT)
+                {
+                    type_and_value tv2 = stack_pop(stack, ptr);
+                    type_and_value tv = stack_pop(stack, ptr);
+                    int32_t offset = SARG();
+                    if (!is_greater(tv, tv2)) pc += offset;
+                    gc_poll(stack, info);
+                }
+                NEXT;
+            INSTR(JUMP_UNLESS_LT)
+                {
+                    type_and_value tv2 = stack_pop(stack, ptr);
+                    type_and_value tv = stack_pop(stack, ptr);
+                    int32_t offset = SARG();
+                    if (!is_less(tv, tv2)) pc += offset;
+                    gc_poll(stack, info);
+                }
+                NEXT;
+            INSTR(JUMP_UNLESS_GE)
+                {
+                    type_and_value tv2 = stack_pop(stack, ptr);
+                    type_and_value tv = stack_pop(stack, ptr);
+                    int32_t offset = SARG();
+                    if (is_less(tv, tv2)) pc += offset;
+                    gc_poll(stack, info);
+                }
+                NEXT;
+            INSTR(JUMP_UNLESS_LE)
+                {
+                    type_and_value tv2 = stack_pop(stack, ptr);
+                    type_and_value tv = stack_pop(stack, ptr);
+                    int32_t offset = SARG();
+                    if (is_greater(tv, tv2)) pc += offset;
+                    gc_poll(stack, info);
                 }
-                break;
+                NEXT;
+            INSTR(NEW_COROUTINE)
+                {
+                    type_and_value & tv = stack_top(stack, ptr);
+                    check_type(tv, CLOSURE);
+                    if (!tv.c()->value.s)
+                        throw vm_error("Only closures of scripts can run as coroutines");
+                    tv = new_coroutine(tv);
+                }
+                NEXT;
+            INSTR(YIELD)
+                {
+                    type_and_value tv = stack_pop(stack, ptr);
+                    // Find the first frame of the innermost coroutine
+                    size_t first = info.size();
+                    coroutine * co = nullptr;
+                    while (!co && first > depth)
+                        co = frame_coroutine(stack, info[--first]);
+                    if (!co)
+                        throw vm_error("Trying to yield outside a coroutine");
+                    suspend(stack, info, first, co, pc, ptr, tv);
+                    if (info.size() == depth)
+                        goto done;
+                    cur_info = &info.back();
+                    cur_obj = scope_obj(cur_info);
+                    if (cur_info->s != state->s)
+                        state = get_state(states, cur_info->s);
+                    code = &state->view;
+                    bc = code->data();
+                }
+                NEXT;
+            INSTR(WIDE)
+                wide = true;
+#ifdef CUTE_FAST_DISPATCH
+                goto * labels[FETCH()];
+#else
+                continue;
+#endif
+            QUICKENED(ADD_INT, ADD, INT, tv = int_value(tv.i() + tv2.i()))
+            QUICKENED(ADD_FLOAT, ADD, FLOAT, tv = float_value(tv.f() + tv2.f()))
+            QUICKENED(ADD_STR, ADD, STRING, tv = concat_strings(tv.s(), tv2.s()))
+            QUICKENED(SUB_INT, SUB, INT, tv = int_value(tv.i() - tv2.i()))
+            QUICKENED(SUB_FLOAT, SUB, FLOAT, tv = float_value(tv.f() - tv2.f()))
+            QUICKENED(MUL_INT, MUL, INT, tv = int_value(tv.i() * tv2.i()))
+            QUICKENED(MUL_FLOAT, MUL, FLOAT, tv = float_value(tv.f() * tv2.f()))
+            QUICKENED(CMP_EQ_INT, CMP_EQ, INT, tv = bool_value(tv.i() == tv2.i()))
+            QUICKENED(CMP_EQ_FLOAT, CMP_EQ, FLOAT, tv = bool_value(tv.f() == tv2.f()))
+            QUICKENED(CMP_NE_INT, CMP_NE, INT, tv = bool_value(tv.i() != tv2.i()))
+            QUICKENED(CMP_NE_FLOAT, CMP_NE, FLOAT, tv = bool_value(!(tv.f() == tv2.f())))
+            QUICKENED(CMP_GT_INT, CMP_GT, INT, tv = bool_value(tv.i() > tv2.i()))
+            QUICKENED(CMP_GT_FLOAT, CMP_GT, FLOAT, tv = bool_value(tv.f() > tv2.f()))
+            QUICKENED(CMP_LT_INT, CMP_LT, INT, tv = bool_value(tv.i() < tv2.i()))
+            QUICKENED(CMP_LT_FLOAT, CMP_LT, FLOAT, tv = bool_value(tv.f() < tv2.f()))
+            QUICKENED(CMP_GE_INT, CMP_GE, INT, tv = bool_value(tv.i() >= tv2.i()))
+            QUICKENED(CMP_GE_FLOAT, CMP_GE, FLOAT, tv = bool_value(!(tv.f() < tv2.f())))
+            QUICKENED(CMP_LE_INT, CMP_LE, INT, tv = bool_value(tv.i() <= tv2.i()))
+            QUICKENED(CMP_LE_FLOAT, CMP_LE, FLOAT, tv = bool_value(!(tv.f() > tv2.f())))
+#ifdef CUTE_FAST_DISPATCH
+            L_UNKNOWN:
+#else
             default:
-                throw vm_error("Unknown instruction %d", (*code)[pc - 1]);
+#endif
+                throw vm_error("Unknown instruction %d", bc[pc - 1]);
             }
         }
     }
     catch (vm_error & e)
     {
-        e.print();
+        if (err) *err = e.what();
+        else e.print();
+        // Coroutines that were running cannot be resumed
+        for (size_t i = depth; i < info.size(); i++)
+            if (coroutine * co = frame_coroutine(stack, info[i]))
+                co->value.state = coroutine_def::DONE;
+        info.resize(depth);
+        stack.resize(stack_size - arg_cnt - 1);
+        stack.push_back(nil_value());
+        return false;
     }
-    cleanup:
-    cleanup();
+    done:
+    return true;
+}
+
+// Resume the tasks of the event loop until every one has returned
+static bool run_tasks(vm_context & ctx)
+{
+    value_stack & stack = ctx.stack;
+    event_loop & loop = ctx.loop;
+    loop_task task;
+    while (loop_next(loop, task))
+    {
+        uint32_t arg_cnt = 0;
+        stack.push_back(task.co);
+        if (task.args.t() == ARRAY)
+        {
+            const arr_def & ad = task.args.a()->value;
+            arg_cnt = ad.size();
+            for (size_t i = 0; i < arg_cnt; i++)
+                stack.push_back(ad.get(i));
+        }
+        loop.current = task.co;
+        bool ok = execute(ctx, nullptr, 0, nullptr, nullptr, arg_cnt, nullptr);
+        loop.current = nil_value();
+        stack.pop_back();
+        if (!ok)
+            return false;
+        if (coroutine_of(task.co)->value.state != coroutine_def::DONE)
+            loop_park(loop, task.co);
+    }
+    return true;
+}
+
+namespace cute
+{
+
+vm::vm(): heap(new gc_heap), ctx(nullptr), saved(nullptr)
+{
+}
+
+vm::~vm()
+{
+    if (ctx) end();
+    for (auto & p : states)
+        delete p.second;
+    delete heap;
+}
+
+void vm::begin(bool use_jit)
+{
+    saved = gc_current;
+    gc_current = heap;
+    ctx = new vm_context{{}, {}, &states, use_jit && jit_supported(), {}, loop_current};
+    loop_current = &ctx->loop;
+    ctx->stack.push_back(new_empty_object());
+    obj_def & libs = ctx->stack[0].o()->value;
+    load_misc(libs);
+    load_io(libs);
+    load_math(libs);
+    load_str(libs);
+    load_arr(libs);
+    load_par(libs);
+    load_aio(libs);
+}
+
+void vm::keep(const type_and_value & tv)
+{
+    ctx->stack.push_back(tv);
+}
+
+bool vm::call(const type_and_value & fn, const type_and_value * args, uint32_t arg_cnt,
+              type_and_value & result, std::string & err)
+{
+    if (fn.t() != CLOSURE)
+    {
+        err = "Trying to call a value that is not a closure";
+        return false;
+    }
+    const closure_def & c = fn.c()->value;
+    if (c.native)
+    {
+        result = nil_value();
+        const char * msg = c.native(c, args, arg_cnt, result);
+        if (msg) err = msg;
+        return !msg;
+    }
+    value_stack & stack = ctx->stack;
+    stack.push_back(fn);
+    for (uint32_t i = 0; i < arg_cnt; i++)
+        stack.push_back(args[i]);
+    bool ok = execute(*ctx, c.s, c.addr, nullptr, c.super, arg_cnt, &err);
+    result = stack.back();
+    stack.pop_back();
+    return ok;
+}
+
+void vm::end()
+{
+    loop_current = ctx->saved_loop;
+    delete ctx;
+    ctx = nullptr;
+    gc_cleanup();
+    io_flush();
+    gc_current = saved;
+}
+
+bool vm::run(const script & s, bool use_jit)
+{
+    begin(use_jit);
+    // Placeholder for the closure, the script body takes no arguments
+    ctx->stack.push_back(nil_value());
+    bool ok = execute(*ctx, &s, 0, new_closure_info(nullptr, new_empty_object()), nullptr, 0, nullptr);
+    if (ok)
+        ok = run_tasks(*ctx);
+    end();
+    return ok;
+}
+
+void vm::forget(const script & s)
+{
+    auto p = states.find(&s);
+    if (p == states.end()) return;
+    delete p->second;
+    states.erase(p);
+}
+
 }
 
 void dump_code(const script & s)
 {
     static const char * names[] =
     {
-        "LOAD",
-        "STORE",
-        "LOAD_SUPER",
-        "STORE_SUPER",
-        "LOAD_FIELD",
-        "STORE_FIELD",
-        "LOAD_ITEM",
-        "STORE_ITEM",
-        "PUSH_BINT",
-        "PUSH_WINT",
-        "PUSH_DWINT",
-        "PUSH_INT",
-        "PUSH_FLOAT",
-        "PUSH_STRING",
-        "PUSH_CLOSURE",
-        "PUSH_ARG",
-        "PUSH_SELF",
-        "PUSH_SUPER",
-        "NEW_ARRAY",
-        "POP",
-        "DUP",
-        "ADD",
-        "SUB",
-        "MUL",
-        "DIV",
-        "REM",
-        "POS",
-        "NEG",
-        "BAND",
-        "BOR",
-        "BXOR",
-        "BINV",
-        "SHL",
-        "SHR",
-        "USHR",
-        "CMP_EQ",
-        "CMP_NE",
-        "CMP_GT",
-        "CMP_LT",
-        "CMP_GE",
-        "CMP_LE",
-        "NOT",
-        "LEN",
-        "JUMP",
-        "JUMP_IF",
-        "JUMP_UNLESS",
-        "CALL",
-        "RETURN",
-        "IN",
-        "OUT",
-        "LOAD_LIB",
+#define X(op, args, imm) #op,
+        CUTE_INSTRUCTIONS(X)
+#undef X
     };
     auto & codes = s.code;
     auto & string_pool = s.string_pool;
     size_t idx = 0;
+    bool wide = false;
+    auto arg = [&]()
+    {
+        if (!wide)
+            return (uint32_t)codes.at(idx++);
+        uint32_t i = 0;
+        for (int n = 0; n < 4; n++)
+            i |= (uint32_t)codes.at(idx++) << (8 * n);
+        return i;
+    };
     while (idx < codes.size())
     {
         printf("%llu ", idx);
         uint8_t code = codes.at(idx++);
+        wide = code == WIDE;
+        if (wide)
+        {
+            printf("%s ", names[code]);
+            code = codes.at(idx++);
+        }
         switch (code)
         {
         case LOAD_ITEM:
@@ -922,23 +2200,42 @@ void dump_code(const script & s)
         case RETURN:
         case IN:
         case OUT:
+        case NEW_COROUTINE:
+        case YIELD:
             puts(names[code]);
             break;
         case LOAD:
         case STORE:
+        case PUSH_STRING:
+        case LOAD_LIB:
+            {
+                std::string name(string_pool.at(arg()));
+                printf("%s %s\n", names[code], name.c_str());
+            }
+            break;
         case LOAD_SUPER:
         case STORE_SUPER:
         case LOAD_FIELD:
         case STORE_FIELD:
-        case PUSH_STRING:
-        case LOAD_LIB:
-            printf("%s %s\n", names[code], string_pool.at(codes.at(idx++)).c_str());
+            {
+                std::string name(string_pool.at(arg()));
+                printf("%s %s %u\n", names[code], name.c_str(), arg());
+            }
             break;
         case PUSH_BINT:
+        case ADD_BINT:
+            printf("%s %d\n", names[code], (int8_t)codes.at(idx++));
+            break;
         case JUMP:
         case JUMP_IF:
         case JUMP_UNLESS:
-            printf("%s %d\n", names[code], (int8_t)codes.at(idx++));
+        case JUMP_UNLESS_EQ:
+        case JUMP_UNLESS_NE:
+        case JUMP_UNLESS_GT:
+        case JUMP_UNLESS_LT:
+        case JUMP_UNLESS_GE:
+        case JUMP_UNLESS_LE:
+            printf("%s %d\n", names[code], wide ? (int32_t)arg() : (int8_t)arg());
             break;
         case PUSH_WINT:
             {
@@ -971,12 +2268,22 @@ void dump_code(const script & s)
                 printf("%s %f\n", names[code], *(double *)&i);
             }
             break;
+        case LOAD_LOCAL_FIELD:
+            {
+                uint32_t slot = arg();
+                std::string name(string_pool.at(arg()));
+                printf("%s %u %s %u\n", names[code], slot, name.c_str(), arg());
+            }
+            break;
         case PUSH_CLOSURE:
         case PUSH_ARG:
         case PUSH_SUPER:
         case NEW_ARRAY:
         case CALL:
-            printf("%s %u\n", names[code], codes.at(idx++));
+        case ENTER:
+        case LOAD_LOCAL:
+        case STORE_LOCAL:
+            printf("%s %u\n", names[code], arg());
             break;
         default:
             printf("[Unknown: %u]\n", code);
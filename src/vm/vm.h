@@ -1,11 +1,27 @@
 #include <vector>
 #include <string>
+#include <string_view>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
 #include <unordered_map>
 
+enum gc_flag : uint8_t
+{
+    GC_MARKED = 1, // reached in the current collection
+    GC_OLD = 2, // survived a minor collection (tenured)
+    GC_REMEMBERED = 4, // old object in the remembered set
+    GC_PINNED = 8, // allocated outside the gc heap, never collected
+};
+
 struct gc_base_obj
 {
-    char gc_status;
+    uint8_t gc_flags;
     virtual ~gc_base_obj() {}
+    // Mark every gc object directly referenced by this one
+    virtual void gc_trace() {}
 };
 
 template<typename T>
@@ -14,21 +30,45 @@ struct gc_obj : gc_base_obj
     T value;
     template<typename ... Args>
     gc_obj(Args ... args): value(args ...) {}
+    void gc_trace() override;
 };
 
+template<typename T>
+void gc_obj<T>::gc_trace() {}
+
+// Read-only bytecode owned elsewhere, by the compiler or a mapped file
+struct code_view
+{
+    const uint8_t * ptr;
+    size_t len;
+
+    const uint8_t * data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return !len; }
+    uint8_t operator[](size_t i) const { return ptr[i]; }
+    uint8_t at(size_t i) const
+    {
+        if (i >= len) throw std::out_of_range("code_view::at");
+        return ptr[i];
+    }
+};
+
+// Code and strings are not owned by the script, see code_view
 struct script
 {
-    std::vector<uint8_t> code;
-    std::vector<std::string> string_pool;
+    code_view code;
+    std::vector<std::string_view> string_pool;
+    int cache_count;
+    bool verified; // verify_script already passed
 };
 
 struct type_and_value;
 
-typedef const std::string str_def;
+struct str_def;
 typedef gc_obj<str_def> str;
-typedef std::unordered_map<std::string, type_and_value> obj_def;
+struct obj_def;
 typedef gc_obj<obj_def> obj;
-typedef std::vector<type_and_value> arr_def;
+struct arr_def;
 typedef gc_obj<arr_def> arr;
 struct closure_def;
 typedef gc_obj<closure_def> closure;
@@ -37,9 +77,16 @@ typedef gc_obj<closure_info_def> closure_info;
 
 enum type {NIL, INT, FLOAT, BOOL, STRING, OBJECT, ARRAY, CLOSURE};
 
+typedef gc_obj<int64_t> big_int;
+
+// A value of any type. Always use the accessors and the *_value() functions
+// below, since the representation depends on CUTE_NAN_BOXING.
+#ifndef CUTE_NAN_BOXING
+// 16 bytes: the type followed by the payload. Compiled code (see jit.h)
+// relies on this layout.
 struct type_and_value
 {
-    type t;
+    type tag;
     union
     {
         int64_t i;
@@ -49,14 +96,484 @@ struct type_and_value
         obj * o;
         arr * a;
         closure * c;
-    } v;
+    } val;
+
+    type t() const { return tag; }
+    int64_t i() const { return val.i; }
+    double f() const { return val.f; }
+    bool b() const { return val.b; }
+    str * s() const { return val.s; }
+    obj * o() const { return val.o; }
+    arr * a() const { return val.a; }
+    closure * c() const { return val.c; }
+    big_int * boxed() const { return nullptr; }
+    // Whether the value references a gc object
+    bool is_ref() const { return tag >= STRING; }
+};
+
+inline type_and_value nil_value() { return {NIL}; }
+inline type_and_value int_value(int64_t i) { return {INT, {.i = i}}; }
+inline type_and_value float_value(double f) { return {FLOAT, {.f = f}}; }
+inline type_and_value bool_value(bool b) { return {BOOL, {.i = b}}; }
+inline type_and_value string_value(str * s) { return {STRING, {.s = s}}; }
+inline type_and_value object_value(obj * o) { return {OBJECT, {.o = o}}; }
+inline type_and_value array_value(arr * a) { return {ARRAY, {.a = a}}; }
+inline type_and_value closure_value(closure * c) { return {CLOSURE, {.c = c}}; }
+#else
+// 8 bytes: a double, or a quiet NaN with the sign bit set that holds a
+// 3 bit tag and a 48 bit payload. Doubles that are NaN are stored as one of
+// two canonical NaNs outside that space, keeping their sign. Ints that do
+// not fit in 48 bits are boxed on the gc heap.
+struct type_and_value
+{
+    static constexpr uint64_t box = 0xFFF8000000000000;
+    static constexpr uint64_t payload = 0x0000FFFFFFFFFFFF;
+    static constexpr uint64_t nan = 0x7FF8000000000000;
+    static constexpr uint64_t negative_nan = 0xFFF4000000000000;
+    static constexpr uint64_t big_int_tag = FLOAT; // FLOAT itself is never tagged
+
+    uint64_t bits;
+
+    bool is_boxed() const { return (bits & box) == box; }
+    uint64_t tag() const { return bits >> 48 & 7; }
+    type t() const
+    {
+        if (!is_boxed()) return FLOAT;
+        uint64_t tg = tag();
+        return tg == big_int_tag ? INT : (type)tg;
+    }
+    int64_t i() const
+    {
+        if (tag() == big_int_tag) return ((big_int *)(bits & payload))->value;
+        return (int64_t)(bits << 16) >> 16;
+    }
+    double f() const
+    {
+        double f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+    bool b() const { return bits & 1; }
+    str * s() const { return (str *)(bits & payload); }
+    obj * o() const { return (obj *)(bits & payload); }
+    arr * a() const { return (arr *)(bits & payload); }
+    closure * c() const { return (closure *)(bits & payload); }
+    big_int * boxed() const
+    {
+        return is_boxed() && tag() == big_int_tag ? (big_int *)(bits & payload) : nullptr;
+    }
+    bool is_ref() const
+    {
+        return is_boxed() && (tag() == big_int_tag || tag() >= STRING);
+    }
+};
+
+inline type_and_value tagged_value(uint64_t tag, uint64_t payload)
+{
+    return {type_and_value::box | tag << 48 | (payload & type_and_value::payload)};
+}
+
+type_and_value new_big_int(int64_t i);
+
+inline type_and_value nil_value() { return tagged_value(NIL, 0); }
+inline type_and_value int_value(int64_t i)
+{
+    if ((int64_t)((uint64_t)i << 16) >> 16 != i)
+        return new_big_int(i);
+    return tagged_value(INT, i);
+}
+inline type_and_value float_value(double f)
+{
+    if (f != f)
+        return {std::signbit(f) ? type_and_value::negative_nan : type_and_value::nan};
+    type_and_value tv;
+    memcpy(&tv.bits, &f, sizeof(f));
+    return tv;
+}
+inline type_and_value bool_value(bool b) { return tagged_value(BOOL, b); }
+inline type_and_value string_value(str * s) { return tagged_value(STRING, (uintptr_t)s); }
+inline type_and_value object_value(obj * o) { return tagged_value(OBJECT, (uintptr_t)o); }
+inline type_and_value array_value(arr * a) { return tagged_value(ARRAY, (uintptr_t)a); }
+inline type_and_value closure_value(closure * c) { return tagged_value(CLOSURE, (uintptr_t)c); }
+#endif
+
+// Operand stack of the interpreter. Unlike std::vector its layout is fixed,
+// so compiled code (see jit.h) can push and pop by moving 'last' directly.
+struct value_stack
+{
+    type_and_value * first;
+    type_and_value * last;
+    type_and_value * limit;
+
+    value_stack(): first(nullptr), last(nullptr), limit(nullptr) {}
+    value_stack(const value_stack &) = delete;
+    ~value_stack() { free(first); }
+
+    size_t size() const { return last - first; }
+    void reserve(size_t n)
+    {
+        if (n <= (size_t)(limit - first)) return;
+        size_t sz = size();
+        size_t cap = std::max(n, 2 * (size_t)(limit - first));
+        first = (type_and_value *)realloc(first, cap * sizeof(type_and_value));
+        if (!first) throw std::bad_alloc();
+        last = first + sz;
+        limit = first + cap;
+    }
+    void push_back(const type_and_value & tv)
+    {
+        type_and_value v = tv; // tv may live in the stack itself
+        if (last == limit) reserve(size() + 1);
+        *last++ = v;
+    }
+    void pop_back() { --last; }
+    void resize(size_t n, const type_and_value & tv = nil_value())
+    {
+        type_and_value v = tv;
+        reserve(n);
+        while (last < first + n) *last++ = v;
+        last = first + n;
+    }
+    type_and_value & back() { return last[-1]; }
+    type_and_value & operator[](size_t i) { return first[i]; }
+    type_and_value & at(size_t i)
+    {
+        if (i >= size()) throw std::out_of_range("value_stack::at");
+        return first[i];
+    }
+    const type_and_value * begin() const { return first; }
+    const type_and_value * end() const { return last; }
+};
+
+// Interned strings are unique per content, so they can be compared by
+// pointer. They are pinned and live as long as the interpreter.
+//
+// Concatenating long strings makes a rope node that only points to both
+// halves. The node is flattened in place the first time its characters are
+// needed, so building a string by appending stays linear.
+//
+// A slice refers to characters kept alive by another gc object, such as a
+// mapped file, instead of owning a copy.
+struct str_def
+{
+    mutable std::string buf;
+    mutable std::string_view chars; // into buf or the owner, only the size is set in ropes
+    mutable str * left; // both nullptr once flat
+    mutable str * right;
+    gc_base_obj * owner;
+    mutable size_t hash;
+    bool interned;
+
+    str_def(std::string_view data): buf(data), chars(buf), left(nullptr), right(nullptr), owner(nullptr), hash(0), interned(false) {}
+    str_def(str * left, str * right);
+    str_def(gc_base_obj * owner, std::string_view chars): chars(chars), left(nullptr), right(nullptr), owner(owner), hash(0), interned(false) {}
+    str_def(const str_def &) = delete;
+    size_t size() const { return chars.size(); }
+    std::string_view data() const
+    {
+        if (left) flatten();
+        return chars;
+    }
+    void flatten() const;
+    size_t get_hash() const
+    {
+        if (!hash)
+            hash = std::hash<std::string_view>()(data()) | 1;
+        return hash;
+    }
+};
+
+struct str_hash
+{
+    size_t operator()(str * s) const;
+};
+
+struct str_equal
+{
+    bool operator()(str * s1, str * s2) const;
+};
+
+str * intern(std::string_view s);
+str * find_interned(str * s);
+
+// Open addressing hash map keyed by strings, for object properties and
+// shapes. Entries keep the hash of their key, so probing past other keys
+// compares integers without touching the strings. Linear probing in a power
+// of two table; erasing shifts the rest of the run back, leaving no
+// tombstones.
+template<typename V>
+struct str_map
+{
+    struct entry
+    {
+        str * key; // nullptr when free
+        size_t hash;
+        V value;
+    };
+
+    entry * table;
+    uint32_t mask; // capacity - 1
+    uint32_t count;
+
+    str_map(): table(nullptr), mask(0), count(0) {}
+    str_map(const str_map & m): str_map() { *this = m; }
+    ~str_map() { delete[] table; }
+    str_map & operator=(const str_map & m)
+    {
+        if (this == &m) return *this;
+        delete[] table;
+        table = nullptr;
+        mask = m.mask;
+        count = m.count;
+        if (m.table)
+        {
+            table = new entry[mask + 1];
+            std::copy(m.table, m.table + mask + 1, table);
+        }
+        return *this;
+    }
+
+    size_t size() const { return count; }
+
+    V * find(str * key) const
+    {
+        entry * e = find_entry(key);
+        return e ? &e->value : nullptr;
+    }
+
+    // Value for key, inserted as V() if missing
+    V & operator[](str * key)
+    {
+        // Keep at most 3/4 of the entries used, runs get long above that
+        if ((count + 1) * 4 > (mask + 1) * 3)
+            grow();
+        size_t hash = key->value.get_hash();
+        for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+        {
+            entry & e = table[i];
+            if (!e.key)
+            {
+                e.key = key;
+                e.hash = hash;
+                e.value = V();
+                count++;
+                return e.value;
+            }
+            if (e.hash == hash && str_equal()(e.key, key)) return e.value;
+        }
+    }
+
+    void erase(str * key)
+    {
+        entry * e = find_entry(key);
+        if (!e) return;
+        uint32_t i = e - table;
+        for (uint32_t j = (i + 1) & mask; table[j].key; j = (j + 1) & mask)
+        {
+            // Move back entries whose home is not between the hole and them
+            uint32_t home = table[j].hash & mask;
+            if (((j - home) & mask) >= ((j - i) & mask))
+            {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i].key = nullptr;
+        count--;
+    }
+
+    // Iteration skips free entries
+    struct iterator
+    {
+        entry * e;
+        entry * last;
+
+        entry & operator*() const { return *e; }
+        entry * operator->() const { return e; }
+        bool operator!=(const iterator & it) const { return e != it.e; }
+        iterator & operator++()
+        {
+            while (++e != last && !e->key);
+            return *this;
+        }
+    };
+
+    iterator begin() const
+    {
+        iterator it{table, table + (table ? mask + 1 : 0)};
+        if (it.e != it.last && !it.e->key) ++it;
+        return it;
+    }
+    iterator end() const
+    {
+        entry * last = table + (table ? mask + 1 : 0);
+        return {last, last};
+    }
+
+private:
+    entry * find_entry(str * key) const
+    {
+        if (!count) return nullptr;
+        size_t hash = key->value.get_hash();
+        for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+        {
+            entry & e = table[i];
+            if (!e.key) return nullptr;
+            if (e.hash == hash && str_equal()(e.key, key)) return &e;
+        }
+    }
+
+private:
+    void grow()
+    {
+        entry * old = table;
+        uint32_t old_cap = table ? mask + 1 : 0;
+        uint32_t cap = old_cap ? old_cap * 2 : 8;
+        table = new entry[cap]();
+        mask = cap - 1;
+        for (entry * e = old; e < old + old_cap; e++)
+        {
+            if (!e->key) continue;
+            uint32_t i = e->hash & mask;
+            while (table[i].key) i = (i + 1) & mask;
+            table[i] = *e;
+        }
+        delete[] old;
+    }
+};
+
+// Hidden class shared by objects that got the same properties added in the
+// same order. A shape maps property names to indices in obj_def::slots.
+struct shape
+{
+    static const uint32_t max_size = 64;
+
+    shape * parent;
+    str_map<uint32_t> index; // keys are interned
+    std::unordered_map<str *, shape *> transitions;
+
+    shape(shape * parent = nullptr): parent(parent) {}
+    ~shape();
+    shape * add(str * key);
+    uint32_t size() const { return index.size(); }
+};
+
+// Of the current heap, see gc.h
+shape * root_shape();
+
+// Slots of an object in shape mode. The first few live in the object
+// itself, so scopes with a handful of locals take no extra allocation.
+struct slot_vector
+{
+    static const uint32_t inline_size = 4;
+
+    type_and_value * first;
+    uint32_t count;
+    uint32_t cap;
+    type_and_value local[inline_size];
+
+    slot_vector(): first(local), count(0), cap(inline_size) {}
+    slot_vector(const slot_vector &) = delete;
+    ~slot_vector() { if (first != local) free(first); }
+
+    size_t size() const { return count; }
+    type_and_value * data() { return first; }
+    const type_and_value * data() const { return first; }
+    type_and_value & operator[](size_t i) { return first[i]; }
+    const type_and_value & operator[](size_t i) const { return first[i]; }
+    void push_back(const type_and_value & tv)
+    {
+        if (count == cap)
+        {
+            type_and_value * p = (type_and_value *)malloc(2 * cap * sizeof(type_and_value));
+            if (!p) throw std::bad_alloc();
+            memcpy(p, first, count * sizeof(type_and_value));
+            if (first != local) free(first);
+            first = p;
+            cap *= 2;
+        }
+        first[count++] = tv;
+    }
+    // Drop the slots and any storage outside the object
+    void clear()
+    {
+        if (first != local) free(first);
+        first = local;
+        count = 0;
+        cap = inline_size;
+    }
+    const type_and_value * begin() const { return first; }
+    const type_and_value * end() const { return first + count; }
 };
 
+// Objects start in shape mode and switch to dictionary mode for good once a
+// property is deleted, they grow too large or get a computed key that was
+// never interned, i.e. when used as hash maps
+struct obj_def
+{
+    typedef str_map<type_and_value> dict_def;
+
+    shape * sh; // nullptr in dictionary mode
+    slot_vector slots;
+    dict_def dict;
+
+    obj_def(): sh(root_shape()) {}
+    obj_def(const obj_def &) = delete;
+
+    const type_and_value * find(str * key) const;
+    void set(str * key, const type_and_value & tv);
+    void set(const std::string & key, const type_and_value & tv) { set(intern(key), tv); }
+    void erase(str * key);
+    size_t size() const { return sh ? slots.size() : dict.size(); }
+    void to_dict();
+};
+
+// Arrays keep their elements unboxed while all of them are INT, FLOAT or
+// BOOL, in the vector matching the kind. Storing anything else switches the
+// array to generic storage for good.
+struct arr_def
+{
+    enum kind_t : uint8_t {INTS, FLOATS, BOOLS, VALUES};
+
+    kind_t kind;
+    std::vector<int64_t> ints;
+    std::vector<double> floats;
+    std::vector<uint8_t> bools;
+    std::vector<type_and_value> values;
+
+    arr_def(const type_and_value * begin, const type_and_value * end);
+    size_t size() const;
+    type_and_value get(size_t idx) const;
+    void set(size_t idx, const type_and_value & tv);
+    void push(const type_and_value & tv);
+    // Grow or shrink to n elements, new ones are tv
+    void resize(size_t n, const type_and_value & tv);
+    // Remove and return the last element, nil if there is none
+    type_and_value pop();
+    // Make every element tv, the kind follows tv
+    void fill(const type_and_value & tv);
+    void to_values();
+};
+
+// Called by CALL with the arguments in place on the operand stack. Stores
+// the return value in result and returns an error message, nullptr on
+// success. Must not collect garbage or call back into the VM.
+typedef const char * (* native_fn)(const closure_def & fn, const type_and_value * args, uint32_t arg_cnt, type_and_value & result);
+
+// Returned by a native to suspend the task of the event loop that called
+// it, see loop.h. Fails like other errors outside of tasks.
+extern const char native_suspend[];
+
+// Closures run bytecode of a script at addr, native functions a C++
+// function given the gc object it was bound to, if any. Coroutines have
+// neither, calling them resumes the coroutine held in data.
 struct closure_def
 {
     closure_info * super;
-    const script * s;
+    const script * s; // nullptr for native functions
     int addr;
+    native_fn native;
+    gc_base_obj * data;
 };
 
 struct closure_info_def
@@ -65,66 +582,187 @@ struct closure_info_def
     type_and_value self;
 };
 
+template<> void gc_obj<str_def>::gc_trace();
+template<> void gc_obj<obj_def>::gc_trace();
+template<> void gc_obj<arr_def>::gc_trace();
+template<> void gc_obj<closure_def>::gc_trace();
+template<> void gc_obj<closure_info_def>::gc_trace();
+
+// X(name, operands, immediate bytes). Operands take one byte, or four bytes
+// each (little endian) when the instruction is prefixed with WIDE, so common
+// code stays compact. Immediates always have the given size.
+//
+// The instructions after WIDE are never emitted. The interpreter rewrites
+// generic arithmetic and comparisons into them, in its own copy of the code,
+// once it has seen the operand types at that place.
+#define CUTE_INSTRUCTIONS(X)                                 \
+    X(LOAD, 1, 0) /* string (push) */                        \
+    X(STORE, 1, 0) /* string (pop) */                        \
+    X(LOAD_SUPER, 2, 0) /* string cache (push) */            \
+    X(STORE_SUPER, 2, 0) /* string cache (pop) */            \
+    X(LOAD_FIELD, 2, 0) /* string cache (pop push) */        \
+    X(STORE_FIELD, 2, 0) /* string cache (pop pop) */        \
+    X(LOAD_ITEM, 0, 0) /* (pop pop push) */                  \
+    X(STORE_ITEM, 0, 0) /* (pop pop pop) */                  \
+    X(PUSH_BINT, 0, 1) /* byte (push) */                     \
+    X(PUSH_WINT, 0, 2) /* word (push) */                     \
+    X(PUSH_DWINT, 0, 4) /* dword (push) */                   \
+    X(PUSH_INT, 0, 8) /* int (push) */                       \
+    X(PUSH_FLOAT, 0, 8) /* float (push) */                   \
+    X(PUSH_STRING, 1, 0) /* string (push) */                 \
+    X(PUSH_CLOSURE, 1, 0) /* uint (push) */                  \
+    X(PUSH_ARG, 1, 0) /* uint (push) */                      \
+    X(PUSH_SELF, 0, 0) /* (push) */                          \
+    X(PUSH_SUPER, 1, 0) /* uint (push) */                    \
+    X(NEW_ARRAY, 1, 0) /* uint (pop*n push) */               \
+    X(POP, 0, 0) /* (pop) */                                 \
+    X(DUP, 0, 0) /* (pop push push) */                       \
+    X(ADD, 0, 0)                                             \
+    X(SUB, 0, 0)                                             \
+    X(MUL, 0, 0)                                             \
+    X(DIV, 0, 0)                                             \
+    X(REM, 0, 0)                                             \
+    X(POS, 0, 0)                                             \
+    X(NEG, 0, 0)                                             \
+    X(BAND, 0, 0)                                            \
+    X(BOR, 0, 0)                                             \
+    X(BXOR, 0, 0)                                            \
+    X(BINV, 0, 0)                                            \
+    X(SHL, 0, 0)                                             \
+    X(SHR, 0, 0)                                             \
+    X(USHR, 0, 0)                                            \
+    X(CMP_EQ, 0, 0)                                          \
+    X(CMP_NE, 0, 0)                                          \
+    X(CMP_GT, 0, 0)                                          \
+    X(CMP_LT, 0, 0)                                          \
+    X(CMP_GE, 0, 0)                                          \
+    X(CMP_LE, 0, 0)                                          \
+    X(NOT, 0, 0)                                             \
+    X(LEN, 0, 0)                                             \
+    X(JUMP, 1, 0) /* offset */                               \
+    X(JUMP_IF, 1, 0) /* offset (pop) */                      \
+    X(JUMP_UNLESS, 1, 0) /* offset (pop) */                  \
+    X(CALL, 1, 0) /* uint (pop) */                           \
+    X(RETURN, 0, 0) /* (pop pop*n push) */                   \
+    X(IN, 0, 0) /* (push) */                                 \
+    X(OUT, 0, 0) /* (pop) */                                 \
+    X(LOAD_LIB, 1, 0) /* string (push) */                    \
+    X(ENTER, 1, 0) /* uint (push*n) */                       \
+    X(LOAD_LOCAL, 1, 0) /* uint (push) */                    \
+    X(STORE_LOCAL, 1, 0) /* uint (pop) */                    \
+    X(LOAD_LOCAL_FIELD, 3, 0) /* uint string cache (push) */ \
+    X(ADD_BINT, 0, 1) /* byte (pop push) */                  \
+    X(JUMP_UNLESS_EQ, 1, 0) /* offset (pop pop) */           \
+    X(JUMP_UNLESS_NE, 1, 0) /* offset (pop pop) */           \
+    X(JUMP_UNLESS_GT, 1, 0) /* offset (pop pop) */           \
+    X(JUMP_UNLESS_LT, 1, 0) /* offset (pop pop) */           \
+    X(JUMP_UNLESS_GE, 1, 0) /* offset (pop pop) */           \
+    X(JUMP_UNLESS_LE, 1, 0) /* offset (pop pop) */           \
+    X(NEW_COROUTINE, 0, 0) /* (pop push) */                  \
+    X(YIELD, 0, 0) /* (pop) */                               \
+    X(WIDE, 0, 0) /* prefix, 4 byte operands follow */       \
+    X(ADD_INT, 0, 0)                                         \
+    X(ADD_FLOAT, 0, 0)                                       \
+    X(ADD_STR, 0, 0)                                         \
+    X(SUB_INT, 0, 0)                                         \
+    X(SUB_FLOAT, 0, 0)                                       \
+    X(MUL_INT, 0, 0)                                         \
+    X(MUL_FLOAT, 0, 0)                                       \
+    X(CMP_EQ_INT, 0, 0)                                      \
+    X(CMP_EQ_FLOAT, 0, 0)                                    \
+    X(CMP_NE_INT, 0, 0)                                      \
+    X(CMP_NE_FLOAT, 0, 0)                                    \
+    X(CMP_GT_INT, 0, 0)                                      \
+    X(CMP_GT_FLOAT, 0, 0)                                    \
+    X(CMP_LT_INT, 0, 0)                                      \
+    X(CMP_LT_FLOAT, 0, 0)                                    \
+    X(CMP_GE_INT, 0, 0)                                      \
+    X(CMP_GE_FLOAT, 0, 0)                                    \
+    X(CMP_LE_INT, 0, 0)                                      \
+    X(CMP_LE_FLOAT, 0, 0)
+
 enum instruction : uint8_t
 {
-    LOAD, // string (push)
-    STORE, // string (pop)
-    LOAD_SUPER, // string (push)
-    STORE_SUPER, // string (pop)
-    LOAD_FIELD, // string (pop push)
-    STORE_FIELD, // string (pop pop)
-    LOAD_ITEM, // (pop pop push)
-    STORE_ITEM, // (pop pop pop)
-    PUSH_BINT, // byte (push)
-    PUSH_WINT, // word (push)
-    PUSH_DWINT, // dword (push)
-    PUSH_INT, // int (push)
-    PUSH_FLOAT, // float (push)
-    PUSH_STRING, // string (push)
-    PUSH_CLOSURE, // ubyte (push)
-    PUSH_ARG, // ubyte (push)
-    PUSH_SELF, // (push)
-    PUSH_SUPER, // ubyte (push)
-    NEW_ARRAY, // ubyte (pop*n push)
-    POP, // (pop)
-    DUP, // (pop push push)
-    ADD,
-    SUB,
-    MUL,
-    DIV,
-    REM,
-    POS,
-    NEG,
-    BAND,
-    BOR,
-    BXOR,
-    BINV,
-    SHL,
-    SHR,
-    USHR,
-    CMP_EQ,
-    CMP_NE,
-    CMP_GT,
-    CMP_LT,
-    CMP_GE,
-    CMP_LE,
-    NOT,
-    LEN,
-    JUMP, // byte
-    JUMP_IF, // byte (pop)
-    JUMP_UNLESS, // byte (pop)
-    CALL, // ubyte (pop)
-    RETURN, // (pop pop*n push)
-    IN, // (push)
-    OUT, // (pop)
-    LOAD_LIB, // string (push)
-};
-
-type_and_value new_string(const std::string & str);
+#define X(op, args, imm) op,
+    CUTE_INSTRUCTIONS(X)
+#undef X
+};
+
+type_and_value new_string(std::string_view str);
+// String of chars, which must live as long as owner
+type_and_value new_string_slice(gc_base_obj * owner, std::string_view chars);
+type_and_value concat_strings(str * s1, str * s2);
 type_and_value new_empty_object();
-type_and_value new_array(arr_def::const_iterator begin, arr_def::const_iterator end);
+type_and_value new_array(const type_and_value * begin, const type_and_value * end);
 type_and_value new_closure(closure_info * super, const script * s, int addr);
+type_and_value new_native(native_fn fn, gc_base_obj * data = nullptr);
+// Coroutine running fn, which must be a closure of a script
+type_and_value new_coroutine(const type_and_value & fn);
 closure_info * new_closure_info(closure_info * super, const type_and_value & self);
 
-void run_script(const script & s);
+void verify_script(const script & s);
+// Same as verify_script, but prints the error and returns false
+bool check_script(const script & s);
 void dump_code(const script & s);
+
+// What a closure uses of the scopes around it, itself or through the
+// closures it creates: the names it reads or writes with '$', or the whole
+// scope object when it is used as a value.
+struct scope_use
+{
+    bool whole = false;
+    std::vector<std::string_view> names;
+};
+// For every closure of a verified script by address, the uses of the scope
+// one level up first. Scopes past the end of the vector are not used.
+std::unordered_map<int, std::vector<scope_use>> scope_uses(const script & s);
+
+struct gc_heap;
+struct script_state;
+struct vm_context;
+
+namespace cute
+{
+
+// An interpreter with a heap of its own, so that several can live in one
+// process. A thread runs one vm at a time, vms on different threads are
+// independent.
+//
+// A vm can run scripts any number of times and stays warm in between: it
+// keeps interned strings, shapes, and the quickened code, inline caches
+// and compiled code of every script it ran. What a run allocates is freed
+// when it ends. Scripts must outlive the vm, or be dropped with forget()
+// before they are freed.
+class vm
+{
+public:
+    vm();
+    vm(const vm &) = delete;
+    ~vm();
+
+    // Runs the script and then the tasks of its event loop, see loop.h.
+    // Prints the error and returns false if the script fails.
+    bool run(const script & s, bool use_jit = false);
+    void forget(const script & s);
+
+    // Calls between begin() and end() share one run: the heap is current,
+    // the libraries are loaded once and end() frees what the calls left.
+    // A value returned by call() lives until the next call, values given
+    // to keep() until end(). Closures from other heaps have to be copied
+    // in first, see marshal.h. Tasks are not run, calling a coroutine
+    // resumes it until it yields.
+    void begin(bool use_jit = false);
+    void keep(const type_and_value & tv);
+    // Returns false with the message in err if fn fails
+    bool call(const type_and_value & fn, const type_and_value * args, uint32_t arg_cnt,
+              type_and_value & result, std::string & err);
+    void end();
+
+private:
+    gc_heap * heap;
+    std::unordered_map<const script *, script_state *> states;
+    vm_context * ctx; // between begin() and end()
+    gc_heap * saved; // current heap before begin()
+};
+
+}
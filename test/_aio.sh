@@ -0,0 +1,5 @@
+# Runs the @aio tasks in every mode, each with a socket of its own in $TMP
+for mode in "" -O0 --jit; do
+    echo "$TMP/aio$mode.sock" | "$CUTE" $mode _aio_tasks.cute
+done
+"$CUTE" -c _aio_tasks.cute -o "$TMP/aio.cutec" && echo "$TMP/aioc.sock" | "$CUTE" "$TMP/aio.cutec"
@@ -0,0 +1,7 @@
+# Runs printing 100000 lines each on four threads. Every run's output must
+# come out in one piece, from its first line to the "end" on its last.
+"$CUTE" -j 4 -n 4 _batch_a.cute _batch_b.cute | awk '
+    cur == "" { cur = $1; n = 0 }
+    { if ($1 != cur) bad++; n++ }
+    $2 == "end" { runs++; if (n != 100000) bad++; cur = "" }
+    END { print runs " runs, " bad + 0 " interleaved" }'
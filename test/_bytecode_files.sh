@@ -0,0 +1,17 @@
+# A hand written bytecode file runs, and malformed ones are rejected when
+# loading, before any of their code runs:
+#
+# _good, and _bad_version, _bad_checksum with the same code:
+#                  ENTER 0; PUSH_BINT 1; OUT; PUSH_SELF; RETURN
+# _bad_truncated:  one string in the pool whose characters are missing
+# _bad_opcode:     ENTER 0; 200; PUSH_SELF; RETURN
+# _bad_slot:       ENTER 1; PUSH_BINT 1; STORE_LOCAL 1; PUSH_SELF; RETURN
+# _bad_underflow:  ENTER 0; POP; PUSH_SELF; RETURN
+# _bad_depth:      ENTER 0; PUSH_BINT 1; JUMP 2
+# _bad_return:     ENTER 0; PUSH_SELF; PUSH_SELF; RETURN
+for name in _good _bad_version _bad_checksum _bad_truncated _bad_opcode \
+        _bad_slot _bad_underflow _bad_depth _bad_return; do
+    "$CUTE" $name.cutec
+    echo "exit $?"
+done
+"$CUTE" -d _good.cutec
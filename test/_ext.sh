@@ -0,0 +1,6 @@
+# Builds the extension in _ext_sample.c and loads it from a CUTE_PATH
+# directory. Without CUTE_PATH the current directory is not searched.
+cc -shared -fPIC -I ../src/include -o "$TMP/libcute_sample.so" _ext_sample.c || exit 1
+DIR=$(pwd)
+CUTE_PATH=/nonexistent:"$TMP" "$CUTE" _ext_sample.cute
+(cd "$TMP" && unset CUTE_PATH && "$CUTE" "$DIR/_ext_sample.cute")
@@ -0,0 +1,51 @@
+/* Extension loaded by _ext.sh as @sample */
+#include <string.h>
+#include "cute_ext.h"
+
+static const cute_api * api;
+
+static const char * add(const cute_value * args, uint32_t arg_cnt, cute_value * result)
+{
+    if (arg_cnt != 2 || api->type(&args[0]) != CUTE_INT || api->type(&args[1]) != CUTE_INT)
+        return "add expects two ints";
+    api->set_int(result, api->get_int(&args[0]) + api->get_int(&args[1]));
+    return NULL;
+}
+
+static const char * greet(const cute_value * args, uint32_t arg_cnt, cute_value * result)
+{
+    char buf[64] = "hello, ";
+    size_t len;
+    const char * s = arg_cnt ? api->get_string(&args[0], &len) : "";
+    if (!arg_cnt || len > sizeof(buf) - 8)
+        return "greet expects a short string";
+    memcpy(buf + 7, s, len);
+    api->set_string(result, buf, 7 + len);
+    return NULL;
+}
+
+static const char * sum(const cute_value * args, uint32_t arg_cnt, cute_value * result)
+{
+    double total = 0;
+    size_t n = arg_cnt ? api->array_size(&args[0]) : 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        cute_value v;
+        api->array_get(&args[0], i, &v);
+        total += api->type(&v) == CUTE_INT ? api->get_int(&v) : api->get_float(&v);
+    }
+    api->set_float(result, total);
+    return NULL;
+}
+
+const char * cute_ext_init(const cute_api * a, cute_module * m)
+{
+    cute_value answer;
+    api = a;
+    api->add_function(m, "add", add);
+    api->add_function(m, "greet", greet);
+    api->add_function(m, "sum", sum);
+    api->set_int(&answer, 42);
+    api->add_value(m, "answer", &answer);
+    return NULL;
+}
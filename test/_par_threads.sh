@@ -0,0 +1,5 @@
+# Thread counts out of range are clamped, the pool always has 1 to 1024
+for n in -1 0 x 3 100000000000; do
+    echo "<< @par.reduce([1, 2, 3, 4, 5], @{ > x, y; < x + y; }, 0);" > "$TMP/threads.cute"
+    CUTE_PAR_THREADS=$n "$CUTE" "$TMP/threads.cute"
+done
@@ -0,0 +1,25 @@
+# >> reads whitespace separated tokens of any length through the input
+# buffer, and output is flushed in order even when the script fails.
+cat > "$TMP/stdio.cute" <<'CUTE'
+>> n;
+n = @str.to_int(n);
+sum = 0;
+i = 0;
+:{ >> x; $sum = $sum + @str.to_int(x); $i = $i + 1; < $i < $n; };
+<< sum;
+>> long;
+<< #long;
+>> last;
+<< last;
+<< 1 + "fail";
+CUTE
+{
+    echo 20000
+    i=1
+    while [ $i -le 20000 ]; do
+        echo "$i"
+        i=$((i + 1))
+    done
+    head -c 100000 /dev/zero | tr '\0' 'x'
+    printf ' \t\n  end'
+} | "$CUTE" "$TMP/stdio.cute"
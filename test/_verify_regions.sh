@@ -0,0 +1,12 @@
+# Bytecode files whose local slots are only in range for the ENTER of
+# another closure, which the verifier must reject:
+#
+# _bad_jump_over_enter:   ENTER 0; JUMP 10; WIDE ENTER 0x1000000;
+#                         PUSH_BINT 1; WIDE STORE_LOCAL 0xffffff; PUSH_SELF; RETURN
+# _bad_jump_into_closure: ENTER 0; PUSH_CLOSURE 9; POP; JUMP 15; PUSH_SELF; RETURN;
+#                         WIDE ENTER 0x1000000; PUSH_BINT 1; WIDE STORE_LOCAL 0xffffff;
+#                         PUSH_SELF; RETURN
+for name in _bad_jump_over_enter _bad_jump_into_closure; do
+    "$CUTE" $name.cutec
+    echo "exit $?"
+done
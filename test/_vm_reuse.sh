@@ -0,0 +1,9 @@
+# One vm runs both scripts three times in turn. Globals of a run are gone
+# in the next one, and code quickened by earlier runs still works.
+"$CUTE" -j 1 -n 3 _vm_reuse_a.cute _vm_reuse_b.cute
+echo "exit $?"
+"$CUTE" -j 1 -n 2 --jit _vm_reuse_b.cute
+echo "exit $?"
+# A run that fails does not stop the others, the exit status reports it
+"$CUTE" -j 1 _jit.cute _vm_reuse_a.cute > "$TMP/reuse" && echo "exit 0" || echo "exit 1"
+tail -3 "$TMP/reuse"
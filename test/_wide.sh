@@ -0,0 +1,28 @@
+# A script past the old single byte limits: 300 strings in the pool, a loop
+# body much longer than 128 bytes of code and a string of 1000 characters.
+f=$TMP/wide.cute
+{
+    echo 'n = 0;'
+    echo 'i = 0;'
+    echo ':{'
+    k=0
+    while [ $k -lt 300 ]; do
+        echo "    \$n = \$n + #\"s$k\";"
+        k=$((k + 1))
+    done
+    echo '    $i = $i + 1;'
+    echo '    < $i < 3;'
+    echo '};'
+    echo '<< n;'
+    printf 's = "'
+    k=0
+    while [ $k -lt 100 ]; do
+        printf 'abcdefghij'
+        k=$((k + 1))
+    done
+    echo '";'
+    echo '<< #s;'
+} > "$f"
+"$CUTE" "$f"
+"$CUTE" -O0 "$f"
+"$CUTE" -c "$f" -o "$TMP/wide.cutec" && "$CUTE" "$TMP/wide.cutec"
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Runs the tests next to this script with the interpreter given as $1.
+#
+# name.cute with name.out runs in every mode (plain, -O0, --jit and from a
+# bytecode file) and must print name.out each time. name.sh with name.out
+# runs with $CUTE set to the interpreter and $TMP to a scratch directory,
+# for tests that need more than one script or special arguments.
+#
+# @par always gets a pool of 4 threads, even on a single core.
+
+CUTE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+DIR=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+CUTE_PAR_THREADS=4
+export CUTE TMP CUTE_PAR_THREADS
+failed=0
+
+check()
+{
+    if ! diff -u "$2" "$TMP/actual" > "$TMP/diff"; then
+        echo "FAIL: $1"
+        cat "$TMP/diff"
+        failed=1
+    fi
+}
+
+cd "$DIR"
+for out in *.out; do
+    name=${out%.out}
+    if [ -f "$name.sh" ]; then
+        sh "$name.sh" > "$TMP/actual" 2>&1
+        check "$name.sh" "$out"
+        continue
+    fi
+    for mode in "" -O0 --jit; do
+        "$CUTE" $mode "$name.cute" > "$TMP/actual" 2>&1
+        check "$name.cute $mode" "$out"
+    done
+    "$CUTE" -c "$name.cute" -o "$TMP/$name.cutec" > "$TMP/actual" 2>&1 &&
+        "$CUTE" "$TMP/$name.cutec" > "$TMP/actual" 2>&1
+    check "$name.cutec" "$out"
+done
+exit $failed